@@ -0,0 +1,331 @@
+#pragma once
+
+#include "body_store.h"
+#include "octree.h"
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// Barnes-Hut octree gravity (Barnes & Hut 1986), O(N log N) per evaluation.
+// The Octree is rebuilt on every call, then masses, centers of mass and optionally quadrupole moments are gathered
+// bottom-up one level at a time, the cells of a level in parallel.
+// A cell is accepted as a whole when the body is farther from its center of mass than s / theta + delta, s the cell
+// side and delta the offset of the center of mass from the cell center, which stays safe when the mass is lopsided.
+// Every leaf walks the tree once for all its bodies and collects an interaction list (Barnes 1990) that each of its
+// bodies then sums in flat loops the compiler can vectorize; leaves are walked in Morton order for locality and every
+// body's sum is taken in list order, so the result does not depend on the thread count.
+class BarnesHut {
+public:
+    double theta = 0.6;
+    bool quadrupole = false;
+    uint32_t leaf_size = 16;
+
+    // last evaluation
+    size_t node_count = 0;
+    size_t depth = 0;
+    uint64_t interactions = 0;
+    double build_seconds = 0;
+    double walk_seconds = 0;
+
+    // adds G times the acceleration of every body to ax, ay, az
+    void accumulate(const BodyStore& bodies, double G, double softening, double* ax, double* ay, double* az, ThreadPool& pool) {
+        evaluate(bodies, softening, pool);
+
+        size_t n = bodies.size();
+        pool.parallelFor(0, n, [&](size_t k) {
+            size_t i = octree.order[k];
+            ax[i] += G * qx[k];
+            ay[i] += G * qy[k];
+            az[i] += G * qz[k];
+        }, 4096);
+    }
+
+    // the potential from the same walk, taken from the last accumulate when the bodies have not moved since
+    double potentialEnergy(const BodyStore& bodies, double G, double softening, ThreadPool& pool) {
+        if (!cacheMatches(bodies, softening)) evaluate(bodies, softening, pool);
+
+        double energy = 0;
+        for (size_t k = 0; k < octree.size(); k++) energy += octree.m[k] * potential[k];
+        return 0.5 * G * energy;
+    }
+
+private:
+    struct Moments {
+        glm::dvec3 com;
+        double mass;
+        // squared distance from the center of mass beyond which the cell is taken as a whole
+        double open2;
+        // traceless quadrupole about the center of mass, xx, yy, zz, xy, xz, yz
+        double q[6];
+    };
+
+    Octree octree;
+    // per cell
+    std::vector<Moments> moments;
+    // results per sorted body, without G
+    std::vector<double> qx, qy, qz, potential;
+
+    // what the results in qx .. potential were computed for
+    bool cache_valid = false;
+    double cached_softening = 0;
+    double cached_theta = 0;
+    bool cached_quadrupole = false;
+
+    bool cacheMatches(const BodyStore& bodies, double softening) const {
+        if (!cache_valid || cached_softening != softening || cached_theta != theta || cached_quadrupole != quadrupole) return false;
+        return octree.holds(bodies);
+    }
+
+    void evaluate(const BodyStore& bodies, double softening, ThreadPool& pool) {
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point start = Clock::now();
+
+        build(bodies, pool);
+        Clock::time_point built = Clock::now();
+
+        walk(softening, pool);
+
+        build_seconds = std::chrono::duration<double>(built - start).count();
+        walk_seconds = std::chrono::duration<double>(Clock::now() - built).count();
+
+        cache_valid = true;
+        cached_softening = softening;
+        cached_theta = theta;
+        cached_quadrupole = quadrupole;
+    }
+
+    void build(const BodyStore& bodies, ThreadPool& pool) {
+        octree.build(bodies, leaf_size, pool);
+        moments.resize(octree.cells.size());
+
+        for (size_t level = octree.depth(); level-- > 0;) {
+            pool.parallelFor(octree.level_start[level], octree.level_start[level + 1], [&](size_t i) { gatherMoments(i); }, 64);
+        }
+        node_count = octree.cells.size();
+        depth = octree.depth();
+    }
+
+    void gatherMoments(size_t i) {
+        const Octree::Cell& cell = octree.cells[i];
+        const std::vector<double>& sx = octree.x;
+        const std::vector<double>& sy = octree.y;
+        const std::vector<double>& sz = octree.z;
+        const std::vector<double>& sm = octree.m;
+        Moments& node = moments[i];
+        double mass = 0;
+        glm::dvec3 weighted(0);
+
+        if (cell.leaf()) {
+            for (uint32_t k = cell.first_body; k < cell.first_body + cell.body_count; k++) {
+                mass += sm[k];
+                weighted += sm[k] * glm::dvec3(sx[k], sy[k], sz[k]);
+            }
+        } else {
+            for (uint32_t c = cell.first_child; c < cell.first_child + cell.child_count; c++) {
+                mass += moments[c].mass;
+                weighted += moments[c].mass * moments[c].com;
+            }
+        }
+
+        node.mass = mass;
+        node.com = mass > 0 ? weighted / mass : cell.center;
+
+        std::fill(node.q, node.q + 6, 0.0);
+        if (quadrupole) {
+            // Q = sum m (3 d d^T - |d|^2 I), the children's own moments shifted to the parent's center of mass
+            auto add = [&](double m, glm::dvec3 d) {
+                double d2 = glm::dot(d, d);
+                node.q[0] += m * (3 * d.x * d.x - d2);
+                node.q[1] += m * (3 * d.y * d.y - d2);
+                node.q[2] += m * (3 * d.z * d.z - d2);
+                node.q[3] += m * 3 * d.x * d.y;
+                node.q[4] += m * 3 * d.x * d.z;
+                node.q[5] += m * 3 * d.y * d.z;
+            };
+
+            if (cell.leaf()) {
+                for (uint32_t k = cell.first_body; k < cell.first_body + cell.body_count; k++) add(sm[k], glm::dvec3(sx[k], sy[k], sz[k]) - node.com);
+            } else {
+                for (uint32_t c = cell.first_child; c < cell.first_child + cell.child_count; c++) {
+                    for (int m = 0; m < 6; m++) node.q[m] += moments[c].q[m];
+                    add(moments[c].mass, moments[c].com - node.com);
+                }
+            }
+        }
+
+        double open = 2 * cell.half_size / theta + glm::length(node.com - cell.center);
+        node.open2 = open * open;
+    }
+
+    // sources one leaf's bodies feel, cells as a whole and the bodies of leaves opened near it
+    struct InteractionList {
+        std::vector<double> x, y, z, m;
+        // cells with their quadrupoles, only when the quadrupole term is on
+        std::vector<double> cx, cy, cz, cm, q[6];
+        // sums for the leaf's bodies
+        std::vector<double> ax, ay, az, phi;
+
+        void clear() {
+            for (std::vector<double>* v : {&x, &y, &z, &m, &cx, &cy, &cz, &cm}) v->clear();
+            for (std::vector<double>& v : q) v.clear();
+        }
+    };
+
+    void walk(double softening, ThreadPool& pool) {
+        size_t n = octree.size();
+        double eps2 = softening * softening;
+        qx.assign(n, 0.0);
+        qy.assign(n, 0.0);
+        qz.assign(n, 0.0);
+        potential.assign(n, 0.0);
+
+        const std::vector<uint32_t>& leaves = octree.leaves;
+        std::atomic<uint64_t> total(0);
+        size_t block = 32;
+        pool.parallelFor(0, (leaves.size() + block - 1) / block, [&](size_t b) {
+            InteractionList list;
+            uint64_t count = 0;
+            for (size_t l = b * block; l < std::min(leaves.size(), (b + 1) * block); l++) count += walkLeaf(octree.cells[leaves[l]], eps2, list);
+            total.fetch_add(count, std::memory_order_relaxed);
+        });
+        interactions = total.load();
+    }
+
+    // Walks the tree once for all bodies of a leaf, a cell is accepted when its center of mass is farther than the
+    // opening distance from every point of the leaf's bounding box, then sums the list for each body in flat loops.
+    // Returns the number of interactions.
+    uint64_t walkLeaf(const Octree::Cell& leaf, double eps2, InteractionList& list) {
+        const std::vector<double>& sx = octree.x;
+        const std::vector<double>& sy = octree.y;
+        const std::vector<double>& sz = octree.z;
+        const std::vector<double>& sm = octree.m;
+        uint32_t first = leaf.first_body;
+        uint32_t last = leaf.first_body + leaf.body_count;
+        uint32_t count = leaf.body_count;
+
+        glm::dvec3 low(sx[first], sy[first], sz[first]);
+        glm::dvec3 high = low;
+        for (uint32_t k = first + 1; k < last; k++) {
+            low = glm::min(low, glm::dvec3(sx[k], sy[k], sz[k]));
+            high = glm::max(high, glm::dvec3(sx[k], sy[k], sz[k]));
+        }
+
+        list.clear();
+
+        // at most seven siblings wait on each level
+        uint32_t stack[8 * (MortonGrid::levels + 2)];
+        int top = 0;
+        stack[top++] = 0;
+
+        while (top > 0) {
+            uint32_t i = stack[--top];
+            const Octree::Cell& cell = octree.cells[i];
+            const Moments& node = moments[i];
+            glm::dvec3 gap = glm::max(glm::max(low - node.com, node.com - high), glm::dvec3(0));
+
+            if (glm::dot(gap, gap) > node.open2) {
+                if (quadrupole) {
+                    list.cx.push_back(node.com.x);
+                    list.cy.push_back(node.com.y);
+                    list.cz.push_back(node.com.z);
+                    list.cm.push_back(node.mass);
+                    for (int m = 0; m < 6; m++) list.q[m].push_back(node.q[m]);
+                } else {
+                    list.x.push_back(node.com.x);
+                    list.y.push_back(node.com.y);
+                    list.z.push_back(node.com.z);
+                    list.m.push_back(node.mass);
+                }
+            } else if (cell.leaf()) {
+                list.x.insert(list.x.end(), sx.begin() + cell.first_body, sx.begin() + cell.first_body + cell.body_count);
+                list.y.insert(list.y.end(), sy.begin() + cell.first_body, sy.begin() + cell.first_body + cell.body_count);
+                list.z.insert(list.z.end(), sz.begin() + cell.first_body, sz.begin() + cell.first_body + cell.body_count);
+                list.m.insert(list.m.end(), sm.begin() + cell.first_body, sm.begin() + cell.first_body + cell.body_count);
+            } else {
+                for (uint32_t c = cell.first_child; c < cell.first_child + cell.child_count; c++) stack[top++] = c;
+            }
+        }
+
+        size_t sources = list.x.size();
+        size_t cells = list.cx.size();
+        const double* x = list.x.data();
+        const double* y = list.y.data();
+        const double* z = list.z.data();
+        const double* m = list.m.data();
+
+        // sources outside, the leaf's bodies inside: the inner loop updates independent sums and vectorizes without
+        // reordering any body's additions. The body itself is on the list, with softening it only adds -m / eps to
+        // its potential, which is taken back at the end.
+        const double* gx = sx.data() + first;
+        const double* gy = sy.data() + first;
+        const double* gz = sz.data() + first;
+        list.ax.assign(count, 0.0);
+        list.ay.assign(count, 0.0);
+        list.az.assign(count, 0.0);
+        list.phi.assign(count, 0.0);
+        double* ax = list.ax.data();
+        double* ay = list.ay.data();
+        double* az = list.az.data();
+        double* phi = list.phi.data();
+
+        for (size_t j = 0; j < sources; j++) {
+            double mj = m[j];
+            for (uint32_t k = 0; k < count; k++) {
+                double dx = x[j] - gx[k];
+                double dy = y[j] - gy[k];
+                double dz = z[j] - gz[k];
+                double s2 = dx * dx + dy * dy + dz * dz + eps2;
+                double inv_r = s2 > 0 ? 1 / std::sqrt(s2) : 0.0;
+                double m_inv_r = mj * inv_r;
+                double m_inv_r3 = m_inv_r * inv_r * inv_r;
+                ax[k] += m_inv_r3 * dx;
+                ay[k] += m_inv_r3 * dy;
+                az[k] += m_inv_r3 * dz;
+                phi[k] -= m_inv_r;
+            }
+        }
+
+        for (size_t j = 0; j < cells; j++) {
+            double mj = list.cm[j];
+            double q0 = list.q[0][j], q1 = list.q[1][j], q2 = list.q[2][j], q3 = list.q[3][j], q4 = list.q[4][j], q5 = list.q[5][j];
+            for (uint32_t k = 0; k < count; k++) {
+                // r from the center of mass to the body, a = -m r / r^3 + Q r / r^5 - 5/2 (r . Q r) r / r^7
+                double rx = gx[k] - list.cx[j];
+                double ry = gy[k] - list.cy[j];
+                double rz = gz[k] - list.cz[j];
+                double inv_r = 1 / std::sqrt(rx * rx + ry * ry + rz * rz + eps2);
+                double inv_r2 = inv_r * inv_r;
+                double inv_r3 = inv_r * inv_r2;
+                double inv_r5 = inv_r3 * inv_r2;
+
+                double qrx = q0 * rx + q3 * ry + q4 * rz;
+                double qry = q3 * rx + q1 * ry + q5 * rz;
+                double qrz = q4 * rx + q5 * ry + q2 * rz;
+                double rqr = rx * qrx + ry * qry + rz * qrz;
+
+                double radial = -mj * inv_r3 - 2.5 * rqr * inv_r5 * inv_r2;
+                ax[k] += radial * rx + inv_r5 * qrx;
+                ay[k] += radial * ry + inv_r5 * qry;
+                az[k] += radial * rz + inv_r5 * qrz;
+                phi[k] -= mj * inv_r + 0.5 * rqr * inv_r5;
+            }
+        }
+
+        double self = eps2 > 0 ? 1 / std::sqrt(eps2) : 0.0;
+        for (uint32_t k = 0; k < count; k++) {
+            qx[first + k] = ax[k];
+            qy[first + k] = ay[k];
+            qz[first + k] = az[k];
+            potential[first + k] = phi[k] + sm[first + k] * self;
+        }
+
+        return uint64_t(sources + cells - 1) * leaf.body_count;
+    }
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Struct-of-arrays storage for the simulated bodies.
+// Every quantity lives in its own contiguous double array so force loops stream through memory.
+class BodyStore {
+public:
+    std::vector<double> x, y, z;
+    std::vector<double> vx, vy, vz;
+    std::vector<double> ax, ay, az;
+    std::vector<double> mass;
+    // collision radius, point masses have 0 and only collide with bodies of some size
+    std::vector<double> radius;
+
+    static constexpr size_t npos = size_t(-1);
+
+    // accelerations are cached for the current positions until something moves the bodies
+    bool accelerations_valid = false;
+
+    size_t size() const {
+        return mass.size();
+    }
+
+    size_t addBody(double m, glm::dvec3 p, glm::dvec3 v, double r = 0) {
+        x.push_back(p.x); y.push_back(p.y); z.push_back(p.z);
+        vx.push_back(v.x); vy.push_back(v.y); vz.push_back(v.z);
+        ax.push_back(0); ay.push_back(0); az.push_back(0);
+        mass.push_back(m);
+        radius.push_back(r);
+
+        accelerations_valid = false;
+
+        return mass.size() - 1;
+    }
+
+    void clear() {
+        x.clear(); y.clear(); z.clear();
+        vx.clear(); vy.clear(); vz.clear();
+        ax.clear(); ay.clear(); az.clear();
+        mass.clear();
+        radius.clear();
+
+        accelerations_valid = false;
+    }
+
+    // drops the flagged bodies in one pass keeping the order of the rest,
+    // returns the new index of every old body, npos for the removed ones
+    std::vector<size_t> removeBodies(const std::vector<bool>& removed) {
+        std::vector<size_t> new_index(size(), npos);
+        size_t kept = 0;
+
+        for (size_t i = 0; i < size(); i++) {
+            if (removed[i]) continue;
+
+            for (std::vector<double>* component : {&x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az, &mass, &radius}) {
+                (*component)[kept] = (*component)[i];
+            }
+            new_index[i] = kept++;
+        }
+
+        for (std::vector<double>* component : {&x, &y, &z, &vx, &vy, &vz, &ax, &ay, &az, &mass, &radius}) {
+            component->resize(kept);
+        }
+
+        accelerations_valid = false;
+        return new_index;
+    }
+
+    glm::dvec3 position(size_t i) const {
+        return glm::dvec3(x[i], y[i], z[i]);
+    }
+
+    glm::dvec3 velocity(size_t i) const {
+        return glm::dvec3(vx[i], vy[i], vz[i]);
+    }
+
+    glm::dvec3 acceleration(size_t i) const {
+        return glm::dvec3(ax[i], ay[i], az[i]);
+    }
+
+    void setPosition(size_t i, glm::dvec3 p) {
+        x[i] = p.x; y[i] = p.y; z[i] = p.z;
+        accelerations_valid = false;
+    }
+
+    void setVelocity(size_t i, glm::dvec3 v) {
+        vx[i] = v.x; vy[i] = v.y; vz[i] = v.z;
+    }
+
+    double totalMass() const {
+        double total = 0;
+        for (double m : mass) total += m;
+        return total;
+    }
+
+    glm::dvec3 centerOfMass() const {
+        glm::dvec3 weighted(0);
+        for (size_t i = 0; i < size(); i++) weighted += mass[i] * position(i);
+        return weighted / totalMass();
+    }
+
+    glm::dvec3 centerOfMassVelocity() const {
+        glm::dvec3 weighted(0);
+        for (size_t i = 0; i < size(); i++) weighted += mass[i] * velocity(i);
+        return weighted / totalMass();
+    }
+
+    // FNV-1a over the bit patterns of every mass, position and velocity, equal hashes mean bit-identical states
+    uint64_t stateHash() const {
+        uint64_t hash = 14695981039346656037ull;
+
+        for (const std::vector<double>* component : {&mass, &x, &y, &z, &vx, &vy, &vz}) {
+            for (double value : *component) {
+                uint64_t bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+
+                for (int byte = 0; byte < 8; byte++) {
+                    hash ^= (bits >> (8 * byte)) & 0xff;
+                    hash *= 1099511628211ull;
+                }
+            }
+        }
+
+        return hash;
+    }
+};
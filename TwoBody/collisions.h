@@ -0,0 +1,336 @@
+#pragma once
+
+#include "body_store.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+enum class CollisionResolution {
+    Merge,
+    Bounce,
+    Fragment
+};
+
+// Continuous collision detection between the spheres of the body store, swept along straight lines from the
+// positions at begin() to the positions after the step, so fast bodies cannot tunnel through each other.
+// The broad phase is a uniform spatial hash over the swept bounding boxes: every box is entered into the cells
+// it covers, the (cell, body) entries are sorted by cell and only bodies sharing a cell are paired. A pair is
+// tested only in the cell holding the low corner of the overlap of the two boxes, so it is tested once however
+// many cells the two share. Boxes spanning more than a few cells, typically a planet among debris, are kept out
+// of the hash and checked against every body with a box test, which keeps the cost O(N log N) for the sort plus
+// O(N) per large body instead of O(N^2).
+// Contacts are resolved in order of time of impact, a body takes part in at most one contact per step.
+class CollisionHandler {
+public:
+    bool enabled = false;
+    CollisionResolution resolution = CollisionResolution::Merge;
+
+    // normal restitution of bounces, 1 is elastic
+    double restitution = 0.5;
+
+    // impacts faster than fragment_speed mutual escape speeds shed fragment_mass_fraction of the merged mass
+    // as fragment_count equal fragments, slower ones merge
+    double fragment_speed = 1.5;
+    double fragment_mass_fraction = 0.2;
+    int fragment_count = 8;
+
+    // boxes spanning more cells than this along an axis are checked outside the hash
+    int max_cells_per_axis = 4;
+
+    // statistics of the last step and totals since the handler was created
+    size_t pair_tests = 0;
+    size_t large_bodies = 0;
+    size_t contacts = 0;
+    uint64_t total_contacts = 0;
+
+    // new index of every body before the last resolve as BodyStore::removeBodies returns it, empty if none was removed
+    std::vector<size_t> new_index;
+
+    // positions at the start of a step
+    void begin(const BodyStore& bodies) {
+        x0 = bodies.x;
+        y0 = bodies.y;
+        z0 = bodies.z;
+    }
+
+    // resolves the contacts of a step of length dt taken since begin(), returns the number of contacts
+    size_t resolve(BodyStore& bodies, double G, double dt) {
+        findContacts(bodies);
+
+        contacts = 0;
+        new_index.clear();
+        if (found.empty()) return 0;
+
+        std::vector<bool> removed(bodies.size(), false);
+        std::vector<bool> touched(bodies.size(), false);
+        size_t count_before = bodies.size();
+
+        for (const Contact& contact : found) {
+            if (touched[contact.i] || touched[contact.j]) continue;
+            touched[contact.i] = touched[contact.j] = true;
+            contacts++;
+
+            switch (resolution) {
+            case CollisionResolution::Bounce:
+                bounce(bodies, contact, dt);
+                break;
+            case CollisionResolution::Fragment:
+                fragment(bodies, contact, G);
+                removed[contact.j] = true;
+                break;
+            default:
+                merge(bodies, contact.i, contact.j);
+                removed[contact.j] = true;
+                break;
+            }
+        }
+
+        total_contacts += contacts;
+        bodies.accelerations_valid = false;
+
+        if (resolution != CollisionResolution::Bounce) {
+            // fragments are appended after the flags were sized
+            removed.resize(bodies.size(), false);
+            new_index = bodies.removeBodies(removed);
+            new_index.resize(count_before);
+        }
+
+        return contacts;
+    }
+
+private:
+    struct Contact {
+        double t;
+        uint32_t i, j;
+
+        bool operator<(const Contact& other) const {
+            if (t != other.t) return t < other.t;
+            return i != other.i ? i < other.i : j < other.j;
+        }
+
+        bool operator==(const Contact& other) const {
+            return i == other.i && j == other.j;
+        }
+    };
+
+    struct Box {
+        glm::dvec3 low, high;
+    };
+
+    std::vector<double> x0, y0, z0;
+    std::vector<Box> boxes;
+    std::vector<std::pair<uint64_t, uint32_t>> entries;
+    std::vector<uint32_t> large;
+    std::vector<Contact> found;
+
+    glm::dvec3 start(size_t i) const {
+        return glm::dvec3(x0[i], y0[i], z0[i]);
+    }
+
+    static uint64_t cellKey(glm::i64vec3 cell) {
+        // 21 bits per axis, far cells may share a key which only costs extra box tests
+        const uint64_t mask = (1u << 21) - 1;
+        return (uint64_t(cell.x) & mask) << 42 | (uint64_t(cell.y) & mask) << 21 | (uint64_t(cell.z) & mask);
+    }
+
+    void findContacts(const BodyStore& bodies) {
+        size_t n = bodies.size();
+        found.clear();
+        entries.clear();
+        large.clear();
+        pair_tests = 0;
+        if (n < 2 || x0.size() != n) return;
+
+        boxes.resize(n);
+        double extent_sum = 0;
+        for (size_t i = 0; i < n; i++) {
+            glm::dvec3 a = start(i), b = bodies.position(i);
+            boxes[i].low = glm::min(a, b) - bodies.radius[i];
+            boxes[i].high = glm::max(a, b) + bodies.radius[i];
+
+            glm::dvec3 size = boxes[i].high - boxes[i].low;
+            extent_sum += std::max(size.x, std::max(size.y, size.z));
+        }
+
+        // cells twice the mean box size put a typical box in one to eight cells
+        double cell = 2 * extent_sum / double(n);
+        if (!(cell > 0)) return;
+
+        for (uint32_t i = 0; i < n; i++) {
+            glm::i64vec3 low(glm::floor(boxes[i].low / cell));
+            glm::i64vec3 high(glm::floor(boxes[i].high / cell));
+            glm::i64vec3 span = high - low;
+
+            if (span.x >= max_cells_per_axis || span.y >= max_cells_per_axis || span.z >= max_cells_per_axis) {
+                large.push_back(i);
+                continue;
+            }
+
+            for (int64_t cx = low.x; cx <= high.x; cx++) {
+                for (int64_t cy = low.y; cy <= high.y; cy++) {
+                    for (int64_t cz = low.z; cz <= high.z; cz++) {
+                        entries.emplace_back(cellKey(glm::i64vec3(cx, cy, cz)), i);
+                    }
+                }
+            }
+        }
+        large_bodies = large.size();
+
+        std::sort(entries.begin(), entries.end());
+
+        for (size_t begin = 0; begin < entries.size();) {
+            size_t end = begin + 1;
+            while (end < entries.size() && entries[end].first == entries[begin].first) end++;
+
+            for (size_t a = begin; a < end; a++) {
+                for (size_t b = a + 1; b < end; b++) {
+                    uint32_t i = entries[a].second, j = entries[b].second;
+                    if (i == j || !overlap(boxes[i], boxes[j])) continue;
+
+                    // the home cell of the pair holds the low corner of the overlap
+                    glm::dvec3 corner = glm::max(boxes[i].low, boxes[j].low);
+                    if (cellKey(glm::i64vec3(glm::floor(corner / cell))) != entries[begin].first) continue;
+
+                    test(bodies, std::min(i, j), std::max(i, j));
+                }
+            }
+
+            begin = end;
+        }
+
+        for (size_t k = 0; k < large.size(); k++) {
+            uint32_t i = large[k];
+            for (uint32_t j = 0; j < n; j++) {
+                if (j == i || !overlap(boxes[i], boxes[j])) continue;
+
+                // a pair of large bodies is seen from both sides
+                bool j_large = std::binary_search(large.begin(), large.end(), j);
+                if (j_large && j < i) continue;
+
+                test(bodies, std::min(i, j), std::max(i, j));
+            }
+        }
+
+        std::sort(found.begin(), found.end());
+        found.erase(std::unique(found.begin(), found.end()), found.end());
+    }
+
+    static bool overlap(const Box& a, const Box& b) {
+        return a.low.x <= b.high.x && b.low.x <= a.high.x
+            && a.low.y <= b.high.y && b.low.y <= a.high.y
+            && a.low.z <= b.high.z && b.low.z <= a.high.z;
+    }
+
+    // earliest t in [0, 1] with |d0 + (d1 - d0) t| = r_i + r_j, bodies already overlapping touch at 0
+    void test(const BodyStore& bodies, uint32_t i, uint32_t j) {
+        pair_tests++;
+
+        double reach = bodies.radius[i] + bodies.radius[j];
+        if (reach <= 0) return;
+
+        glm::dvec3 d0 = start(j) - start(i);
+        glm::dvec3 e = (bodies.position(j) - bodies.position(i)) - d0;
+
+        double c = glm::dot(d0, d0) - reach * reach;
+        if (c <= 0) {
+            found.push_back({0, i, j});
+            return;
+        }
+
+        double a = glm::dot(e, e);
+        double b = 2 * glm::dot(d0, e);
+        double discriminant = b * b - 4 * a * c;
+        if (a == 0 || b >= 0 || discriminant < 0) return;
+
+        double t = (-b - std::sqrt(discriminant)) / (2 * a);
+        if (t <= 1) found.push_back({t, i, j});
+    }
+
+    // j is absorbed into i at the center of mass, momentum and mass are conserved and volume is added
+    static void merge(BodyStore& bodies, size_t i, size_t j) {
+        double m = bodies.mass[i] + bodies.mass[j];
+        glm::dvec3 p = (bodies.mass[i] * bodies.position(i) + bodies.mass[j] * bodies.position(j)) / m;
+        glm::dvec3 v = (bodies.mass[i] * bodies.velocity(i) + bodies.mass[j] * bodies.velocity(j)) / m;
+        double r = std::cbrt(std::pow(bodies.radius[i], 3) + std::pow(bodies.radius[j], 3));
+
+        bodies.mass[i] = m;
+        bodies.radius[i] = r;
+        bodies.setPosition(i, p);
+        bodies.setVelocity(i, v);
+    }
+
+    // impulse along the line of centers at the time of impact, the rest of the step is coasted with the new velocities
+    void bounce(BodyStore& bodies, const Contact& contact, double dt) {
+        size_t i = contact.i, j = contact.j;
+        glm::dvec3 pi = glm::mix(start(i), bodies.position(i), contact.t);
+        glm::dvec3 pj = glm::mix(start(j), bodies.position(j), contact.t);
+
+        glm::dvec3 normal = pj - pi;
+        double distance = glm::length(normal);
+        if (distance == 0) return;
+        normal /= distance;
+
+        double approach = glm::dot(bodies.velocity(j) - bodies.velocity(i), normal);
+        if (approach >= 0) return;
+
+        double inverse_i = 1 / bodies.mass[i], inverse_j = 1 / bodies.mass[j];
+        double impulse = -(1 + restitution) * approach / (inverse_i + inverse_j);
+
+        glm::dvec3 vi = bodies.velocity(i) - impulse * inverse_i * normal;
+        glm::dvec3 vj = bodies.velocity(j) + impulse * inverse_j * normal;
+        double rest = (1 - contact.t) * dt;
+
+        bodies.setVelocity(i, vi);
+        bodies.setVelocity(j, vj);
+        bodies.setPosition(i, pi + vi * rest);
+        bodies.setPosition(j, pj + vj * rest);
+    }
+
+    // merges, then for fast impacts splits off equal fragments on a Fibonacci sphere around the remnant,
+    // leaving at the mutual escape speed; the remnant takes up the momentum so the total is unchanged
+    void fragment(BodyStore& bodies, const Contact& contact, double G) {
+        size_t i = contact.i, j = contact.j;
+        double impact_speed = glm::length(bodies.velocity(j) - bodies.velocity(i));
+        double reach = bodies.radius[i] + bodies.radius[j];
+        double escape_speed = std::sqrt(2 * G * (bodies.mass[i] + bodies.mass[j]) / reach);
+
+        merge(bodies, i, j);
+        if (fragment_count < 1 || impact_speed < fragment_speed * escape_speed) return;
+
+        double m = bodies.mass[i];
+        double r = bodies.radius[i];
+        glm::dvec3 p = bodies.position(i);
+        glm::dvec3 v = bodies.velocity(i);
+
+        double fragment_mass = fragment_mass_fraction * m / fragment_count;
+        double fragment_radius = r * std::cbrt(fragment_mass / m);
+        double remnant_radius = r * std::cbrt(1 - fragment_mass_fraction);
+
+        std::vector<glm::dvec3> directions(fragment_count);
+        glm::dvec3 mean(0);
+        double golden_angle = 3.883222077450933;
+        for (int k = 0; k < fragment_count; k++) {
+            double height = 1 - (2 * k + 1.0) / fragment_count;
+            double ring = std::sqrt(std::max(0.0, 1 - height * height));
+            directions[k] = glm::dvec3(ring * std::cos(golden_angle * k), height, ring * std::sin(golden_angle * k));
+            mean += directions[k] / double(fragment_count);
+        }
+
+        glm::dvec3 fragment_momentum(0);
+        for (int k = 0; k < fragment_count; k++) {
+            glm::dvec3 fragment_velocity = v + (directions[k] - mean) * escape_speed;
+            bodies.addBody(fragment_mass, p + directions[k] * (1.01 * (remnant_radius + fragment_radius)), fragment_velocity, fragment_radius);
+            fragment_momentum += fragment_mass * fragment_velocity;
+        }
+
+        double remnant_mass = m - fragment_count * fragment_mass;
+        bodies.mass[i] = remnant_mass;
+        bodies.radius[i] = remnant_radius;
+        bodies.setVelocity(i, (m * v - fragment_momentum) / remnant_mass);
+    }
+};
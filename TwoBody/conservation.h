@@ -0,0 +1,240 @@
+#pragma once
+
+#include "body_store.h"
+#include "simulation.h"
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TWOBODY_SSE2 1
+#endif
+
+struct MomentSums {
+    // sum of m v^2
+    double twice_kinetic = 0;
+    // sum of m r x v
+    glm::dvec3 angular_momentum = glm::dvec3(0);
+    // sum of m r . a, the potential energy of unsoftened gravity by the virial theorem
+    double virial = 0;
+};
+
+// One pass over the bodies [begin, end) with two doubles per SSE2 lane, the odd body is added by the scalar tail.
+// The virial sum is only meaningful while the cached accelerations are valid.
+inline MomentSums momentSums(const BodyStore& bodies, size_t begin, size_t end) {
+    size_t n = end;
+    size_t i = begin;
+    MomentSums sums;
+
+    const double* m = bodies.mass.data();
+    const double* x = bodies.x.data(); const double* y = bodies.y.data(); const double* z = bodies.z.data();
+    const double* vx = bodies.vx.data(); const double* vy = bodies.vy.data(); const double* vz = bodies.vz.data();
+    const double* ax = bodies.ax.data(); const double* ay = bodies.ay.data(); const double* az = bodies.az.data();
+
+#ifdef TWOBODY_SSE2
+    __m128d kinetic = _mm_setzero_pd();
+    __m128d lx = _mm_setzero_pd(), ly = _mm_setzero_pd(), lz = _mm_setzero_pd();
+    __m128d virial = _mm_setzero_pd();
+
+    for (; i + 2 <= n; i += 2) {
+        __m128d mi = _mm_loadu_pd(m + i);
+        __m128d xi = _mm_loadu_pd(x + i), yi = _mm_loadu_pd(y + i), zi = _mm_loadu_pd(z + i);
+        __m128d vxi = _mm_loadu_pd(vx + i), vyi = _mm_loadu_pd(vy + i), vzi = _mm_loadu_pd(vz + i);
+        __m128d axi = _mm_loadu_pd(ax + i), ayi = _mm_loadu_pd(ay + i), azi = _mm_loadu_pd(az + i);
+
+        __m128d v2 = _mm_add_pd(_mm_add_pd(_mm_mul_pd(vxi, vxi), _mm_mul_pd(vyi, vyi)), _mm_mul_pd(vzi, vzi));
+        kinetic = _mm_add_pd(kinetic, _mm_mul_pd(mi, v2));
+
+        lx = _mm_add_pd(lx, _mm_mul_pd(mi, _mm_sub_pd(_mm_mul_pd(yi, vzi), _mm_mul_pd(zi, vyi))));
+        ly = _mm_add_pd(ly, _mm_mul_pd(mi, _mm_sub_pd(_mm_mul_pd(zi, vxi), _mm_mul_pd(xi, vzi))));
+        lz = _mm_add_pd(lz, _mm_mul_pd(mi, _mm_sub_pd(_mm_mul_pd(xi, vyi), _mm_mul_pd(yi, vxi))));
+
+        __m128d ra = _mm_add_pd(_mm_add_pd(_mm_mul_pd(xi, axi), _mm_mul_pd(yi, ayi)), _mm_mul_pd(zi, azi));
+        virial = _mm_add_pd(virial, _mm_mul_pd(mi, ra));
+    }
+
+    auto horizontal = [](__m128d lanes) {
+        return _mm_cvtsd_f64(_mm_add_sd(lanes, _mm_unpackhi_pd(lanes, lanes)));
+    };
+
+    sums.twice_kinetic = horizontal(kinetic);
+    sums.angular_momentum = glm::dvec3(horizontal(lx), horizontal(ly), horizontal(lz));
+    sums.virial = horizontal(virial);
+#endif
+
+    for (; i < n; i++) {
+        sums.twice_kinetic += m[i] * (vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i]);
+        sums.angular_momentum += m[i] * glm::dvec3(y[i] * vz[i] - z[i] * vy[i], z[i] * vx[i] - x[i] * vz[i], x[i] * vy[i] - y[i] * vx[i]);
+        sums.virial += m[i] * (x[i] * ax[i] + y[i] * ay[i] + z[i] * az[i]);
+    }
+
+    return sums;
+}
+
+// All bodies in fixed blocks on the pool, the block sums added pairwise in a fixed tree so the result does not
+// depend on the thread count.
+inline MomentSums momentSums(const BodyStore& bodies, ThreadPool& pool) {
+    const size_t block = 8192;
+    size_t n = bodies.size();
+    if (n <= block) return momentSums(bodies, 0, n);
+
+    std::vector<MomentSums> partial((n + block - 1) / block);
+    pool.parallelFor(0, partial.size(), [&](size_t b) {
+        partial[b] = momentSums(bodies, b * block, std::min(n, (b + 1) * block));
+    });
+
+    for (size_t count = partial.size(); count > 1; count = (count + 1) / 2) {
+        for (size_t k = 0; k < count / 2; k++) {
+            const MomentSums& a = partial[2 * k];
+            const MomentSums& b = partial[2 * k + 1];
+            partial[k].twice_kinetic = a.twice_kinetic + b.twice_kinetic;
+            partial[k].angular_momentum = a.angular_momentum + b.angular_momentum;
+            partial[k].virial = a.virial + b.virial;
+        }
+        if (count % 2) partial[count / 2] = partial[count - 1];
+    }
+
+    return partial[0];
+}
+
+// Watches energy, total angular momentum and the Laplace-Runge-Lenz (eccentricity) vector of the
+// bodies 0 and 1 relative orbit. A sample is taken once every interval steps and its drift from the
+// values at start is appended to a bounded history for plotting.
+// Large point-mass systems take the potential from the virial sum over the cached accelerations, exact
+// without softening and O(N) instead of O(N^2), everything else sums the force model's potential.
+// Only what the force model conserves can raise the alarm: energy, softened where the gravity is, and angular
+// momentum for point masses, the eccentricity vector as well for an unsoftened isolated pair. All of them need
+// the direct gravity solver, the tree and mesh solvers are approximate and their expected error would raise
+// the alarm.
+class ConservationMonitor {
+public:
+    struct Sample {
+        double time;
+        // relative drift of energy and angular momentum, absolute drift of the eccentricity vector
+        double energy;
+        double angular_momentum;
+        double eccentricity;
+    };
+
+    uint64_t interval = 16;
+    size_t history_length = 512;
+    size_t virial_threshold = 1024;
+
+    double alarm_threshold = 1e-6;
+    bool alarm = false;
+    const char* alarm_quantity = "";
+    double alarm_drift = 0;
+    double alarm_time = 0;
+
+    std::deque<Sample> history;
+    bool used_virial = false;
+
+    void start(const Simulation& simulation) {
+        history.clear();
+        alarm = false;
+        last_step = simulation.step_count;
+
+        measure(simulation, energy0, angular_momentum0, eccentricity0);
+        record(simulation);
+    }
+
+    // samples when the simulation has taken interval steps since the last sample
+    void update(const Simulation& simulation) {
+        // the step counter restarts with the simulation's mode and step changes, the references stay
+        if (simulation.step_count < last_step) last_step = simulation.step_count;
+        if (simulation.step_count - last_step < interval) return;
+
+        last_step = simulation.step_count;
+        record(simulation);
+    }
+
+    void acknowledge() {
+        alarm = false;
+    }
+
+    bool conservesEnergy(const Simulation& simulation) const {
+        return exactGravity(simulation);
+    }
+
+    bool conservesAngularMomentum(const Simulation& simulation) const {
+        return exactGravity(simulation);
+    }
+
+    bool conservesEccentricity(const Simulation& simulation) const {
+        return exactGravity(simulation) && simulation.isTwoBody() && simulation.gravity.softening == 0;
+    }
+
+private:
+    uint64_t last_step = 0;
+
+    // point masses summed pair by pair
+    static bool exactGravity(const Simulation& simulation) {
+        return simulation.force_model == ForceModelKind::PointMass && simulation.gravity.solver == GravitySolver::Direct;
+    }
+
+    double energy0 = 0;
+    glm::dvec3 angular_momentum0 = glm::dvec3(0);
+    glm::dvec3 eccentricity0 = glm::dvec3(0);
+
+    void measure(const Simulation& simulation, double& energy, glm::dvec3& angular_momentum, glm::dvec3& eccentricity) {
+        const BodyStore& bodies = simulation.bodies;
+        MomentSums sums = momentSums(bodies, simulation.gravity.threads());
+
+        used_virial = bodies.size() >= virial_threshold && bodies.accelerations_valid
+            && exactGravity(simulation) && simulation.gravity.softening == 0;
+
+        double potential = used_virial ? sums.virial : simulation.potentialEnergy();
+        energy = sums.twice_kinetic / 2 + potential;
+        angular_momentum = sums.angular_momentum;
+
+        eccentricity = glm::dvec3(0);
+        if (bodies.size() >= 2) {
+            glm::dvec3 r = bodies.position(1) - bodies.position(0);
+            glm::dvec3 v = bodies.velocity(1) - bodies.velocity(0);
+            double mu = simulation.gravity.G * (bodies.mass[0] + bodies.mass[1]);
+
+            eccentricity = glm::cross(v, glm::cross(r, v)) / mu - r / glm::length(r);
+        }
+    }
+
+    void record(const Simulation& simulation) {
+        double energy;
+        glm::dvec3 angular_momentum, eccentricity;
+        measure(simulation, energy, angular_momentum, eccentricity);
+
+        Sample sample;
+        sample.time = simulation.stateTime();
+        sample.energy = energy0 != 0 ? std::abs((energy - energy0) / energy0) : std::abs(energy);
+
+        double l0 = glm::length(angular_momentum0);
+        sample.angular_momentum = glm::length(angular_momentum - angular_momentum0) / (l0 > 0 ? l0 : 1);
+        sample.eccentricity = glm::length(eccentricity - eccentricity0);
+
+        history.push_back(sample);
+        while (history.size() > history_length) history.pop_front();
+
+        if (alarm) return;
+
+        if (conservesEnergy(simulation) && sample.energy > alarm_threshold) {
+            raise(sample, "energy", sample.energy);
+        } else if (conservesAngularMomentum(simulation) && sample.angular_momentum > alarm_threshold) {
+            raise(sample, "angular momentum", sample.angular_momentum);
+        } else if (conservesEccentricity(simulation) && sample.eccentricity > alarm_threshold) {
+            raise(sample, "eccentricity vector", sample.eccentricity);
+        }
+    }
+
+    void raise(const Sample& sample, const char* quantity, double drift) {
+        alarm = true;
+        alarm_quantity = quantity;
+        alarm_drift = drift;
+        alarm_time = sample.time;
+    }
+};
@@ -0,0 +1,314 @@
+#pragma once
+
+#include "body_store.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define TWOBODY_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC compiles any intrinsic anywhere, GCC and Clang need the instruction set enabled per function
+#if defined(TWOBODY_X86) && !defined(_MSC_VER)
+#define TWOBODY_TARGET(isa) __attribute__((target(isa)))
+#else
+#define TWOBODY_TARGET(isa)
+#endif
+
+enum class SimdLevel {
+    Scalar,
+    Avx2,
+    Avx512
+};
+
+inline const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+    case SimdLevel::Avx2: return "AVX2";
+    case SimdLevel::Avx512: return "AVX-512";
+    default: return "scalar";
+    }
+}
+
+// widest instruction set both the processor and the operating system's saved register state support
+inline SimdLevel detectSimdLevel() {
+#if defined(TWOBODY_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return SimdLevel::Scalar;
+
+    __cpuid(info, 1);
+    bool fma = (info[2] >> 12) & 1;
+    bool osxsave = (info[2] >> 27) & 1;
+    if (!osxsave) return SimdLevel::Scalar;
+
+    unsigned long long xcr0 = _xgetbv(0);
+    bool ymm_state = (xcr0 & 0x6) == 0x6;
+    bool zmm_state = (xcr0 & 0xe6) == 0xe6;
+
+    __cpuidex(info, 7, 0);
+    bool avx2 = (info[1] >> 5) & 1;
+    bool avx512f = (info[1] >> 16) & 1;
+
+    if (avx512f && zmm_state) return SimdLevel::Avx512;
+    if (avx2 && fma && ymm_state) return SimdLevel::Avx2;
+    return SimdLevel::Scalar;
+#elif defined(TWOBODY_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return SimdLevel::Avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SimdLevel::Avx2;
+    return SimdLevel::Scalar;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+// Direct O(N^2) summation of point-mass gravity, every body gathering its acceleration from all others.
+// Positions and masses are copied into padded arrays, then a group of i bodies, one per vector lane, sweeps a tile
+// of j bodies broadcast one at a time, so the accumulators never leave the registers within a tile and the tile's
+// 32 bytes per body stay in L1 while every group of the thread's range passes over it.
+// 1 / r comes either from a square root and a division, or from the hardware reciprocal square root estimate
+// refined by Newton's iteration y (3 - r^2 y^2) / 2, each step doubling the correct bits: two from the 14 bits of
+// AVX-512, three from the 12 bits of the single precision AVX2 estimate, which also limits r^2 to the float range.
+// The sum is split over i only and each lane adds its j terms in index order, so the result does not depend on
+// the thread count, but it uses fused multiply-adds and differs in the last bits from the scalar pairwise sum.
+// Coincident bodies, the body itself among them, contribute nothing when the softening is zero.
+class DirectSummation {
+public:
+    SimdLevel level = detectSimdLevel();
+    bool fast_rsqrt = false;
+    // j bodies per tile, 512 take 16 KB
+    size_t tile = 512;
+
+    // totals since the last resetStatistics, an interaction is one i, j pair
+    uint64_t interactions = 0;
+    double seconds = 0;
+
+    static SimdLevel supportedLevel() {
+        static SimdLevel supported = detectSimdLevel();
+        return supported;
+    }
+
+    double interactionsPerSecond() const {
+        return seconds > 0 ? double(interactions) / seconds : 0;
+    }
+
+    void resetStatistics() {
+        interactions = 0;
+        seconds = 0;
+    }
+
+    // adds G times the acceleration of every body to ax, ay, az
+    void accumulate(const BodyStore& bodies, double G, double softening, double* ax, double* ay, double* az, ThreadPool& pool) {
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point start = Clock::now();
+
+        size_t n = bodies.size();
+        SimdLevel used = std::min(level, supportedLevel());
+        size_t width = used == SimdLevel::Avx512 ? 8 : used == SimdLevel::Avx2 ? 4 : 1;
+        size_t padded = (n + width - 1) / width * width;
+
+        // padding bodies are massless, their own accelerations are computed and dropped
+        px.assign(padded, 0.0);
+        py.assign(padded, 0.0);
+        pz.assign(padded, 0.0);
+        pm.assign(padded, 0.0);
+        std::copy(bodies.x.begin(), bodies.x.end(), px.begin());
+        std::copy(bodies.y.begin(), bodies.y.end(), py.begin());
+        std::copy(bodies.z.begin(), bodies.z.end(), pz.begin());
+        std::copy(bodies.mass.begin(), bodies.mass.end(), pm.begin());
+
+        qx.assign(padded, 0.0);
+        qy.assign(padded, 0.0);
+        qz.assign(padded, 0.0);
+
+        Kernel kernel{px.data(), py.data(), pz.data(), pm.data(), qx.data(), qy.data(), qz.data(),
+            padded, std::max<size_t>(tile, 1), softening * softening, fast_rsqrt};
+
+        // ranges of 64 bodies keep every thread on a tile for a while
+        size_t groups = padded / width;
+        size_t groups_per_range = std::max<size_t>(1, 64 / width);
+        size_t ranges = (groups + groups_per_range - 1) / groups_per_range;
+
+        pool.parallelFor(0, ranges, [&](size_t range) {
+            size_t first = range * groups_per_range * width;
+            size_t last = std::min(padded, first + groups_per_range * width);
+
+            switch (used) {
+#if defined(TWOBODY_X86)
+            case SimdLevel::Avx512: kernel.avx512(first, last); break;
+            case SimdLevel::Avx2: kernel.avx2(first, last); break;
+#endif
+            default: kernel.scalar(first, last); break;
+            }
+        });
+
+        for (size_t i = 0; i < n; i++) {
+            ax[i] += G * qx[i];
+            ay[i] += G * qy[i];
+            az[i] += G * qz[i];
+        }
+
+        interactions += uint64_t(n) * uint64_t(n);
+        seconds += std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+private:
+    std::vector<double> px, py, pz, pm;
+    std::vector<double> qx, qy, qz;
+
+    struct Kernel {
+        const double* x;
+        const double* y;
+        const double* z;
+        const double* m;
+        double* ax;
+        double* ay;
+        double* az;
+        size_t n;
+        size_t tile;
+        double eps2;
+        bool fast_rsqrt;
+
+        void scalar(size_t first, size_t last) const {
+            for (size_t j0 = 0; j0 < n; j0 += tile) {
+                size_t j1 = std::min(n, j0 + tile);
+
+                for (size_t i = first; i < last; i++) {
+                    double sx = 0, sy = 0, sz = 0;
+
+                    for (size_t j = j0; j < j1; j++) {
+                        double dx = x[j] - x[i];
+                        double dy = y[j] - y[i];
+                        double dz = z[j] - z[i];
+
+                        double r2 = dx * dx + dy * dy + dz * dz + eps2;
+                        if (r2 == 0) continue;
+
+                        double inv_r = 1.0 / std::sqrt(r2);
+                        double s = m[j] * inv_r * inv_r * inv_r;
+
+                        sx += dx * s;
+                        sy += dy * s;
+                        sz += dz * s;
+                    }
+
+                    ax[i] += sx;
+                    ay[i] += sy;
+                    az[i] += sz;
+                }
+            }
+        }
+
+#if defined(TWOBODY_X86)
+        TWOBODY_TARGET("avx2,fma")
+        void avx2(size_t first, size_t last) const {
+            const __m256d zero = _mm256_setzero_pd();
+            const __m256d one = _mm256_set1_pd(1.0);
+            const __m256d half = _mm256_set1_pd(0.5);
+            const __m256d three_halves = _mm256_set1_pd(1.5);
+            const __m256d soft = _mm256_set1_pd(eps2);
+
+            for (size_t j0 = 0; j0 < n; j0 += tile) {
+                size_t j1 = std::min(n, j0 + tile);
+
+                for (size_t i = first; i < last; i += 4) {
+                    __m256d xi = _mm256_loadu_pd(x + i);
+                    __m256d yi = _mm256_loadu_pd(y + i);
+                    __m256d zi = _mm256_loadu_pd(z + i);
+                    __m256d sx = zero, sy = zero, sz = zero;
+
+                    for (size_t j = j0; j < j1; j++) {
+                        __m256d dx = _mm256_sub_pd(_mm256_broadcast_sd(x + j), xi);
+                        __m256d dy = _mm256_sub_pd(_mm256_broadcast_sd(y + j), yi);
+                        __m256d dz = _mm256_sub_pd(_mm256_broadcast_sd(z + j), zi);
+                        __m256d r2 = _mm256_fmadd_pd(dx, dx, _mm256_fmadd_pd(dy, dy, _mm256_fmadd_pd(dz, dz, soft)));
+
+                        __m256d inv_r;
+                        if (fast_rsqrt) {
+                            inv_r = _mm256_cvtps_pd(_mm_rsqrt_ps(_mm256_cvtpd_ps(r2)));
+                            __m256d half_r2 = _mm256_mul_pd(half, r2);
+                            for (int k = 0; k < 3; k++) {
+                                __m256d y2 = _mm256_mul_pd(inv_r, inv_r);
+                                inv_r = _mm256_mul_pd(inv_r, _mm256_fnmadd_pd(half_r2, y2, three_halves));
+                            }
+                        } else {
+                            inv_r = _mm256_div_pd(one, _mm256_sqrt_pd(r2));
+                        }
+
+                        __m256d s = _mm256_mul_pd(_mm256_mul_pd(inv_r, inv_r), _mm256_mul_pd(inv_r, _mm256_broadcast_sd(m + j)));
+                        s = _mm256_and_pd(s, _mm256_cmp_pd(r2, zero, _CMP_NEQ_OQ));
+
+                        sx = _mm256_fmadd_pd(dx, s, sx);
+                        sy = _mm256_fmadd_pd(dy, s, sy);
+                        sz = _mm256_fmadd_pd(dz, s, sz);
+                    }
+
+                    _mm256_storeu_pd(ax + i, _mm256_add_pd(_mm256_loadu_pd(ax + i), sx));
+                    _mm256_storeu_pd(ay + i, _mm256_add_pd(_mm256_loadu_pd(ay + i), sy));
+                    _mm256_storeu_pd(az + i, _mm256_add_pd(_mm256_loadu_pd(az + i), sz));
+                }
+            }
+        }
+
+        TWOBODY_TARGET("avx512f")
+        void avx512(size_t first, size_t last) const {
+            const __m512d zero = _mm512_setzero_pd();
+            const __m512d one = _mm512_set1_pd(1.0);
+            const __m512d half = _mm512_set1_pd(0.5);
+            const __m512d three_halves = _mm512_set1_pd(1.5);
+            const __m512d soft = _mm512_set1_pd(eps2);
+
+            for (size_t j0 = 0; j0 < n; j0 += tile) {
+                size_t j1 = std::min(n, j0 + tile);
+
+                for (size_t i = first; i < last; i += 8) {
+                    __m512d xi = _mm512_loadu_pd(x + i);
+                    __m512d yi = _mm512_loadu_pd(y + i);
+                    __m512d zi = _mm512_loadu_pd(z + i);
+                    __m512d sx = zero, sy = zero, sz = zero;
+
+                    for (size_t j = j0; j < j1; j++) {
+                        __m512d dx = _mm512_sub_pd(_mm512_set1_pd(x[j]), xi);
+                        __m512d dy = _mm512_sub_pd(_mm512_set1_pd(y[j]), yi);
+                        __m512d dz = _mm512_sub_pd(_mm512_set1_pd(z[j]), zi);
+                        __m512d r2 = _mm512_fmadd_pd(dx, dx, _mm512_fmadd_pd(dy, dy, _mm512_fmadd_pd(dz, dz, soft)));
+                        __mmask8 apart = _mm512_cmp_pd_mask(r2, zero, _CMP_NEQ_OQ);
+
+                        __m512d inv_r;
+                        if (fast_rsqrt) {
+                            inv_r = _mm512_rsqrt14_pd(r2);
+                            __m512d half_r2 = _mm512_mul_pd(half, r2);
+                            for (int k = 0; k < 2; k++) {
+                                __m512d y2 = _mm512_mul_pd(inv_r, inv_r);
+                                inv_r = _mm512_mul_pd(inv_r, _mm512_fnmadd_pd(half_r2, y2, three_halves));
+                            }
+                        } else {
+                            inv_r = _mm512_div_pd(one, _mm512_sqrt_pd(r2));
+                        }
+
+                        __m512d s = _mm512_maskz_mul_pd(apart, _mm512_mul_pd(inv_r, inv_r), _mm512_mul_pd(inv_r, _mm512_set1_pd(m[j])));
+
+                        sx = _mm512_fmadd_pd(dx, s, sx);
+                        sy = _mm512_fmadd_pd(dy, s, sy);
+                        sz = _mm512_fmadd_pd(dz, s, sz);
+                    }
+
+                    _mm512_storeu_pd(ax + i, _mm512_add_pd(_mm512_loadu_pd(ax + i), sx));
+                    _mm512_storeu_pd(ay + i, _mm512_add_pd(_mm512_loadu_pd(ay + i), sy));
+                    _mm512_storeu_pd(az + i, _mm512_add_pd(_mm512_loadu_pd(az + i), sz));
+                }
+            }
+        }
+#endif
+    };
+};
@@ -0,0 +1,302 @@
+#pragma once
+
+#include "body_store.h"
+#include "forces.h"
+#include "ias15.h"
+#include "root_finding.h"
+#include "simulation.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+enum class EventKind {
+    ShadowEntry,
+    ShadowExit,
+    Periapsis,
+    Apoapsis,
+    AscendingNode,
+    DescendingNode,
+    OccultationStart,
+    OccultationEnd,
+    Count
+};
+
+inline const char* eventKindName(EventKind kind) {
+    switch (kind) {
+    case EventKind::ShadowEntry: return "shadow entry";
+    case EventKind::ShadowExit: return "shadow exit";
+    case EventKind::Periapsis: return "periapsis";
+    case EventKind::Apoapsis: return "apoapsis";
+    case EventKind::AscendingNode: return "ascending node";
+    case EventKind::DescendingNode: return "descending node";
+    case EventKind::OccultationStart: return "occultation start";
+    case EventKind::OccultationEnd: return "occultation end";
+    default: return "";
+    }
+}
+
+struct Event {
+    double time = 0;
+    EventKind kind = EventKind::Periapsis;
+    // the shadowed, orbiting or farther body, and the one casting the shadow, orbited or in front
+    size_t body = 0;
+    size_t other = 0;
+    // every body at time, so the simulation can be put there without stepping
+    BodyStore state;
+};
+
+struct EventTimeline {
+    double t_start = 0;
+    double t_end = 0;
+    std::vector<Event> events;
+
+    uint64_t steps = 0;
+    uint64_t refinements = 0;
+    double wall_seconds = 0;
+    // the scan stopped at max_events before t_end
+    bool truncated = false;
+};
+
+// where the light comes from, a body of the store, the Sun ephemeris of the near-Earth forces or infinitely far along direction
+struct EventLight {
+    enum class Kind {
+        Direction,
+        Body,
+        Ephemeris
+    };
+
+    Kind kind = Kind::Direction;
+    glm::dvec3 direction = glm::dvec3(1, 1, 1);
+    size_t body = BodyStore::npos;
+    SunEphemeris ephemeris;
+};
+
+// Finds the events of a primary and its secondary, e.g. the Earth and the Moon, in a span ahead of a simulation's state.
+// A private IAS15 run with the simulation's forces steps through the span and every event function, continuous in time
+// and changing sign at its event, is sampled on the dense output of each accepted step. A sign change between samples
+// is refined by Brent's method on the same polynomial, so the cost is a few dense evaluations per step and not a
+// stepped run at the accuracy wanted. The event functions:
+//     shadow       distance of the body's limb outside the umbra cone of the other, or its antumbra past the tip,
+//                  the cone becomes a cylinder for a light at infinity
+//     apsides      r . v of the secondary relative to the primary, rising through zero at periapsis
+//     nodes        r . n for the reference plane normal n, rising at the ascending node
+//     occultation  angular separation of the two bodies from the viewer minus their angular radii, the discs touch at zero
+// Spin and collisions are left out, events are about the orbits.
+class EventFinder {
+public:
+    size_t primary = 0;
+    size_t secondary = 1;
+    double primary_radius = 1;
+    double secondary_radius = 0.5;
+
+    EventLight light;
+    glm::dvec3 plane_normal = glm::dvec3(0, 1, 0);
+    // the viewer keeps a fixed offset from this body, or from the barycenter of the pair for npos
+    size_t viewer_body = BodyStore::npos;
+    glm::dvec3 viewer_offset = glm::dvec3(0);
+
+    bool shadows = true;
+    bool apsides = true;
+    bool nodes = true;
+    bool occultations = true;
+
+    // event times are located to this accuracy, for the Moon's month of 2 pi this is well below a millisecond
+    double tolerance = 1e-10;
+    // event functions are sampled this many times per IAS15 step, events shorter than a sample interval can be missed
+    int samples_per_step = 8;
+    size_t max_events = 100000;
+
+    EventTimeline scan(const Simulation& simulation, double span) const {
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point start = Clock::now();
+
+        EventTimeline timeline;
+        timeline.t_start = simulation.stateTime();
+        timeline.t_end = timeline.t_start + span;
+
+        BodyStore bodies = simulation.bodies;
+        bodies.accelerations_valid = false;
+        if (primary >= bodies.size() || secondary >= bodies.size()) return timeline;
+
+        Ias15 ias15 = simulation.ias15;
+        ias15.reset(timeline.t_start, simulation.fixed_dt);
+
+        std::vector<Crossing> crossings = eventFunctions();
+        std::vector<double> previous(crossings.size());
+        for (size_t k = 0; k < crossings.size(); k++) previous[k] = value(crossings[k], Sample(bodies, timeline.t_start));
+
+        while (ias15.time < timeline.t_end && !timeline.truncated) {
+            double t0 = ias15.time;
+            simulation.withForces(t0, [&](auto& forces) { ias15.step(bodies, forces); });
+            timeline.steps++;
+
+            double t1 = std::min(ias15.time, timeline.t_end);
+            for (int s = 1; s <= samples_per_step; s++) {
+                double ta = t0 + (t1 - t0) * (s - 1) / samples_per_step;
+                double tb = s == samples_per_step ? t1 : t0 + (t1 - t0) * s / samples_per_step;
+
+                for (size_t k = 0; k < crossings.size(); k++) {
+                    double fa = previous[k];
+                    double fb = value(crossings[k], Sample(ias15, bodies, tb));
+                    previous[k] = fb;
+
+                    if ((fa < 0) == (fb < 0) || fa == 0) continue;
+
+                    auto f = [&](double t) { return value(crossings[k], Sample(ias15, bodies, t)); };
+                    double t = brentRoot(f, ta, tb, fa, fb, tolerance);
+                    timeline.refinements++;
+
+                    timeline.events.push_back(event(crossings[k], fb > fa, ias15, bodies, t));
+                }
+            }
+
+            if (timeline.events.size() >= max_events) timeline.truncated = true;
+        }
+
+        // sample intervals are scanned function by function, events sharing one come out of order
+        std::stable_sort(timeline.events.begin(), timeline.events.end(), [](const Event& a, const Event& b) { return a.time < b.time; });
+
+        timeline.wall_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        return timeline;
+    }
+
+private:
+    enum class Function {
+        Shadow,
+        Apsides,
+        Nodes,
+        Occultation
+    };
+
+    struct Crossing {
+        Function function;
+        // the shadowed body and the occluder, the orbiting body and the orbited one
+        size_t body;
+        size_t other;
+        double body_radius;
+        double other_radius;
+    };
+
+    // positions and velocities at one time, from the dense output or from the store itself
+    struct Sample {
+        const Ias15* ias15;
+        const BodyStore* bodies;
+        double time;
+
+        Sample(const BodyStore& bodies, double time) : ias15(nullptr), bodies(&bodies), time(time) {}
+        Sample(const Ias15& ias15, const BodyStore& bodies, double time) : ias15(&ias15), bodies(&bodies), time(time) {}
+
+        glm::dvec3 position(size_t i) const {
+            return ias15 ? ias15->densePosition(i, time) : bodies->position(i);
+        }
+
+        glm::dvec3 velocity(size_t i) const {
+            return ias15 ? ias15->denseVelocity(i, time) : bodies->velocity(i);
+        }
+    };
+
+    std::vector<Crossing> eventFunctions() const {
+        std::vector<Crossing> crossings;
+        if (shadows) {
+            crossings.push_back({Function::Shadow, secondary, primary, secondary_radius, primary_radius});
+            crossings.push_back({Function::Shadow, primary, secondary, primary_radius, secondary_radius});
+        }
+        if (apsides) crossings.push_back({Function::Apsides, secondary, primary, secondary_radius, primary_radius});
+        if (nodes) crossings.push_back({Function::Nodes, secondary, primary, secondary_radius, primary_radius});
+        if (occultations) crossings.push_back({Function::Occultation, secondary, primary, secondary_radius, primary_radius});
+        return crossings;
+    }
+
+    glm::dvec3 viewer(const Sample& sample) const {
+        if (viewer_body != BodyStore::npos) return sample.position(viewer_body) + viewer_offset;
+
+        double m1 = sample.bodies->mass[primary];
+        double m2 = sample.bodies->mass[secondary];
+        return (m1 * sample.position(primary) + m2 * sample.position(secondary)) / (m1 + m2) + viewer_offset;
+    }
+
+    double value(const Crossing& crossing, const Sample& sample) const {
+        glm::dvec3 r = sample.position(crossing.body) - sample.position(crossing.other);
+
+        switch (crossing.function) {
+        case Function::Shadow: {
+            // towards the light from the occluder, and the umbra's half-angle slope
+            glm::dvec3 to_light;
+            double slope = 0;
+            if (light.kind == EventLight::Kind::Direction) {
+                to_light = glm::normalize(light.direction);
+            } else {
+                bool body_light = light.kind == EventLight::Kind::Body;
+                glm::dvec3 source = body_light ? sample.position(light.body) : light.ephemeris.position(sample.time);
+                double source_radius = body_light ? sample.bodies->radius[light.body] : light.ephemeris.radius;
+
+                glm::dvec3 offset = source - sample.position(crossing.other);
+                double distance = glm::length(offset);
+                to_light = offset / distance;
+                slope = (source_radius - crossing.other_radius) / distance;
+            }
+
+            // on the lit side the distance to the occluder takes over, it matches the cone at its base
+            double behind = -glm::dot(r, to_light);
+            if (behind <= 0) return glm::length(r) - crossing.other_radius - crossing.body_radius;
+
+            double axis_distance = glm::length(r + behind * to_light);
+            double umbra = std::abs(crossing.other_radius - behind * slope);
+            return axis_distance - umbra - crossing.body_radius;
+        }
+        case Function::Apsides:
+            return glm::dot(r, sample.velocity(crossing.body) - sample.velocity(crossing.other));
+        case Function::Nodes:
+            return glm::dot(r, plane_normal);
+        default: {
+            glm::dvec3 eye = viewer(sample);
+            glm::dvec3 a = sample.position(crossing.body) - eye;
+            glm::dvec3 b = sample.position(crossing.other) - eye;
+            double la = glm::length(a);
+            double lb = glm::length(b);
+
+            double separation = std::atan2(glm::length(glm::cross(a, b)), glm::dot(a, b));
+            double radius_a = std::asin(std::min(1.0, crossing.body_radius / la));
+            double radius_b = std::asin(std::min(1.0, crossing.other_radius / lb));
+            return separation - radius_a - radius_b;
+        }
+        }
+    }
+
+    Event event(const Crossing& crossing, bool rising, const Ias15& ias15, const BodyStore& bodies, double t) const {
+        Event event;
+        event.time = t;
+        event.body = crossing.body;
+        event.other = crossing.other;
+
+        switch (crossing.function) {
+        case Function::Shadow: event.kind = rising ? EventKind::ShadowExit : EventKind::ShadowEntry; break;
+        case Function::Apsides: event.kind = rising ? EventKind::Periapsis : EventKind::Apoapsis; break;
+        case Function::Nodes: event.kind = rising ? EventKind::AscendingNode : EventKind::DescendingNode; break;
+        default: event.kind = rising ? EventKind::OccultationEnd : EventKind::OccultationStart; break;
+        }
+
+        event.state = bodies;
+        for (size_t i = 0; i < bodies.size(); i++) {
+            event.state.setPosition(i, ias15.densePosition(i, t));
+            event.state.setVelocity(i, ias15.denseVelocity(i, t));
+        }
+        event.state.accelerations_valid = false;
+
+        // the hidden body is the farther one
+        if (crossing.function == Function::Occultation) {
+            Sample sample(event.state, t);
+            glm::dvec3 eye = viewer(sample);
+            if (glm::length(event.state.position(event.other) - eye) > glm::length(event.state.position(event.body) - eye)) {
+                std::swap(event.body, event.other);
+            }
+        }
+
+        return event;
+    }
+};
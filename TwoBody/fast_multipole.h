@@ -0,0 +1,487 @@
+#pragma once
+
+#include "body_store.h"
+#include "octree.h"
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Cartesian fast multipole method (Greengard & Rokhlin 1987 in Dehnen's 2002 dual-tree form), O(N) per evaluation.
+// Expansions are Taylor series of 1/r to a configurable order p over multi-indices n = (a, b, c), |n| = a + b + c <= p:
+//   P2M  M_k = sum m d^k / k!                              d from the cell's center of mass to the body
+//   M2M  M_k = sum_j M'_j t^(k - j) / (k - j)!              t from the child's center to the parent's
+//   M2L  L_n = sum_k (-1)^|k| M_k D^(n + k) (1/r)(R)        R from the source's center to the target's, |n + k| <= p
+//   L2L  L_n = sum_k L'_(n + k) t^k / k!                    t from the parent's center to the child's
+//   L2P  Phi = sum_n L_n d^n / n!, its gradient the same sum over L_(n + e_i)
+// The derivatives of 1/r come from the recurrence |n| r^2 D^n = -(2|n| - 1) sum_i n_i R_i D^(n - e_i)
+// - (|n| - 1) sum_i n_i (n_i - 1) D^(n - 2 e_i), so any order costs the same code.
+// The dual-tree walk pairs cells from the root down: two cells interact through M2L when (r_a + r_b) < theta |R|,
+// r the radius of a cell's bodies around its center of mass, leaves that fail the test sum their bodies directly, and
+// otherwise the larger cell is split. Pairs are only ever collected for the target side, so once the walk has split the
+// targets down to a level with enough cells every such cell continues on its own with a task of the pool, and all the
+// pairs a task finds have their targets inside its subtree: its M2L and direct sums run in parallel with the other
+// tasks' without locks, and always in the same order, so the result does not depend on the thread count.
+// Softening only enters the direct sums, far cells see the point masses.
+class FastMultipole {
+public:
+    int order = 4;
+    double theta = 0.6;
+    uint32_t leaf_size = 32;
+
+    // last evaluation
+    size_t cell_count = 0;
+    size_t depth = 0;
+    uint64_t m2l_count = 0;
+    uint64_t p2p_count = 0;
+    double build_seconds = 0;
+    double traversal_seconds = 0;
+    double m2l_seconds = 0;
+    double evaluation_seconds = 0;
+
+    static constexpr int max_order = 12;
+
+    // adds G times the acceleration of every body to ax, ay, az
+    void accumulate(const BodyStore& bodies, double G, double softening, double* ax, double* ay, double* az, ThreadPool& pool) {
+        evaluate(bodies, softening, pool);
+
+        size_t n = bodies.size();
+        pool.parallelFor(0, n, [&](size_t k) {
+            size_t i = octree.order[k];
+            ax[i] += G * qx[k];
+            ay[i] += G * qy[k];
+            az[i] += G * qz[k];
+        }, 4096);
+    }
+
+    // the potential from the same evaluation, taken from the last accumulate when the bodies have not moved since
+    double potentialEnergy(const BodyStore& bodies, double G, double softening, ThreadPool& pool) {
+        if (!cacheMatches(bodies, softening)) evaluate(bodies, softening, pool);
+
+        double energy = 0;
+        for (size_t k = 0; k < octree.size(); k++) energy += octree.m[k] * potential[k];
+        return 0.5 * G * energy;
+    }
+
+private:
+    // one term of a sum over multi-index pairs: out[target] += in[source] * factor[other], target = source + other
+    struct Term {
+        uint16_t target;
+        uint16_t source;
+        uint16_t other;
+    };
+
+    struct Expansions {
+        int order = -1;
+        size_t terms = 0;
+        std::vector<int> a, b, c, degree;
+        std::vector<double> inverse_factorial;
+        // index of n - e_i and n - 2 e_i per axis, terms when absent
+        std::vector<int> minus1[3], minus2[3];
+        // index of n + e_i for |n| < order
+        std::vector<int> plus1[3];
+        // recurrence factors -(2|n| - 1) / |n| and -(|n| - 1) / |n|
+        std::vector<double> first_factor, second_factor;
+        // all (j, k) with |j + k| <= order, as (j + k, j, k), those of j in [sums_begin[j], sums_begin[j + 1])
+        std::vector<Term> sums;
+        std::vector<size_t> sums_begin;
+
+        void prepare(int p) {
+            if (order == p) return;
+            order = p;
+
+            std::vector<int> index((p + 1) * (p + 1) * (p + 1), -1);
+            auto at = [&](int x, int y, int z) { return (x * (p + 1) + y) * (p + 1) + z; };
+
+            a.clear();
+            b.clear();
+            c.clear();
+            degree.clear();
+            inverse_factorial.clear();
+            // graded order, every lower order is a prefix
+            for (int d = 0; d <= p; d++) {
+                for (int x = d; x >= 0; x--) {
+                    for (int y = d - x; y >= 0; y--) {
+                        int z = d - x - y;
+                        index[at(x, y, z)] = int(a.size());
+                        a.push_back(x);
+                        b.push_back(y);
+                        c.push_back(z);
+                        degree.push_back(d);
+                        inverse_factorial.push_back(1 / (std::tgamma(x + 1.0) * std::tgamma(y + 1.0) * std::tgamma(z + 1.0)));
+                    }
+                }
+            }
+            terms = a.size();
+
+            auto find = [&](int x, int y, int z) {
+                if (x < 0 || y < 0 || z < 0 || x + y + z > p) return int(terms);
+                return index[at(x, y, z)];
+            };
+
+            for (int i = 0; i < 3; i++) {
+                minus1[i].resize(terms);
+                minus2[i].resize(terms);
+                plus1[i].resize(terms);
+                for (size_t t = 0; t < terms; t++) {
+                    int e[3] = {i == 0, i == 1, i == 2};
+                    minus1[i][t] = find(a[t] - e[0], b[t] - e[1], c[t] - e[2]);
+                    minus2[i][t] = find(a[t] - 2 * e[0], b[t] - 2 * e[1], c[t] - 2 * e[2]);
+                    plus1[i][t] = find(a[t] + e[0], b[t] + e[1], c[t] + e[2]);
+                }
+            }
+
+            first_factor.resize(terms);
+            second_factor.resize(terms);
+            for (size_t t = 1; t < terms; t++) {
+                first_factor[t] = -(2.0 * degree[t] - 1) / degree[t];
+                second_factor[t] = -(degree[t] - 1.0) / degree[t];
+            }
+
+            sums.clear();
+            sums_begin.clear();
+            for (size_t j = 0; j < terms; j++) {
+                sums_begin.push_back(sums.size());
+                for (size_t k = 0; k < terms; k++) {
+                    int sum = find(a[j] + a[k], b[j] + b[k], c[j] + c[k]);
+                    if (sum < int(terms)) sums.push_back({uint16_t(sum), uint16_t(j), uint16_t(k)});
+                }
+            }
+            sums_begin.push_back(sums.size());
+        }
+
+        // d^n / n! for every term
+        void powers(glm::dvec3 d, double* out) const {
+            double px[max_order + 1], py[max_order + 1], pz[max_order + 1];
+            px[0] = py[0] = pz[0] = 1;
+            for (int k = 1; k <= order; k++) {
+                px[k] = px[k - 1] * d.x;
+                py[k] = py[k - 1] * d.y;
+                pz[k] = pz[k - 1] * d.z;
+            }
+            for (size_t t = 0; t < terms; t++) out[t] = px[a[t]] * py[b[t]] * pz[c[t]] * inverse_factorial[t];
+        }
+
+        // out[j] += sum over k of in[k] * factor[j + k], the shape of both M2L and L2L
+        void gather(const double* in, const double* factor, double* out) const {
+            for (size_t j = 0; j < terms; j++) {
+                double sum = 0;
+                for (size_t s = sums_begin[j]; s < sums_begin[j + 1]; s++) sum += in[sums[s].other] * factor[sums[s].target];
+                out[j] += sum;
+            }
+        }
+
+        // D^n (1/r) at R for every term
+        void derivatives(glm::dvec3 R, double* out) const {
+            double r2 = glm::dot(R, R);
+            double inv_r2 = 1 / r2;
+            double coordinate[3] = {R.x, R.y, R.z};
+
+            out[0] = std::sqrt(inv_r2);
+            for (size_t t = 1; t < terms; t++) {
+                int n[3] = {a[t], b[t], c[t]};
+                double first = 0, second = 0;
+                for (int i = 0; i < 3; i++) {
+                    if (n[i] >= 1) first += n[i] * coordinate[i] * out[minus1[i][t]];
+                    if (n[i] >= 2) second += n[i] * (n[i] - 1) * out[minus2[i][t]];
+                }
+                out[t] = (first_factor[t] * first + second_factor[t] * second) * inv_r2;
+            }
+        }
+    };
+
+    struct CellData {
+        glm::dvec3 center;
+        double radius;
+    };
+
+    // pairs one task found, targets inside its subtree
+    struct Pairs {
+        std::vector<std::pair<uint32_t, uint32_t>> far, near;
+    };
+
+    Octree octree;
+    Expansions expansions;
+    std::vector<CellData> data;
+    // per cell, expansions.terms each
+    std::vector<double> multipoles, locals;
+    // the first task takes the pairs whose targets lie above the split level
+    std::vector<Pairs> tasks;
+    // results per sorted body, without G
+    std::vector<double> qx, qy, qz, potential;
+
+    bool cache_valid = false;
+    double cached_softening = 0;
+    double cached_theta = 0;
+    int cached_order = 0;
+
+    bool cacheMatches(const BodyStore& bodies, double softening) const {
+        if (!cache_valid || cached_softening != softening || cached_theta != theta || cached_order != order) return false;
+        return octree.holds(bodies);
+    }
+
+    void evaluate(const BodyStore& bodies, double softening, ThreadPool& pool) {
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point start = Clock::now();
+
+        expansions.prepare(std::clamp(order, 1, max_order));
+        octree.build(bodies, std::max<uint32_t>(1, leaf_size), pool);
+        upward(pool);
+        Clock::time_point built = Clock::now();
+
+        traverse(pool);
+        Clock::time_point traversed = Clock::now();
+
+        transfer(pool);
+        Clock::time_point transferred = Clock::now();
+
+        downward(softening, pool);
+
+        build_seconds = std::chrono::duration<double>(built - start).count();
+        traversal_seconds = std::chrono::duration<double>(traversed - built).count();
+        m2l_seconds = std::chrono::duration<double>(transferred - traversed).count();
+        evaluation_seconds = std::chrono::duration<double>(Clock::now() - transferred).count();
+        cell_count = octree.cells.size();
+        depth = octree.depth();
+
+        cache_valid = true;
+        cached_softening = softening;
+        cached_theta = theta;
+        cached_order = order;
+    }
+
+    double* multipole(size_t cell) {
+        return multipoles.data() + cell * expansions.terms;
+    }
+
+    double* local(size_t cell) {
+        return locals.data() + cell * expansions.terms;
+    }
+
+    // P2M at the leaves and M2M above them, one level at a time from the deepest
+    void upward(ThreadPool& pool) {
+        size_t terms = expansions.terms;
+        data.resize(octree.cells.size());
+        multipoles.assign(octree.cells.size() * terms, 0.0);
+        locals.assign(octree.cells.size() * terms, 0.0);
+
+        for (size_t level = octree.depth(); level-- > 0;) {
+            pool.parallelFor(octree.level_start[level], octree.level_start[level + 1], [&](size_t i) {
+                const Octree::Cell& cell = octree.cells[i];
+                CellData& cell_data = data[i];
+                double* M = multipole(i);
+                std::vector<double> shift(terms);
+
+                double mass = 0;
+                glm::dvec3 weighted(0);
+                if (cell.leaf()) {
+                    for (uint32_t k = cell.first_body; k < cell.first_body + cell.body_count; k++) {
+                        mass += octree.m[k];
+                        weighted += octree.m[k] * octree.position(k);
+                    }
+                } else {
+                    for (uint32_t c = cell.first_child; c < cell.first_child + cell.child_count; c++) {
+                        mass += multipole(c)[0];
+                        weighted += multipole(c)[0] * data[c].center;
+                    }
+                }
+                cell_data.center = mass > 0 ? weighted / mass : cell.center;
+                cell_data.radius = 0;
+
+                if (cell.leaf()) {
+                    for (uint32_t k = cell.first_body; k < cell.first_body + cell.body_count; k++) {
+                        glm::dvec3 d = octree.position(k) - cell_data.center;
+                        cell_data.radius = std::max(cell_data.radius, glm::length(d));
+                        expansions.powers(d, shift.data());
+                        for (size_t t = 0; t < terms; t++) M[t] += octree.m[k] * shift[t];
+                    }
+                } else {
+                    for (uint32_t c = cell.first_child; c < cell.first_child + cell.child_count; c++) {
+                        glm::dvec3 t = data[c].center - cell_data.center;
+                        cell_data.radius = std::max(cell_data.radius, glm::length(t) + data[c].radius);
+                        expansions.powers(t, shift.data());
+                        const double* child = multipole(c);
+                        for (const Term& term : expansions.sums) M[term.target] += child[term.source] * shift[term.other];
+                    }
+                }
+            }, 16);
+        }
+    }
+
+    bool wellSeparated(uint32_t target, uint32_t source) const {
+        glm::dvec3 R = data[target].center - data[source].center;
+        double reach = data[target].radius + data[source].radius;
+        return reach * reach < theta * theta * glm::dot(R, R);
+    }
+
+    // the dual-tree walk from one pair, pairs with targets at or below the split cell deferred to its task
+    void interact(uint32_t target, uint32_t source, size_t split_begin, size_t split_end,
+                  std::vector<std::vector<uint32_t>>* deferred, Pairs& pairs) const {
+        if (deferred && target >= split_begin && target < split_end) {
+            (*deferred)[target - split_begin].push_back(source);
+            return;
+        }
+
+        const Octree::Cell& a = octree.cells[target];
+        const Octree::Cell& b = octree.cells[source];
+
+        if (target == source) {
+            if (a.leaf()) {
+                pairs.near.emplace_back(target, source);
+                return;
+            }
+            for (uint32_t i = a.first_child; i < a.first_child + a.child_count; i++) {
+                for (uint32_t j = a.first_child; j < a.first_child + a.child_count; j++) interact(i, j, split_begin, split_end, deferred, pairs);
+            }
+        } else if (wellSeparated(target, source)) {
+            pairs.far.emplace_back(target, source);
+        } else if (a.leaf() && b.leaf()) {
+            pairs.near.emplace_back(target, source);
+        } else if (b.leaf() || (!a.leaf() && data[target].radius >= data[source].radius)) {
+            for (uint32_t i = a.first_child; i < a.first_child + a.child_count; i++) interact(i, source, split_begin, split_end, deferred, pairs);
+        } else {
+            for (uint32_t j = b.first_child; j < b.first_child + b.child_count; j++) interact(target, j, split_begin, split_end, deferred, pairs);
+        }
+    }
+
+    void traverse(ThreadPool& pool) {
+        // the shallowest level with a few cells per thread, cells above it are the targets of the serial start
+        size_t split = 0;
+        while (split + 1 < octree.depth() && octree.level_start[split + 1] - octree.level_start[split] < 8 * size_t(pool.size())) split++;
+        size_t split_begin = octree.level_start[split];
+        size_t split_end = octree.level_start[split + 1];
+
+        std::vector<std::vector<uint32_t>> deferred(split_end - split_begin);
+        tasks.assign(1 + deferred.size(), Pairs());
+        if (octree.size() > 0) interact(0, 0, split_begin, split_end, &deferred, tasks[0]);
+
+        pool.parallelFor(0, deferred.size(), [&](size_t task) {
+            for (uint32_t source : deferred[task]) interact(uint32_t(split_begin + task), source, 0, 0, nullptr, tasks[task + 1]);
+        });
+
+        m2l_count = 0;
+        p2p_count = 0;
+        for (const Pairs& pairs : tasks) {
+            m2l_count += pairs.far.size();
+            for (const auto& pair : pairs.near) p2p_count += uint64_t(octree.cells[pair.first].body_count) * octree.cells[pair.second].body_count;
+        }
+    }
+
+    // M2L over every far pair, each task's pairs on one thread
+    void transfer(ThreadPool& pool) {
+        size_t terms = expansions.terms;
+
+        auto apply = [&](const Pairs& pairs) {
+            std::vector<double> D(terms), M(terms);
+            for (const auto& pair : pairs.far) {
+                expansions.derivatives(data[pair.first].center - data[pair.second].center, D.data());
+
+                const double* source = multipole(pair.second);
+                for (size_t t = 0; t < terms; t++) M[t] = expansions.degree[t] & 1 ? -source[t] : source[t];
+
+                expansions.gather(M.data(), D.data(), local(pair.first));
+            }
+        };
+
+        apply(tasks[0]);
+        pool.parallelFor(1, tasks.size(), [&](size_t task) { apply(tasks[task]); });
+    }
+
+    // L2L down the levels, L2P at the leaves, then the direct sums of the near pairs
+    void downward(double softening, ThreadPool& pool) {
+        size_t terms = expansions.terms;
+        size_t n = octree.size();
+        double eps2 = softening * softening;
+
+        for (size_t level = 0; level + 1 < octree.depth(); level++) {
+            pool.parallelFor(octree.level_start[level], octree.level_start[level + 1], [&](size_t i) {
+                const Octree::Cell& cell = octree.cells[i];
+                std::vector<double> shift(terms);
+                const double* parent = local(i);
+                for (uint32_t c = cell.first_child; c < cell.first_child + cell.child_count; c++) {
+                    expansions.powers(data[c].center - data[i].center, shift.data());
+                    expansions.gather(shift.data(), parent, local(c));
+                }
+            }, 16);
+        }
+
+        qx.assign(n, 0.0);
+        qy.assign(n, 0.0);
+        qz.assign(n, 0.0);
+        potential.assign(n, 0.0);
+
+        pool.parallelFor(0, octree.leaves.size(), [&](size_t l) {
+            uint32_t i = octree.leaves[l];
+            const Octree::Cell& cell = octree.cells[i];
+            const double* L = local(i);
+            std::vector<double> shift(terms);
+
+            // Phi = sum L_n d^n / n! is the sum m / r, the acceleration its gradient and the potential its negative
+            for (uint32_t k = cell.first_body; k < cell.first_body + cell.body_count; k++) {
+                expansions.powers(octree.position(k) - data[i].center, shift.data());
+                double phi = 0, gx = 0, gy = 0, gz = 0;
+                for (size_t t = 0; t < terms; t++) {
+                    phi += L[t] * shift[t];
+                    if (expansions.degree[t] < expansions.order) {
+                        gx += L[expansions.plus1[0][t]] * shift[t];
+                        gy += L[expansions.plus1[1][t]] * shift[t];
+                        gz += L[expansions.plus1[2][t]] * shift[t];
+                    }
+                }
+                qx[k] = gx;
+                qy[k] = gy;
+                qz[k] = gz;
+                potential[k] = -phi;
+            }
+        }, 16);
+
+        // sources outside, the target leaf's bodies inside, as in BarnesHut; a leaf paired with itself meets every
+        // body once at zero distance, which with softening only adds -m / eps to the potential and is taken back
+        double self = eps2 > 0 ? 1 / std::sqrt(eps2) : 0.0;
+        auto near = [&](const Pairs& pairs) {
+            for (const auto& pair : pairs.near) {
+                const Octree::Cell& target = octree.cells[pair.first];
+                const Octree::Cell& source = octree.cells[pair.second];
+                uint32_t first = target.first_body;
+                uint32_t count = target.body_count;
+                const double* gx = octree.x.data() + first;
+                const double* gy = octree.y.data() + first;
+                const double* gz = octree.z.data() + first;
+                double* ax = qx.data() + first;
+                double* ay = qy.data() + first;
+                double* az = qz.data() + first;
+                double* phi = potential.data() + first;
+
+                for (uint32_t j = source.first_body; j < source.first_body + source.body_count; j++) {
+                    double xj = octree.x[j], yj = octree.y[j], zj = octree.z[j], mj = octree.m[j];
+                    for (uint32_t k = 0; k < count; k++) {
+                        double dx = xj - gx[k];
+                        double dy = yj - gy[k];
+                        double dz = zj - gz[k];
+                        double s2 = dx * dx + dy * dy + dz * dz + eps2;
+                        double inv_r = s2 > 0 ? 1 / std::sqrt(s2) : 0.0;
+                        double m_inv_r = mj * inv_r;
+                        double m_inv_r3 = m_inv_r * inv_r * inv_r;
+                        ax[k] += m_inv_r3 * dx;
+                        ay[k] += m_inv_r3 * dy;
+                        az[k] += m_inv_r3 * dz;
+                        phi[k] -= m_inv_r;
+                    }
+                }
+
+                if (pair.first == pair.second) {
+                    for (uint32_t k = 0; k < count; k++) phi[k] += octree.m[first + k] * self;
+                }
+            }
+        };
+
+        near(tasks[0]);
+        pool.parallelFor(1, tasks.size(), [&](size_t task) { near(tasks[task]); });
+    }
+};
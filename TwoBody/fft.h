@@ -0,0 +1,218 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Iterative radix-2 complex FFT of one power-of-two length, unnormalized in both directions.
+class Fft {
+public:
+    explicit Fft(size_t n = 1) {
+        prepare(n);
+    }
+
+    void prepare(size_t n) {
+        if (n == length) return;
+        length = n;
+
+        int bits = 0;
+        while ((size_t(1) << bits) < n) bits++;
+
+        reversed.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            size_t r = 0;
+            for (int b = 0; b < bits; b++) r |= ((i >> b) & 1) << (bits - 1 - b);
+            reversed[i] = uint32_t(r);
+        }
+
+        twiddle.resize(n / 2);
+        for (size_t k = 0; k < n / 2; k++) twiddle[k] = std::polar(1.0, -glm::two_pi<double>() * double(k) / double(n));
+    }
+
+    size_t size() const {
+        return length;
+    }
+
+    // X_k = sum x_j e^(-2 pi i jk / n), or with e^(+2 pi i jk / n) for the inverse
+    void transform(std::complex<double>* data, bool inverse) const {
+        for (size_t i = 0; i < length; i++) {
+            if (i < reversed[i]) std::swap(data[i], data[reversed[i]]);
+        }
+
+        for (size_t span = 2; span <= length; span *= 2) {
+            size_t half = span / 2;
+            size_t stride = length / span;
+            for (size_t start = 0; start < length; start += span) {
+                for (size_t k = 0; k < half; k++) {
+                    std::complex<double> w = twiddle[k * stride];
+                    double wi = inverse ? -w.imag() : w.imag();
+                    std::complex<double> u = data[start + k];
+                    std::complex<double> x = data[start + k + half];
+                    // spelled out, std::complex's product also checks for infinities on every call
+                    std::complex<double> v(x.real() * w.real() - x.imag() * wi, x.real() * wi + x.imag() * w.real());
+                    data[start + k] = u + v;
+                    data[start + k + half] = u - v;
+                }
+            }
+        }
+    }
+
+private:
+    size_t length = 0;
+    std::vector<uint32_t> reversed;
+    std::vector<std::complex<double>> twiddle;
+};
+
+// Real-to-complex FFT of an n^3 grid, n a power of two, real[(z * n + y) * n + x].
+// The spectrum keeps the n / 2 + 1 non-negative x frequencies, spectrum[(z * n + y) * (n / 2 + 1) + kx]; the rest
+// follow from the symmetry of a real signal. Along x every line of n reals is transformed as n / 2 complex values,
+// the even samples real and the odd imaginary, and the two halves are separated afterwards; y and z are complex
+// passes over gathered columns. Each pass transforms independent lines, split over the pool by planes.
+// A zero-padded grid only has data in its first `used` points per axis: forward skips the lines that hold nothing but
+// padding, and inverse only produces the real values inside that corner, which is all a convolution with padding for
+// isolated boundaries reads back.
+class RealFft3d {
+public:
+    void prepare(size_t n) {
+        if (n == size) return;
+        size = n;
+        half = n / 2 + 1;
+        line.prepare(n / 2);
+        column.prepare(n);
+
+        line_twiddle.resize(n / 2 + 1);
+        for (size_t k = 0; k <= n / 2; k++) line_twiddle[k] = std::polar(1.0, -glm::two_pi<double>() * double(k) / double(n));
+    }
+
+    size_t extent() const {
+        return size;
+    }
+
+    size_t halfExtent() const {
+        return half;
+    }
+
+    void forward(const std::vector<double>& real, std::vector<std::complex<double>>& spectrum, ThreadPool& pool, size_t used = 0) const {
+        size_t n = size;
+        size_t m = n / 2;
+        if (used == 0 || used > n) used = n;
+        spectrum.resize(n * n * half);
+
+        pool.parallelFor(0, n, [&](size_t z) {
+            std::vector<std::complex<double>> packed(m);
+            for (size_t y = 0; y < n; y++) {
+                const double* in = real.data() + (z * n + y) * n;
+                std::complex<double>* out = spectrum.data() + (z * n + y) * half;
+                if (y >= used || z >= used) {
+                    std::fill(out, out + half, std::complex<double>(0));
+                    continue;
+                }
+
+                for (size_t j = 0; j < m; j++) packed[j] = std::complex<double>(in[2 * j], in[2 * j + 1]);
+                line.transform(packed.data(), false);
+
+                // X_k = E_k + w^k O_k with E_k = (Z_k + conj Z_(m - k)) / 2 and O_k = (Z_k - conj Z_(m - k)) / 2i
+                for (size_t k = 0; k <= m; k++) {
+                    std::complex<double> a = packed[k % m];
+                    std::complex<double> b = std::conj(packed[(m - k) % m]);
+                    std::complex<double> even = 0.5 * (a + b);
+                    std::complex<double> odd = std::complex<double>(0, -0.5) * (a - b);
+                    out[k] = even + line_twiddle[k] * odd;
+                }
+            }
+        });
+
+        columns(spectrum, false, used, pool);
+    }
+
+    // the inverse of forward, scaled so that inverse(forward(x)) = x; the spectrum is used as scratch space
+    void inverse(std::vector<std::complex<double>>& spectrum, std::vector<double>& real, ThreadPool& pool, size_t used = 0) const {
+        size_t n = size;
+        size_t m = n / 2;
+        if (used == 0 || used > n) used = n;
+        real.resize(n * n * n);
+
+        columns(spectrum, true, used, pool);
+
+        double scale = 1 / (double(m) * double(n) * double(n));
+        pool.parallelFor(0, used, [&](size_t z) {
+            std::vector<std::complex<double>> packed(m);
+            for (size_t y = 0; y < used; y++) {
+                const std::complex<double>* in = spectrum.data() + (z * n + y) * half;
+                double* out = real.data() + (z * n + y) * n;
+
+                // Z_k = E_k + i O_k with E_k = (X_k + conj X_(m - k)) / 2 and O_k = (X_k - conj X_(m - k)) / 2 w^k
+                for (size_t k = 0; k < m; k++) {
+                    std::complex<double> a = in[k];
+                    std::complex<double> b = std::conj(in[m - k]);
+                    std::complex<double> even = 0.5 * (a + b);
+                    std::complex<double> odd = 0.5 * (a - b) * std::conj(line_twiddle[k]);
+                    packed[k] = even + std::complex<double>(0, 1) * odd;
+                }
+                line.transform(packed.data(), true);
+
+                for (size_t j = 0; j < m; j++) {
+                    out[2 * j] = packed[j].real() * scale;
+                    out[2 * j + 1] = packed[j].imag() * scale;
+                }
+            }
+        });
+    }
+
+private:
+    size_t size = 0;
+    size_t half = 0;
+    Fft line;
+    Fft column;
+    // e^(-2 pi i k / n) for the split of the packed x lines
+    std::vector<std::complex<double>> line_twiddle;
+
+    // the y pass plane by plane in z, then the z pass plane by plane in y, reversed for the inverse; columns are
+    // gathered a few neighbouring frequencies at a time so every strided read brings in a whole run of them.
+    // The y pass only covers the planes below used: forward the others are still zero, inverse they are not read.
+    void columns(std::vector<std::complex<double>>& spectrum, bool inverse, size_t used, ThreadPool& pool) const {
+        const size_t block = 8;
+        size_t n = size;
+
+        auto pass = [&](std::complex<double>* first, size_t stride, std::vector<std::complex<double>>& buffer) {
+            for (size_t k0 = 0; k0 < half; k0 += block) {
+                size_t count = std::min(block, half - k0);
+                for (size_t i = 0; i < n; i++) {
+                    for (size_t b = 0; b < count; b++) buffer[b * n + i] = first[i * stride + k0 + b];
+                }
+                for (size_t b = 0; b < count; b++) column.transform(buffer.data() + b * n, inverse);
+                for (size_t i = 0; i < n; i++) {
+                    for (size_t b = 0; b < count; b++) first[i * stride + k0 + b] = buffer[b * n + i];
+                }
+            }
+        };
+
+        auto y_pass = [&] {
+            pool.parallelFor(0, used, [&](size_t z) {
+                std::vector<std::complex<double>> buffer(block * n);
+                pass(spectrum.data() + z * n * half, half, buffer);
+            });
+        };
+        auto z_pass = [&] {
+            pool.parallelFor(0, n, [&](size_t y) {
+                std::vector<std::complex<double>> buffer(block * n);
+                pass(spectrum.data() + y * half, n * half, buffer);
+            });
+        };
+
+        if (inverse) {
+            z_pass();
+            y_pass();
+        } else {
+            y_pass();
+            z_pass();
+        }
+    }
+};
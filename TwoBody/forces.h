@@ -0,0 +1,617 @@
+#pragma once
+
+#include "barnes_hut.h"
+#include "body_store.h"
+#include "direct_summation.h"
+#include "fast_multipole.h"
+#include "geopotential.h"
+#include "particle_mesh.h"
+#include "thread_pool.h"
+#include "time_base.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Force terms are policies with
+//     void accumulate(BodyStore& bodies, double G, const DoubleDouble& t) const
+// adding their accelerations at time t to ax, ay, az, and optionally
+//     double potentialEnergy(const BodyStore& bodies, double G, const DoubleDouble& t) const
+// ForceModel folds a compile-time list of them into computeAccelerations, so every term is a direct,
+// inlinable call. Picking a model at runtime is a single switch per step, see Simulation::withForces.
+// Body 0 is the central body in the near-Earth terms, with its pole along the world Y axis.
+
+enum class GravitySolver {
+    Direct,
+    BarnesHut,
+    FastMultipole,
+    ParticleMesh
+};
+
+inline const char* gravitySolverName(GravitySolver solver) {
+    switch (solver) {
+    case GravitySolver::BarnesHut: return "Barnes-Hut tree";
+    case GravitySolver::FastMultipole: return "Fast multipole method";
+    case GravitySolver::ParticleMesh: return "Particle mesh";
+    default: return "Direct summation";
+    }
+}
+
+// Newtonian point-mass gravity evaluated by direct pairwise summation, or approximated by a tree, multipole
+// or mesh solver.
+// Small systems are summed serially with each pair visited once. From parallel_threshold bodies up the rows
+// are split over the thread pool, every thread scattering its pairs into private buffers that are added
+// afterwards, so the rounding depends on the thread count. Reproducible mode instead gathers each body's
+// acceleration over all others in index order, twice the pair work but bit-identical for any number of
+// threads, and to the serial sum, which hands every body its terms in the same order. Contracting a * b + c
+// into FMA would still differ between builds, the project compiles with /fp:precise which keeps them
+// separate, GCC and Clang builds need -ffp-contract=off.
+// Outside reproducible mode large systems go to the vectorized DirectSummation kernel, which also gathers
+// over all others but with AVX2 or AVX-512 and fused multiply-adds.
+// The Barnes-Hut, fast multipole and particle-mesh solvers replace all of this for any body count once
+// selected, potential energy included.
+class PointMassGravity {
+public:
+    double G;
+    double softening;
+
+    bool reproducible = false;
+    size_t parallel_threshold = 256;
+    // null is ThreadPool::global()
+    ThreadPool* pool = nullptr;
+
+    bool vectorized = true;
+    mutable DirectSummation direct;
+
+    GravitySolver solver = GravitySolver::Direct;
+    mutable BarnesHut tree;
+    mutable FastMultipole multipole;
+    mutable ParticleMesh mesh;
+
+    PointMassGravity(double G = 1.0, double softening = 0.0) : G(G), softening(softening) {
+
+    }
+
+    void computeAccelerations(BodyStore& bodies) const {
+        std::fill(bodies.ax.begin(), bodies.ax.end(), 0.0);
+        std::fill(bodies.ay.begin(), bodies.ay.end(), 0.0);
+        std::fill(bodies.az.begin(), bodies.az.end(), 0.0);
+
+        accumulate(bodies, G, 0);
+
+        bodies.accelerations_valid = true;
+    }
+
+    void accumulate(BodyStore& bodies, double, const DoubleDouble&) const {
+        size_t n = bodies.size();
+
+        if (solver == GravitySolver::BarnesHut) {
+            tree.accumulate(bodies, G, softening, bodies.ax.data(), bodies.ay.data(), bodies.az.data(), threads());
+        } else if (solver == GravitySolver::FastMultipole) {
+            multipole.accumulate(bodies, G, softening, bodies.ax.data(), bodies.ay.data(), bodies.az.data(), threads());
+        } else if (solver == GravitySolver::ParticleMesh) {
+            mesh.accumulate(bodies, G, softening, bodies.ax.data(), bodies.ay.data(), bodies.az.data(), threads());
+        } else if (n < parallel_threshold) {
+            accumulateRows(bodies, 0, n, bodies.ax.data(), bodies.ay.data(), bodies.az.data());
+        } else if (reproducible) {
+            accumulateGathered(bodies);
+        } else if (vectorized) {
+            direct.accumulate(bodies, G, softening, bodies.ax.data(), bodies.ay.data(), bodies.az.data(), threads());
+        } else {
+            accumulateScattered(bodies);
+        }
+    }
+
+    double potentialEnergy(const BodyStore& bodies) const {
+        size_t n = bodies.size();
+        if (solver == GravitySolver::BarnesHut) return tree.potentialEnergy(bodies, G, softening, threads());
+        if (solver == GravitySolver::FastMultipole) return multipole.potentialEnergy(bodies, G, softening, threads());
+        if (solver == GravitySolver::ParticleMesh) return mesh.potentialEnergy(bodies, G, softening, threads());
+        if (n < parallel_threshold) return -rowsPotential(bodies, 0, n);
+
+        // block sums in a fixed order, the same for every thread count
+        return -threads().deterministicSum(0, n, [&](size_t i) { return rowsPotential(bodies, i, i + 1); }, 16);
+    }
+
+    double potentialEnergy(const BodyStore& bodies, double, const DoubleDouble&) const {
+        return potentialEnergy(bodies);
+    }
+
+    // the pool everything of this force model runs on
+    ThreadPool& threads() const {
+        return pool ? *pool : ThreadPool::global();
+    }
+
+private:
+    // one block of private x, y, z acceleration buffers per thread of the scattered sum
+    mutable std::vector<double> scratch;
+
+    // pairs (i, j > i) for i in [first, last), each adding to both bodies
+    void accumulateRows(const BodyStore& bodies, size_t first, size_t last, double* ax, double* ay, double* az) const {
+        size_t n = bodies.size();
+        double eps2 = softening * softening;
+
+        for (size_t i = first; i < last; i++) {
+            for (size_t j = i + 1; j < n; j++) {
+                double dx = bodies.x[j] - bodies.x[i];
+                double dy = bodies.y[j] - bodies.y[i];
+                double dz = bodies.z[j] - bodies.z[i];
+
+                double r2 = dx * dx + dy * dy + dz * dz + eps2;
+                double inv_r = 1.0 / std::sqrt(r2);
+                double inv_r3 = G * inv_r * inv_r * inv_r;
+
+                ax[i] += dx * inv_r3 * bodies.mass[j];
+                ay[i] += dy * inv_r3 * bodies.mass[j];
+                az[i] += dz * inv_r3 * bodies.mass[j];
+
+                ax[j] -= dx * inv_r3 * bodies.mass[i];
+                ay[j] -= dy * inv_r3 * bodies.mass[i];
+                az[j] -= dz * inv_r3 * bodies.mass[i];
+            }
+        }
+    }
+
+    // G m_i m_j / r over the pairs (i, j > i) for i in [first, last)
+    double rowsPotential(const BodyStore& bodies, size_t first, size_t last) const {
+        size_t n = bodies.size();
+        double eps2 = softening * softening;
+        double energy = 0;
+
+        for (size_t i = first; i < last; i++) {
+            for (size_t j = i + 1; j < n; j++) {
+                double dx = bodies.x[j] - bodies.x[i];
+                double dy = bodies.y[j] - bodies.y[i];
+                double dz = bodies.z[j] - bodies.z[i];
+
+                energy += G * bodies.mass[i] * bodies.mass[j] / std::sqrt(dx * dx + dy * dy + dz * dz + eps2);
+            }
+        }
+
+        return energy;
+    }
+
+    void accumulateScattered(BodyStore& bodies) const {
+        size_t n = bodies.size();
+        size_t parts = threads().size();
+        scratch.assign(parts * 3 * n, 0.0);
+
+        // row ranges with equal pair counts, row i has n - 1 - i pairs
+        std::vector<size_t> row_start(parts + 1, n);
+        double total_pairs = 0.5 * double(n) * double(n - 1);
+        size_t row = 0;
+        double pairs = 0;
+        for (size_t part = 0; part < parts; part++) {
+            row_start[part] = row;
+            while (row < n && pairs < total_pairs * double(part + 1) / double(parts)) pairs += double(n - 1 - row++);
+        }
+
+        threads().parallelFor(0, parts, [&](size_t part) {
+            double* buffer = scratch.data() + part * 3 * n;
+            accumulateRows(bodies, row_start[part], row_start[part + 1], buffer, buffer + n, buffer + 2 * n);
+        });
+
+        threads().parallelFor(0, n, [&](size_t i) {
+            for (size_t part = 0; part < parts; part++) {
+                const double* buffer = scratch.data() + part * 3 * n;
+                bodies.ax[i] += buffer[i];
+                bodies.ay[i] += buffer[n + i];
+                bodies.az[i] += buffer[2 * n + i];
+            }
+        }, 256);
+    }
+
+    void accumulateGathered(BodyStore& bodies) const {
+        size_t n = bodies.size();
+        double eps2 = softening * softening;
+
+        threads().parallelFor(0, n, [&](size_t i) {
+            double ax = 0, ay = 0, az = 0;
+
+            for (size_t j = 0; j < n; j++) {
+                if (j == i) continue;
+
+                double dx = bodies.x[j] - bodies.x[i];
+                double dy = bodies.y[j] - bodies.y[i];
+                double dz = bodies.z[j] - bodies.z[i];
+
+                double r2 = dx * dx + dy * dy + dz * dz + eps2;
+                double inv_r = 1.0 / std::sqrt(r2);
+                double inv_r3 = G * inv_r * inv_r * inv_r;
+
+                ax += dx * inv_r3 * bodies.mass[j];
+                ay += dy * inv_r3 * bodies.mass[j];
+                az += dz * inv_r3 * bodies.mass[j];
+            }
+
+            bodies.ax[i] += ax;
+            bodies.ay[i] += ay;
+            bodies.az[i] += az;
+        }, 16);
+    }
+};
+
+// adds acceleration a on body i > 0 and the reaction that keeps the total momentum on body 0
+inline void addCentralReaction(BodyStore& bodies, size_t i, glm::dvec3 a) {
+    bodies.ax[i] += a.x;
+    bodies.ay[i] += a.y;
+    bodies.az[i] += a.z;
+
+    double ratio = bodies.mass[i] / bodies.mass[0];
+    bodies.ax[0] -= a.x * ratio;
+    bodies.ay[0] -= a.y * ratio;
+    bodies.az[0] -= a.z * ratio;
+}
+
+// Body 0's full spherical harmonic field beyond the point mass. The body-fixed frame turns about
+// world Y at rotation_rate, its orientation is held for the duration of an evaluation.
+class SphericalHarmonicGravity {
+public:
+    const SphericalHarmonicField* field = nullptr;
+    double radius = 1;
+    int degree = 360;
+
+    // radians per time unit, one sidereal day per 1 / 27.4 lunar month
+    double rotation_rate = 27.3217 / 0.99727;
+
+    double angle(const DoubleDouble& t) const {
+        return wrap(t * rotation_rate, glm::two_pi<double>());
+    }
+
+    void accumulate(BodyStore& bodies, double G, const DoubleDouble& t) const {
+        size_t n = bodies.size();
+        if (!field || n < 2) return;
+
+        evaluate(bodies, G, t, nullptr);
+
+        for (size_t i = 1; i < n; i++) addCentralReaction(bodies, i, fromFieldFrame(accelerations[i - 1], t));
+    }
+
+    double potentialEnergy(const BodyStore& bodies, double G, const DoubleDouble& t) const {
+        size_t n = bodies.size();
+        if (!field || n < 2) return 0;
+
+        std::vector<double> potential(n - 1);
+        evaluate(bodies, G, t, potential.data());
+
+        double energy = 0;
+        for (size_t i = 1; i < n; i++) energy -= bodies.mass[i] * potential[i - 1];
+        return energy;
+    }
+
+private:
+    // scratch for the field evaluation, reused between steps
+    mutable std::vector<glm::dvec3> points, accelerations;
+
+    void evaluate(const BodyStore& bodies, double G, const DoubleDouble& t, double* potential) const {
+        size_t n = bodies.size();
+        points.resize(n - 1);
+        accelerations.resize(n - 1);
+
+        for (size_t i = 1; i < n; i++) points[i - 1] = toFieldFrame(bodies.position(i) - bodies.position(0), t);
+
+        field->evaluate(points.data(), n - 1, G * bodies.mass[0], radius, accelerations.data(), potential, degree);
+    }
+
+    // world Y is the field's z axis, world X its x axis at zero angle
+    glm::dvec3 toFieldFrame(glm::dvec3 w, const DoubleDouble& t) const {
+        double c = std::cos(angle(t)), s = std::sin(angle(t));
+        return glm::dvec3(c * w.x - s * w.z, -s * w.x - c * w.z, w.y);
+    }
+
+    glm::dvec3 fromFieldFrame(glm::dvec3 f, const DoubleDouble& t) const {
+        double c = std::cos(angle(t)), s = std::sin(angle(t));
+        return glm::dvec3(c * f.x - s * f.y, f.z, -s * f.x - c * f.y);
+    }
+};
+
+// Closed-form J2 and J3 zonal terms of body 0, the cheap alternative to a full field for satellites.
+// Defaults are the Earth's unnormalized values.
+class ZonalHarmonics {
+public:
+    double J2 = 1.08263e-3;
+    double J3 = -2.5327e-6;
+    double radius = 1;
+
+    void accumulate(BodyStore& bodies, double G, const DoubleDouble&) const {
+        double mu = G * bodies.mass[0];
+
+        for (size_t i = 1; i < bodies.size(); i++) {
+            glm::dvec3 r = bodies.position(i) - bodies.position(0);
+            double r2 = glm::dot(r, r);
+            double inv_r2 = 1 / r2;
+            double inv_r = std::sqrt(inv_r2);
+
+            // polar axis is world Y
+            double z = r.y;
+            double z2_r2 = z * z * inv_r2;
+
+            double j2 = -1.5 * J2 * mu * radius * radius * inv_r2 * inv_r2 * inv_r;
+            glm::dvec3 a(r.x * (1 - 5 * z2_r2), r.y * (3 - 5 * z2_r2), r.z * (1 - 5 * z2_r2));
+            a *= j2;
+
+            double j3 = -2.5 * J3 * mu * radius * radius * radius * inv_r2 * inv_r2 * inv_r2 * inv_r;
+            double equatorial = 3 * z - 7 * z * z2_r2;
+            a += j3 * glm::dvec3(r.x * equatorial, 6 * z * z - 7 * z * z * z2_r2 - 0.6 * r2, r.z * equatorial);
+
+            addCentralReaction(bodies, i, a);
+        }
+    }
+
+    double potentialEnergy(const BodyStore& bodies, double G, const DoubleDouble&) const {
+        double mu = G * bodies.mass[0];
+        double energy = 0;
+
+        for (size_t i = 1; i < bodies.size(); i++) {
+            glm::dvec3 r = bodies.position(i) - bodies.position(0);
+            double distance = glm::length(r);
+            double s = r.y / distance;
+            double q = radius / distance;
+
+            double p2 = (3 * s * s - 1) / 2;
+            double p3 = (5 * s * s - 3) * s / 2;
+
+            energy += bodies.mass[i] * mu / distance * (J2 * q * q * p2 + J3 * q * q * q * p3);
+        }
+
+        return energy;
+    }
+};
+
+// The Sun on a fixed circular orbit around the system barycenter, in the XZ plane like the Sun of
+// the planetary scene.
+struct SunEphemeris {
+    double mass = 0;
+    double distance = 1;
+    double radius = 0;
+    // mean motion and angle at t = 0
+    double rate = 0;
+    double phase = 0;
+
+    glm::dvec3 position(const DoubleDouble& t) const {
+        double angle = phase + wrap(t * rate, glm::two_pi<double>());
+        return distance * glm::dvec3(std::cos(angle), 0, -std::sin(angle));
+    }
+};
+
+// Differential pull of the Sun, its direct attraction minus the one on the barycenter at the origin,
+// which is what an observer co-moving with the Earth-Moon system sees.
+class ThirdBodySun {
+public:
+    SunEphemeris sun;
+
+    void accumulate(BodyStore& bodies, double G, const DoubleDouble& t) const {
+        if (sun.mass == 0) return;
+
+        glm::dvec3 s = sun.position(t);
+        double gm = G * sun.mass;
+        glm::dvec3 indirect = s * (gm / (sun.distance * sun.distance * sun.distance));
+
+        for (size_t i = 0; i < bodies.size(); i++) {
+            glm::dvec3 d = s - bodies.position(i);
+            double inv_d = 1 / glm::length(d);
+            glm::dvec3 a = d * (gm * inv_d * inv_d * inv_d) - indirect;
+
+            bodies.ax[i] += a.x;
+            bodies.ay[i] += a.y;
+            bodies.az[i] += a.z;
+        }
+    }
+};
+
+// Drag in an atmosphere co-rotating with body 0, a = -1/2 rho B |v| v with B = Cd A / m.
+// Density follows the piecewise exponential table of Vallado, Fundamentals of Astrodynamics, table 8-4.
+// The scenes keep the lunar month but not the Earth's mass, so orbits are scaled dynamically: lengths by
+// the body radius and times by sqrt(R^3 / GM). The drag to gravity ratio of a circular orbit is
+// 1/2 rho B r, so a_scene = -1/2 rho B L |v| v with L the meters per scene unit keeps it physical.
+class AtmosphericDrag {
+public:
+    // bodies before this one are the Earth and the Moon
+    size_t first_body = 2;
+
+    double radius = 1;
+    double radius_km = 6378.137;
+
+    // the real Earth's spin and GM, m^3 / s^2, the atmosphere turns at this rate in dynamical time
+    static constexpr double earth_rotation = 7.2921159e-5;
+    static constexpr double earth_mu = 3.986004418e14;
+
+    // Cd A / m in m^2 / kg, zero turns drag off
+    double ballistic_coefficient = 0.01;
+    // multiplies the table, decay at real densities takes months
+    double density_scale = 1;
+
+    // base altitude km, density kg / m^3, scale height km
+    struct Layer {
+        double altitude, density, scale_height;
+    };
+
+    static constexpr std::array<Layer, 28> layers = {{
+        {0, 1.225, 7.249}, {25, 3.899e-2, 6.349}, {30, 1.774e-2, 6.682}, {40, 3.972e-3, 7.554},
+        {50, 1.057e-3, 8.382}, {60, 3.206e-4, 7.714}, {70, 8.770e-5, 6.549}, {80, 1.905e-5, 5.799},
+        {90, 3.396e-6, 5.382}, {100, 5.297e-7, 5.877}, {110, 9.661e-8, 7.263}, {120, 2.438e-8, 9.473},
+        {130, 8.484e-9, 12.636}, {140, 3.845e-9, 16.149}, {150, 2.070e-9, 22.523}, {180, 5.464e-10, 29.740},
+        {200, 2.789e-10, 37.105}, {250, 7.248e-11, 45.546}, {300, 2.418e-11, 53.628}, {350, 9.518e-12, 53.298},
+        {400, 3.725e-12, 58.515}, {450, 1.585e-12, 60.828}, {500, 6.967e-13, 63.822}, {600, 1.454e-13, 71.835},
+        {700, 3.614e-14, 88.667}, {800, 1.170e-14, 124.64}, {900, 5.245e-15, 181.05}, {1000, 3.019e-15, 268.00}
+    }};
+
+    static double density(double altitude_km) {
+        if (altitude_km < 0) altitude_km = 0;
+
+        auto above = std::upper_bound(layers.begin(), layers.end(), altitude_km,
+            [](double altitude, const Layer& layer) { return altitude < layer.altitude; });
+        const Layer& layer = *(above - 1);
+
+        return layer.density * std::exp(-(altitude_km - layer.altitude) / layer.scale_height);
+    }
+
+    // atmosphere rotation in radians per scene time unit
+    double rotationRate(double G, double central_mass) const {
+        double meters = 1000 * radius_km;
+        double real_time = std::sqrt(meters * meters * meters / earth_mu);
+        double scene_time = std::sqrt(radius * radius * radius / (G * central_mass));
+        return earth_rotation * real_time / scene_time;
+    }
+
+    void accumulate(BodyStore& bodies, double G, const DoubleDouble&) const {
+        if (ballistic_coefficient == 0) return;
+
+        double km_per_unit = radius_km / radius;
+        double meters_per_unit = 1000 * km_per_unit;
+        glm::dvec3 spin(0, rotationRate(G, bodies.mass[0]), 0);
+        // above the table the exponential tail is below any drag worth integrating
+        double top = radius + 1500 / km_per_unit;
+
+        for (size_t i = first_body; i < bodies.size(); i++) {
+            glm::dvec3 r = bodies.position(i) - bodies.position(0);
+            double distance = glm::length(r);
+            if (distance > top) continue;
+
+            glm::dvec3 v = bodies.velocity(i) - bodies.velocity(0) - glm::cross(spin, r);
+            double rho = density_scale * density((distance - radius) * km_per_unit);
+
+            glm::dvec3 a = (-0.5 * rho * ballistic_coefficient * meters_per_unit * glm::length(v)) * v;
+
+            bodies.ax[i] += a.x;
+            bodies.ay[i] += a.y;
+            bodies.az[i] += a.z;
+        }
+    }
+};
+
+// Fraction of the solar disk visible from p past a spherical occulter (Montenbruck & Gill, Satellite Orbits, 3.4.2),
+// 0 in the umbra, 1 in full sunlight, the overlap of the two apparent disks in between.
+inline double sunlightFraction(glm::dvec3 p, glm::dvec3 sun, double sun_radius, glm::dvec3 occulter, double occulter_radius) {
+    glm::dvec3 to_sun = sun - p;
+    glm::dvec3 to_occulter = occulter - p;
+
+    double sun_distance = glm::length(to_sun);
+    double occulter_distance = glm::length(to_occulter);
+    if (occulter_distance <= occulter_radius) return 0;
+
+    double a = std::asin(std::min(sun_radius / sun_distance, 1.0));
+    double b = std::asin(occulter_radius / occulter_distance);
+    double c = std::acos(std::clamp(glm::dot(to_sun, to_occulter) / (sun_distance * occulter_distance), -1.0, 1.0));
+
+    if (c >= a + b) return 1;
+    if (c <= b - a) return 0;
+    if (c <= a - b) return 1 - (b * b) / (a * a);
+
+    double x = (c * c + a * a - b * b) / (2 * c);
+    double y = std::sqrt(std::max(a * a - x * x, 0.0));
+    double area = a * a * std::acos(std::clamp(x / a, -1.0, 1.0)) + b * b * std::acos(std::clamp((c - x) / b, -1.0, 1.0)) - c * y;
+
+    return 1 - area / (glm::pi<double>() * a * a);
+}
+
+// Solar radiation pressure on a cannonball, a = P Cr A / m (1 AU / d)^2 away from the Sun, dimmed by
+// the shadows of body 0 (the Earth) and body 1 (the Moon). Scaled to the scene by the ratio of
+// body 0's surface gravity in scene units to the real one, as with drag.
+class SolarRadiationPressure {
+public:
+    size_t first_body = 2;
+
+    SunEphemeris sun;
+
+    double earth_radius = 1;
+    double moon_radius = 0.27;
+
+    // Cr A / m in m^2 / kg, zero turns the pressure off
+    double area_to_mass = 0.02;
+    // multiplies the pressure so its effect shows within a few orbits
+    double pressure_scale = 1;
+
+    // N / m^2 at 1 AU and the Earth's surface gravity in m / s^2
+    static constexpr double solar_pressure = 4.56e-6;
+    static constexpr double surface_gravity = 9.798;
+
+    void accumulate(BodyStore& bodies, double G, const DoubleDouble& t) const {
+        if (area_to_mass == 0 || bodies.size() < 2) return;
+
+        glm::dvec3 s = sun.position(t);
+        double scene_gravity = G * bodies.mass[0] / (earth_radius * earth_radius);
+        double scale = pressure_scale * solar_pressure * area_to_mass * scene_gravity / surface_gravity;
+
+        for (size_t i = first_body; i < bodies.size(); i++) {
+            glm::dvec3 p = bodies.position(i);
+            double light = sunlightFraction(p, s, sun.radius, bodies.position(0), earth_radius)
+                         * sunlightFraction(p, s, sun.radius, bodies.position(1), moon_radius);
+            if (light == 0) continue;
+
+            glm::dvec3 away = p - s;
+            double d = glm::length(away);
+            glm::dvec3 a = away * (light * scale * sun.distance * sun.distance / (d * d * d));
+
+            bodies.ax[i] += a.x;
+            bodies.ay[i] += a.y;
+            bodies.az[i] += a.z;
+        }
+    }
+};
+
+template<class Term, class = void>
+struct HasPotential : std::false_type {};
+
+template<class Term>
+struct HasPotential<Term, std::void_t<decltype(std::declval<const Term&>().potentialEnergy(std::declval<const BodyStore&>(), 0.0, 0.0))>> : std::true_type {};
+
+// A compile-time sum of force terms. The first is the point-mass gravity of the scene, its G and
+// softening are what the Kepler-based steppers and the regularization read. The model only refers to
+// the terms, which stay owned by the simulation, and carries the time forces are evaluated at: it starts
+// at the beginning of the step and the integrators move it to each stage or node before evaluating.
+// The time is double-double like the simulation clock, so the rotating field and the Sun keep their phase
+// resolution over long runs. IAS15 and the block Hermite stepper still count their own time in double.
+template<class... Terms>
+class ForceModel {
+public:
+    double G;
+    double softening;
+    DoubleDouble time;
+
+    ForceModel(const DoubleDouble& t, const PointMassGravity& gravity, const Terms&... terms)
+        : G(gravity.G), softening(gravity.softening), time(t), gravity(gravity), terms(terms...)
+    {
+
+    }
+
+    void computeAccelerations(BodyStore& bodies) const {
+        std::fill(bodies.ax.begin(), bodies.ax.end(), 0.0);
+        std::fill(bodies.ay.begin(), bodies.ay.end(), 0.0);
+        std::fill(bodies.az.begin(), bodies.az.end(), 0.0);
+
+        gravity.accumulate(bodies, G, time);
+        std::apply([&](const Terms&... term) { (term.accumulate(bodies, G, time), ...); }, terms);
+
+        bodies.accelerations_valid = true;
+    }
+
+    // sum over the conservative terms, drag and radiation pressure have no potential
+    double potentialEnergy(const BodyStore& bodies) const {
+        double energy = gravity.potentialEnergy(bodies);
+
+        std::apply([&](const Terms&... term) {
+            ((energy += termPotential(term, bodies)), ...);
+        }, terms);
+
+        return energy;
+    }
+
+private:
+    const PointMassGravity& gravity;
+    std::tuple<const Terms&...> terms;
+
+    template<class Term>
+    double termPotential(const Term& term, const BodyStore& bodies) const {
+        if constexpr (HasPotential<Term>::value) return term.potentialEnergy(bodies, G, time);
+        else return 0;
+    }
+};
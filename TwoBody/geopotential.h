@@ -0,0 +1,256 @@
+#pragma once
+
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Spherical harmonic gravity field of a central body from fully normalized coefficients C_nm, S_nm.
+// Acceleration and potential come from the Cunningham V_nm / W_nm recursion (Montenbruck & Gill,
+// Satellite Orbits, 3.2) rewritten for normalized terms, so it stays finite to degree 360 and beyond
+// where the unnormalized factorials overflow. All recursion and summation factors depend only on n and m
+// and are tabulated once when the field is loaded.
+// Only degrees 2 and up are summed, the central term belongs to the point-mass gravity.
+class SphericalHarmonicField {
+public:
+    std::string name;
+    int degree = 0;
+
+    // from the file, informational, evaluation uses the caller's mu and radius so the field scales to the scene
+    double file_mu = 0;
+    double file_radius = 0;
+
+    // degrees whose (R / r)^n falls below this are skipped, far points only need the low degrees
+    double truncation = 1e-16;
+
+    // Reads an ICGEM .gfc coefficient file, as published for EGM2008 and most other models,
+    // keeping degrees up to max_degree. Throws std::runtime_error on unreadable input.
+    static SphericalHarmonicField loadIcgem(const std::string& path, int max_degree = 360) {
+        std::ifstream file(path);
+        if (!file.good()) throw std::runtime_error("Gravity field file not found: " + path);
+
+        SphericalHarmonicField field;
+        field.name = path.substr(path.find_last_of("/\\") + 1);
+
+        int file_degree = -1;
+        bool in_header = true;
+        std::string line;
+
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string key;
+            if (!(fields >> key)) continue;
+
+            if (in_header) {
+                if (key == "earth_gravity_constant") fields >> field.file_mu;
+                else if (key == "radius") fields >> field.file_radius;
+                else if (key == "max_degree") fields >> file_degree;
+                else if (key == "norm") {
+                    std::string norm;
+                    fields >> norm;
+                    if (norm != "fully_normalized") throw std::runtime_error("Only fully normalized coefficients are supported: " + path);
+                } else if (key == "end_of_head") {
+                    if (file_degree < 0) throw std::runtime_error("Missing max_degree in " + path);
+
+                    field.resize(std::min(file_degree, max_degree));
+                    in_header = false;
+                }
+                continue;
+            }
+
+            // time variable models add gfct epochs and trend terms, the static part is enough here
+            if (key != "gfc" && key != "gfct") continue;
+
+            int n, m;
+            std::string c, s;
+            if (!(fields >> n >> m >> c >> s)) throw std::runtime_error("Malformed coefficient line in " + path + ": " + line);
+            if (n > field.degree || m > n) continue;
+
+            field.C[field.index(n, m)] = parseFortranDouble(c);
+            field.S[field.index(n, m)] = parseFortranDouble(s);
+        }
+
+        if (in_header) throw std::runtime_error("No end_of_head in " + path);
+
+        return field;
+    }
+
+    // accelerations at count points given in the body-fixed frame (z along the rotation axis),
+    // mu and radius in the caller's units. Potential may be null.
+    void evaluate(const glm::dvec3* points, size_t count, double mu, double radius, glm::dvec3* accelerations, double* potentials, int max_degree) const {
+        auto evaluate_range = [&](size_t begin, size_t end) {
+            // recursion tables are reused between calls on the same thread
+            thread_local std::vector<double> V, W;
+            V.resize(a.size());
+            W.resize(V.size());
+
+            for (size_t i = begin; i < end; i++) {
+                accelerations[i] = evaluatePoint(points[i], mu, radius, std::min(max_degree, degree), V, W, potentials ? &potentials[i] : nullptr);
+            }
+        };
+
+        if (count < 64) {
+            evaluate_range(0, count);
+        } else {
+            ThreadPool::global().parallelFor(0, count, [&](size_t i) { evaluate_range(i, i + 1); }, 16);
+        }
+    }
+
+private:
+    std::vector<double> C, S;
+
+    // recursion factors over degrees up to degree + 1
+    std::vector<double> a, b;
+    std::vector<double> sectoral;
+
+    // summation factors over degrees up to degree
+    std::vector<double> f_x, f_x_lower, f_z;
+
+    // column-major triangle, column m holds degrees m .. dimension
+    static size_t columnIndex(int dimension, int n, int m) {
+        return size_t(m) * (dimension + 1) - size_t(m) * (m - 1) / 2 + (n - m);
+    }
+
+    size_t index(int n, int m) const {
+        return columnIndex(degree, n, m);
+    }
+
+    size_t recursionIndex(int n, int m) const {
+        return columnIndex(degree + 1, n, m);
+    }
+
+    static double parseFortranDouble(std::string text) {
+        std::replace(text.begin(), text.end(), 'D', 'e');
+        std::replace(text.begin(), text.end(), 'd', 'e');
+        return std::stod(text);
+    }
+
+    void resize(int new_degree) {
+        degree = new_degree;
+
+        size_t coefficients = columnIndex(degree, degree, degree) + 1;
+        C.assign(coefficients, 0.0);
+        S.assign(coefficients, 0.0);
+        f_x.assign(coefficients, 0.0);
+        f_x_lower.assign(coefficients, 0.0);
+        f_z.assign(coefficients, 0.0);
+
+        int dimension = degree + 1;
+        size_t terms = columnIndex(dimension, dimension, dimension) + 1;
+        a.assign(terms, 0.0);
+        b.assign(terms, 0.0);
+        sectoral.assign(dimension + 1, 0.0);
+
+        for (int m = 1; m <= dimension; m++) {
+            double kronecker = m == 1 ? 2 : 1;
+            sectoral[m] = std::sqrt(kronecker * (2.0 * m + 1) / (2.0 * m));
+        }
+
+        for (int m = 0; m <= dimension; m++) {
+            for (int n = m + 1; n <= dimension; n++) {
+                double nn = n, mm = m;
+                a[recursionIndex(n, m)] = std::sqrt((2 * nn + 1) * (2 * nn - 1) / ((nn - mm) * (nn + mm)));
+                if (n >= m + 2) {
+                    b[recursionIndex(n, m)] = std::sqrt((2 * nn + 1) * (nn + mm - 1) * (nn - mm - 1) / ((2 * nn - 3) * (nn + mm) * (nn - mm)));
+                }
+            }
+        }
+
+        for (int m = 0; m <= degree; m++) {
+            for (int n = m; n <= degree; n++) {
+                double nn = n, mm = m;
+                double degree_ratio = (2 * nn + 1) / (2 * nn + 3);
+                double m_kronecker = m == 0 ? 1 : 2;
+                double lower_kronecker = m == 1 ? 1 : 2;
+
+                f_x[index(n, m)] = std::sqrt(m_kronecker / 2 * degree_ratio * (nn + mm + 1) * (nn + mm + 2));
+                if (m > 0) f_x_lower[index(n, m)] = std::sqrt(2 / lower_kronecker * degree_ratio * (nn - mm + 2) * (nn - mm + 1));
+                f_z[index(n, m)] = std::sqrt(degree_ratio * (nn + mm + 1) * (nn - mm + 1));
+            }
+        }
+    }
+
+    glm::dvec3 evaluatePoint(glm::dvec3 p, double mu, double radius, int max_degree, std::vector<double>& V, std::vector<double>& W, double* potential) const {
+        double r2 = glm::dot(p, p);
+        double r = std::sqrt(r2);
+
+        // far from the body the high degrees are below rounding; at the surface every degree counts, and the
+        // quotient there grows without bound or is -inf where r / radius rounds to 1, so it is clamped in double
+        int L = max_degree;
+        if (r > radius) {
+            double degree = std::log(truncation) / std::log(radius / r);
+            if (!(degree >= 0) || !std::isfinite(degree)) degree = L;
+            L = std::min(L, int(std::clamp(degree, 2.0, double(std::max(L, 2)))));
+        }
+
+        double rho = radius / r2;
+        double x0 = p.x * rho, y0 = p.y * rho, z0 = p.z * rho;
+        double rho_radius = radius * rho;
+
+        int dimension = L + 1;
+
+        // sectoral terms, then each column upwards in degree
+        V[recursionIndex(0, 0)] = radius / r;
+        W[recursionIndex(0, 0)] = 0;
+
+        for (int m = 0; m <= dimension; m++) {
+            size_t mm = recursionIndex(m, m);
+
+            if (m > 0) {
+                size_t previous = recursionIndex(m - 1, m - 1);
+                V[mm] = sectoral[m] * (x0 * V[previous] - y0 * W[previous]);
+                W[mm] = sectoral[m] * (x0 * W[previous] + y0 * V[previous]);
+            }
+
+            if (m + 1 <= dimension) {
+                size_t k = recursionIndex(m + 1, m);
+                V[k] = a[k] * z0 * V[mm];
+                W[k] = a[k] * z0 * W[mm];
+            }
+
+            for (int n = m + 2; n <= dimension; n++) {
+                size_t k = recursionIndex(n, m);
+                V[k] = a[k] * z0 * V[k - 1] - b[k] * rho_radius * V[k - 2];
+                W[k] = a[k] * z0 * W[k - 1] - b[k] * rho_radius * W[k - 2];
+            }
+        }
+
+        glm::dvec3 acceleration(0);
+        double u = 0;
+
+        for (int m = 0; m <= L; m++) {
+            for (int n = std::max(m, 2); n <= L; n++) {
+                size_t k = index(n, m);
+                double c = C[k], s = S[k];
+
+                if (potential) u += c * V[recursionIndex(n, m)] + s * W[recursionIndex(n, m)];
+
+                size_t up = recursionIndex(n + 1, m + 1);
+                size_t same = recursionIndex(n + 1, m);
+
+                if (m == 0) {
+                    acceleration.x -= f_x[k] * c * V[up];
+                    acceleration.y -= f_x[k] * c * W[up];
+                } else {
+                    size_t down = recursionIndex(n + 1, m - 1);
+
+                    acceleration.x += 0.5 * (f_x[k] * (-c * V[up] - s * W[up]) + f_x_lower[k] * (c * V[down] + s * W[down]));
+                    acceleration.y += 0.5 * (f_x[k] * (-c * W[up] + s * V[up]) + f_x_lower[k] * (-c * W[down] + s * V[down]));
+                }
+
+                acceleration.z += f_z[k] * (-c * V[same] - s * W[same]);
+            }
+        }
+
+        if (potential) *potential = mu / radius * u;
+
+        return acceleration * (mu / (radius * radius));
+    }
+};
@@ -0,0 +1,230 @@
+#pragma once
+
+#include "body_store.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Fourth-order Hermite predictor-corrector with individual block timesteps (Makino & Aarseth 1992).
+// Every body steps with dt = max_dt / 2^level and only the block due at the next time is corrected,
+// the rest are merely predicted. A tight binary then costs steps for its two members instead of
+// forcing its timestep onto the whole cluster.
+// Block times are kept relative to the start so they stay exact binary fractions.
+class BlockHermite {
+public:
+    double eta = 0.02;
+    double eta_start = 0.01;
+    double max_dt = 1.0 / 8;
+    int max_level = 40;
+
+    // absolute time of the last block step, every body's state is known (predicted or corrected) here
+    double time = 0;
+
+    uint64_t block_steps = 0;
+    uint64_t body_steps = 0;
+
+    std::vector<int> level;
+
+    bool started() const {
+        return !level.empty();
+    }
+
+    void clear() {
+        level.clear();
+        block_steps = 0;
+        body_steps = 0;
+    }
+
+    void start(const BodyStore& bodies, double G, double softening, double t0) {
+        size_t n = bodies.size();
+
+        origin = t0;
+        time = t0;
+        block_steps = 0;
+        body_steps = 0;
+
+        x.resize(n); v.resize(n); a.resize(n); jerk.resize(n);
+        xp.resize(n); vp.resize(n);
+        last.assign(n, 0.0);
+        level.assign(n, 0);
+
+        for (size_t i = 0; i < n; i++) {
+            x[i] = xp[i] = bodies.position(i);
+            v[i] = vp[i] = bodies.velocity(i);
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            evaluate(bodies, i, G, softening, a[i], jerk[i]);
+
+            double a_norm = glm::length(a[i]);
+            double j_norm = glm::length(jerk[i]);
+            double dt = j_norm > 0 ? eta_start * a_norm / j_norm : max_dt;
+            level[i] = levelFor(dt);
+        }
+    }
+
+    double stepOf(size_t i) const {
+        return std::ldexp(max_dt, -level[i]);
+    }
+
+    // absolute time of the next block
+    double nextTime() const {
+        return origin + nextRelativeTime();
+    }
+
+    // advances the block due next, writes the state of all bodies at the new block time, returns the block size
+    size_t step(BodyStore& bodies, double G, double softening) {
+        double t = nextRelativeTime();
+        size_t n = bodies.size();
+
+        active.clear();
+        for (size_t i = 0; i < n; i++) {
+            if (last[i] + stepOf(i) == t) active.push_back(i);
+            predict(i, t, xp[i], vp[i]);
+        }
+
+        // forces on the active block come from everybody's predicted state
+        for (size_t i = 0; i < n; i++) {
+            bodies.x[i] = xp[i].x; bodies.y[i] = xp[i].y; bodies.z[i] = xp[i].z;
+            bodies.vx[i] = vp[i].x; bodies.vy[i] = vp[i].y; bodies.vz[i] = vp[i].z;
+        }
+
+        for (size_t i : active) {
+            double dt = stepOf(i);
+
+            glm::dvec3 a1, j1;
+            evaluate(bodies, i, G, softening, a1, j1);
+
+            glm::dvec3 v1 = v[i] + (a[i] + a1) * (dt / 2) + (jerk[i] - j1) * (dt * dt / 12);
+            glm::dvec3 x1 = x[i] + (v[i] + v1) * (dt / 2) + (a[i] - a1) * (dt * dt / 12);
+
+            // snap and crackle from the Hermite interpolant, snap moved to the end of the step
+            glm::dvec3 crackle = (12.0 * (a[i] - a1) + 6 * dt * (jerk[i] + j1)) / (dt * dt * dt);
+            glm::dvec3 snap = (-6.0 * (a[i] - a1) - dt * (4.0 * jerk[i] + 2.0 * j1)) / (dt * dt) + dt * crackle;
+
+            x[i] = x1; v[i] = v1; a[i] = a1; jerk[i] = j1;
+            last[i] = t;
+
+            level[i] = nextLevel(i, t, aarsethStep(a1, j1, snap, crackle));
+        }
+
+        // corrected values replace the predictions in the store
+        for (size_t i : active) {
+            bodies.x[i] = x[i].x; bodies.y[i] = x[i].y; bodies.z[i] = x[i].z;
+            bodies.vx[i] = v[i].x; bodies.vy[i] = v[i].y; bodies.vz[i] = v[i].z;
+        }
+        bodies.accelerations_valid = false;
+
+        time = origin + t;
+        block_steps++;
+        body_steps += active.size();
+
+        return active.size();
+    }
+
+    // third-order Taylor prediction of body i to absolute time t, used for rendering between blocks
+    glm::dvec3 predictedPosition(size_t i, double t) const {
+        glm::dvec3 position, velocity;
+        predict(i, t - origin, position, velocity);
+        return position;
+    }
+
+    glm::dvec3 predictedVelocity(size_t i, double t) const {
+        glm::dvec3 position, velocity;
+        predict(i, t - origin, position, velocity);
+        return velocity;
+    }
+
+    // number of bodies on each level, index 0 is max_dt
+    std::vector<int> levelOccupancy() const {
+        std::vector<int> occupancy;
+        for (int l : level) {
+            if (l >= int(occupancy.size())) occupancy.resize(l + 1, 0);
+            occupancy[l]++;
+        }
+        return occupancy;
+    }
+
+private:
+    double origin = 0;
+
+    // state at each body's own last correction time, relative to origin
+    std::vector<double> last;
+    std::vector<glm::dvec3> x, v, a, jerk;
+
+    std::vector<glm::dvec3> xp, vp;
+    std::vector<size_t> active;
+
+    double nextRelativeTime() const {
+        double t = std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < level.size(); i++) t = std::min(t, last[i] + stepOf(i));
+        return t;
+    }
+
+    void predict(size_t i, double t, glm::dvec3& position, glm::dvec3& velocity) const {
+        double dt = t - last[i];
+
+        position = x[i] + dt * (v[i] + dt * (a[i] / 2.0 + dt * jerk[i] / 6.0));
+        velocity = v[i] + dt * (a[i] + dt * jerk[i] / 2.0);
+    }
+
+    // acceleration and jerk on body i from the positions and velocities in the store
+    static void evaluate(const BodyStore& bodies, size_t i, double G, double softening, glm::dvec3& acceleration, glm::dvec3& jerk) {
+        double eps2 = softening * softening;
+        acceleration = glm::dvec3(0);
+        jerk = glm::dvec3(0);
+
+        glm::dvec3 xi = bodies.position(i);
+        glm::dvec3 vi = bodies.velocity(i);
+
+        for (size_t j = 0; j < bodies.size(); j++) {
+            if (j == i) continue;
+
+            glm::dvec3 dx = bodies.position(j) - xi;
+            glm::dvec3 dv = bodies.velocity(j) - vi;
+
+            double r2 = glm::dot(dx, dx) + eps2;
+            double inv_r2 = 1 / r2;
+            double inv_r3 = G * bodies.mass[j] * inv_r2 / std::sqrt(r2);
+            double rv = 3 * glm::dot(dx, dv) * inv_r2;
+
+            acceleration += inv_r3 * dx;
+            jerk += inv_r3 * (dv - rv * dx);
+        }
+    }
+
+    // Aarseth's timestep criterion
+    double aarsethStep(glm::dvec3 acceleration, glm::dvec3 j, glm::dvec3 snap, glm::dvec3 crackle) const {
+        double a_norm = glm::length(acceleration);
+        double j_norm = glm::length(j);
+        double s_norm = glm::length(snap);
+        double c_norm = glm::length(crackle);
+
+        double denominator = j_norm * c_norm + s_norm * s_norm;
+        if (denominator <= 0) return max_dt;
+
+        return std::sqrt(eta * (a_norm * s_norm + j_norm * j_norm) / denominator);
+    }
+
+    int levelFor(double dt) const {
+        int l = 0;
+        while (l < max_level && std::ldexp(max_dt, -l) > dt) l++;
+        return l;
+    }
+
+    // halve freely, but only double when the current time lies on the coarser block grid
+    int nextLevel(size_t i, double t, double dt) const {
+        int l = level[i];
+
+        if (std::ldexp(max_dt, -l) > dt) return levelFor(dt);
+
+        if (l > 0 && std::ldexp(max_dt, -(l - 1)) <= dt && std::fmod(t, std::ldexp(max_dt, -(l - 1))) == 0) return l - 1;
+
+        return l;
+    }
+};
@@ -0,0 +1,372 @@
+#pragma once
+
+#include "body_store.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// IAS15: 15th order implicit integrator with adaptive step size (Rein & Spiegel 2015).
+// Within a step of length dt the acceleration is a polynomial in tau = (t - t0) / dt,
+//     a(tau) = a0 + b0 tau + b1 tau^2 + ... + b6 tau^7,
+// fitted by predictor-corrector iterations on the Gauss-Radau spacings. The same polynomial,
+// integrated twice, is kept after each accepted step as dense output for arbitrary-time sampling.
+class Ias15 {
+public:
+    double epsilon;
+    double safety_factor;
+    double min_dt;
+    int max_iterations;
+
+    double dt;
+    double time;
+
+    uint64_t steps_accepted;
+    uint64_t steps_rejected;
+    uint64_t force_evaluations;
+
+    Ias15() : epsilon(1e-9), safety_factor(0.25), min_dt(0), max_iterations(12),
+              dt(0), time(0), steps_accepted(0), steps_rejected(0), force_evaluations(0), has_segment(false) {
+
+    }
+
+    void reset(double t0, double dt0) {
+        time = t0;
+        dt = dt0;
+        steps_accepted = 0;
+        steps_rejected = 0;
+        force_evaluations = 0;
+        has_segment = false;
+
+        for (auto& coefficient : b) coefficient.clear();
+        for (auto& coefficient : g) coefficient.clear();
+    }
+
+    template<class Forces>
+    void step(BodyStore& bodies, Forces& forces) {
+        const auto& tables = constants();
+        size_t n = bodies.size() * 3;
+
+        // the forces are evaluated at the time of every node
+        forces.time = time;
+        if (!bodies.accelerations_valid) {
+            forces.computeAccelerations(bodies);
+            force_evaluations++;
+        }
+
+        resize(n);
+        gather(bodies, x0, v0, a0);
+
+        for (;;) {
+            // predictor-corrector iterations until the b coefficients stop changing
+            double previous_pc_error = 2;
+            for (int iteration = 0; iteration < max_iterations; iteration++) {
+                double max_delta_b6 = 0;
+                double max_acceleration = 0;
+
+                for (int node = 1; node < 8; node++) {
+                    predict(bodies, tables.h[node]);
+                    forces.time = time + tables.h[node] * dt;
+                    forces.computeAccelerations(bodies);
+                    force_evaluations++;
+
+                    for (size_t k = 0; k < n; k++) {
+                        double a = acceleration(bodies, k);
+                        max_acceleration = std::max(max_acceleration, std::abs(a));
+
+                        // divided difference on the nodes 0 .. node
+                        double tmp = (a - a0[k]) / tables.h[node];
+                        for (int m = 1; m < node; m++) tmp = (tmp - g[m - 1][k]) / (tables.h[node] - tables.h[m]);
+
+                        double delta = tmp - g[node - 1][k];
+                        g[node - 1][k] = tmp;
+
+                        for (int power = 1; power <= node; power++) b[power - 1][k] += tables.c[node][power] * delta;
+
+                        if (node == 7) max_delta_b6 = std::max(max_delta_b6, std::abs(tables.c[7][7] * delta));
+                    }
+                }
+
+                double pc_error = max_acceleration > 0 ? max_delta_b6 / max_acceleration : 0;
+                if (pc_error < 1e-16) break;
+                if (iteration > 1 && pc_error >= previous_pc_error) break;
+                previous_pc_error = pc_error;
+            }
+
+            // step size control from the relative size of the last coefficient
+            double max_b6 = 0;
+            double max_acceleration = 0;
+            for (size_t k = 0; k < n; k++) {
+                max_b6 = std::max(max_b6, std::abs(b[6][k]));
+                max_acceleration = std::max(max_acceleration, std::abs(a0[k]));
+            }
+
+            double dt_done = dt;
+            double dt_new = dt_done / safety_factor;
+            if (max_b6 > 0 && max_acceleration > 0) {
+                double error = max_b6 / max_acceleration;
+                dt_new = dt_done * std::pow(epsilon / error, 1.0 / 7.0);
+            }
+            dt_new = std::copysign(std::max(std::abs(dt_new), min_dt), dt_done);
+
+            if (std::abs(dt_new / dt_done) < safety_factor && std::abs(dt_new) > min_dt) {
+                // rejected, restart from the beginning of the step with the polynomial rescaled
+                scatter(bodies, x0, v0);
+                rescale(dt_new / dt_done);
+
+                dt = dt_new;
+                steps_rejected++;
+                continue;
+            }
+
+            if (std::abs(dt_new / dt_done) > 1 / safety_factor) dt_new = dt_done / safety_factor;
+
+            // accepted, keep the polynomial as dense output and move to the end of the step
+            segment_t0 = time;
+            segment_dt = dt_done;
+            segment_x0 = x0;
+            segment_v0 = v0;
+            segment_a0 = a0;
+            segment_b = b;
+            has_segment = true;
+
+            predict(bodies, 1.0);
+            bodies.accelerations_valid = false;
+
+            time += dt_done;
+            forces.time = time;
+            dt = dt_new;
+            steps_accepted++;
+
+            shiftToNextStep(dt_new / dt_done);
+            break;
+        }
+    }
+
+    // steps until exactly t_end, shortening the last step instead of overshooting,
+    // after_step(h) is called with the length of every step taken
+    template<class Forces, class AfterStep>
+    void integrateTo(BodyStore& bodies, Forces& forces, double t_end, AfterStep&& after_step) {
+        while (time < t_end) {
+            double t0 = time;
+            dt = std::min(dt, t_end - time);
+            step(bodies, forces);
+
+            // absorb the rounding of time += dt so the loop ends on t_end itself
+            if (t_end - time <= 1e-14 * std::abs(t_end)) time = t_end;
+            after_step(time - t0);
+        }
+    }
+
+    template<class Forces>
+    void integrateTo(BodyStore& bodies, Forces& forces, double t_end) {
+        integrateTo(bodies, forces, t_end, [](double) {});
+    }
+
+    bool hasSegment() const {
+        return has_segment;
+    }
+
+    double segmentStart() const {
+        return segment_t0;
+    }
+
+    double segmentEnd() const {
+        return segment_t0 + segment_dt;
+    }
+
+    // position of body i at time t inside the last accepted step
+    glm::dvec3 densePosition(size_t i, double t) const {
+        double tau = std::clamp((t - segment_t0) / segment_dt, 0.0, 1.0);
+        glm::dvec3 p;
+        for (int c = 0; c < 3; c++) p[c] = positionPolynomial(segment_x0, segment_v0, segment_a0, segment_b, 3 * i + c, tau, segment_dt);
+        return p;
+    }
+
+    glm::dvec3 denseVelocity(size_t i, double t) const {
+        double tau = std::clamp((t - segment_t0) / segment_dt, 0.0, 1.0);
+        glm::dvec3 v;
+        for (int c = 0; c < 3; c++) v[c] = velocityPolynomial(segment_v0, segment_a0, segment_b, 3 * i + c, tau, segment_dt);
+        return v;
+    }
+
+private:
+    struct Constants {
+        // Gauss-Radau spacings
+        double h[8];
+        // c[j][k] is the coefficient of tau^k in tau * (tau - h1) * ... * (tau - h[j-1])
+        double c[8][8];
+    };
+
+    static const Constants& constants() {
+        static const Constants tables = [] {
+            Constants t{};
+            const double spacings[8] = {
+                0.0,
+                0.0562625605369221464656521910318,
+                0.180240691736892364987579942780,
+                0.352624717113169637373907769648,
+                0.547153626330555383001448554766,
+                0.734210177215410531523210605558,
+                0.885320946839095768090359771030,
+                0.977520613561287501891174488626
+            };
+            std::copy(spacings, spacings + 8, t.h);
+
+            t.c[1][1] = 1;
+            for (int j = 2; j < 8; j++) {
+                for (int k = 1; k <= j; k++) {
+                    t.c[j][k] = t.c[j - 1][k - 1] - t.h[j - 1] * t.c[j - 1][k];
+                }
+            }
+            return t;
+        }();
+
+        return tables;
+    }
+
+    using Coefficients = std::array<std::vector<double>, 7>;
+
+    std::vector<double> x0, v0, a0;
+    Coefficients b, g;
+
+    bool has_segment;
+    double segment_t0 = 0;
+    double segment_dt = 1;
+    std::vector<double> segment_x0, segment_v0, segment_a0;
+    Coefficients segment_b;
+
+    void resize(size_t n) {
+        if (b[0].size() == n) return;
+
+        for (auto& coefficient : b) coefficient.assign(n, 0.0);
+        for (auto& coefficient : g) coefficient.assign(n, 0.0);
+    }
+
+    static double acceleration(const BodyStore& bodies, size_t k) {
+        size_t i = k / 3;
+        switch (k % 3) {
+        case 0: return bodies.ax[i];
+        case 1: return bodies.ay[i];
+        default: return bodies.az[i];
+        }
+    }
+
+    static void gather(const BodyStore& bodies, std::vector<double>& x, std::vector<double>& v, std::vector<double>& a) {
+        size_t count = bodies.size();
+        x.resize(3 * count); v.resize(3 * count); a.resize(3 * count);
+
+        for (size_t i = 0; i < count; i++) {
+            x[3 * i + 0] = bodies.x[i]; x[3 * i + 1] = bodies.y[i]; x[3 * i + 2] = bodies.z[i];
+            v[3 * i + 0] = bodies.vx[i]; v[3 * i + 1] = bodies.vy[i]; v[3 * i + 2] = bodies.vz[i];
+            a[3 * i + 0] = bodies.ax[i]; a[3 * i + 1] = bodies.ay[i]; a[3 * i + 2] = bodies.az[i];
+        }
+    }
+
+    static void scatter(BodyStore& bodies, const std::vector<double>& x, const std::vector<double>& v) {
+        for (size_t i = 0; i < bodies.size(); i++) {
+            bodies.x[i] = x[3 * i + 0]; bodies.y[i] = x[3 * i + 1]; bodies.z[i] = x[3 * i + 2];
+            bodies.vx[i] = v[3 * i + 0]; bodies.vy[i] = v[3 * i + 1]; bodies.vz[i] = v[3 * i + 2];
+        }
+
+        bodies.accelerations_valid = false;
+    }
+
+    static double positionPolynomial(const std::vector<double>& x, const std::vector<double>& v, const std::vector<double>& a,
+                                     const Coefficients& bk, size_t k, double tau, double h) {
+        double s = bk[6][k] / 72;
+        s = tau * s + bk[5][k] / 56;
+        s = tau * s + bk[4][k] / 42;
+        s = tau * s + bk[3][k] / 30;
+        s = tau * s + bk[2][k] / 20;
+        s = tau * s + bk[1][k] / 12;
+        s = tau * s + bk[0][k] / 6;
+        s = tau * s + a[k] / 2;
+
+        return x[k] + tau * h * (v[k] + tau * h * s);
+    }
+
+    static double velocityPolynomial(const std::vector<double>& v, const std::vector<double>& a,
+                                     const Coefficients& bk, size_t k, double tau, double h) {
+        double s = bk[6][k] / 8;
+        s = tau * s + bk[5][k] / 7;
+        s = tau * s + bk[4][k] / 6;
+        s = tau * s + bk[3][k] / 5;
+        s = tau * s + bk[2][k] / 4;
+        s = tau * s + bk[1][k] / 3;
+        s = tau * s + bk[0][k] / 2;
+        s = tau * s + a[k];
+
+        return v[k] + tau * h * s;
+    }
+
+    // writes the predicted state at substep tau of the current step into the body store
+    void predict(BodyStore& bodies, double tau) const {
+        for (size_t i = 0; i < bodies.size(); i++) {
+            bodies.x[i] = positionPolynomial(x0, v0, a0, b, 3 * i + 0, tau, dt);
+            bodies.y[i] = positionPolynomial(x0, v0, a0, b, 3 * i + 1, tau, dt);
+            bodies.z[i] = positionPolynomial(x0, v0, a0, b, 3 * i + 2, tau, dt);
+            bodies.vx[i] = velocityPolynomial(v0, a0, b, 3 * i + 0, tau, dt);
+            bodies.vy[i] = velocityPolynomial(v0, a0, b, 3 * i + 1, tau, dt);
+            bodies.vz[i] = velocityPolynomial(v0, a0, b, 3 * i + 2, tau, dt);
+        }
+
+        bodies.accelerations_valid = false;
+    }
+
+    // recomputes the Newton form g from the monomial form b, c[][] is unit upper triangular
+    void updateDividedDifferences() {
+        const auto& tables = constants();
+
+        for (size_t k = 0; k < b[0].size(); k++) {
+            for (int j = 7; j >= 1; j--) {
+                double value = b[j - 1][k];
+                for (int m = j + 1; m <= 7; m++) value -= tables.c[m][j] * g[m - 1][k];
+                g[j - 1][k] = value;
+            }
+        }
+    }
+
+    // same polynomial expressed in a step that is ratio times as long
+    void rescale(double ratio) {
+        double q = ratio;
+        for (int j = 0; j < 7; j++, q *= ratio) {
+            for (double& value : b[j]) value *= q;
+        }
+
+        updateDividedDifferences();
+    }
+
+    // re-expands the polynomial around the end of the step as the starting guess for the next one
+    void shiftToNextStep(double ratio) {
+        static const double binomial[8][8] = {
+            {1},
+            {1, 1},
+            {1, 2, 1},
+            {1, 3, 3, 1},
+            {1, 4, 6, 4, 1},
+            {1, 5, 10, 10, 5, 1},
+            {1, 6, 15, 20, 15, 6, 1},
+            {1, 7, 21, 35, 35, 21, 7, 1}
+        };
+
+        for (size_t k = 0; k < b[0].size(); k++) {
+            double shifted[7];
+            double q = ratio;
+
+            for (int power = 1; power <= 7; power++, q *= ratio) {
+                double sum = 0;
+                for (int j = power; j <= 7; j++) sum += binomial[j][power] * b[j - 1][k];
+                shifted[power - 1] = q * sum;
+            }
+
+            for (int j = 0; j < 7; j++) b[j][k] = shifted[j];
+        }
+
+        updateDividedDifferences();
+    }
+};
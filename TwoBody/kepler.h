@@ -0,0 +1,122 @@
+#pragma once
+
+#include "body_store.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+// Analytic two-body propagation in universal variables, valid for elliptic, parabolic and hyperbolic orbits.
+// One solve of the universal Kepler equation moves a state by any time span, no stepping involved.
+
+struct KeplerState {
+    glm::dvec3 position;
+    glm::dvec3 velocity;
+};
+
+// Stumpff functions c2(z) = (1 - cos sqrt(z)) / z and c3(z) = (sqrt(z) - sin sqrt(z)) / z^(3/2)
+inline void stumpff(double z, double& c2, double& c3) {
+    if (z > 1e-6) {
+        double s = std::sqrt(z);
+        c2 = (1 - std::cos(s)) / z;
+        c3 = (s - std::sin(s)) / (z * s);
+    } else if (z < -1e-6) {
+        double s = std::sqrt(-z);
+        c2 = (1 - std::cosh(s)) / z;
+        c3 = (std::sinh(s) - s) / (-z * s);
+    } else {
+        c2 = 1.0 / 2 - z * (1.0 / 24 - z * (1.0 / 720 - z / 40320));
+        c3 = 1.0 / 6 - z * (1.0 / 120 - z * (1.0 / 5040 - z / 362880));
+    }
+}
+
+// relative state r0, v0 under gravitational parameter mu moved by dt
+inline KeplerState propagateKepler(const glm::dvec3& r0, const glm::dvec3& v0, double mu, double dt) {
+    double r0_length = glm::length(r0);
+    double sqrt_mu = std::sqrt(mu);
+    double sigma0 = glm::dot(r0, v0) / sqrt_mu;
+
+    // reciprocal semi-major axis, positive for bound orbits
+    double alpha = 2 / r0_length - glm::dot(v0, v0) / mu;
+
+    // whole periods do not change the state, dropping them keeps the solve O(1) at any time span
+    if (alpha > 1e-12) {
+        double period = glm::two_pi<double>() / (sqrt_mu * alpha * std::sqrt(alpha));
+        dt = std::fmod(dt, period);
+    }
+
+    double chi;
+    if (alpha > 1e-12) {
+        chi = sqrt_mu * dt * alpha;
+    } else if (alpha < -1e-12) {
+        double a = 1 / alpha;
+        double sign = dt >= 0 ? 1 : -1;
+        double argument = -2 * mu * alpha * dt / (glm::dot(r0, v0) + sign * std::sqrt(-mu * a) * (1 - r0_length * alpha));
+        // the logarithmic guess is for long spans, over short ones it has the wrong sign and the iterations
+        // crawl back from far out on the exponential branch
+        chi = argument > 1 ? sign * std::sqrt(-a) * std::log(argument) : sqrt_mu * dt / r0_length;
+    } else {
+        chi = sqrt_mu * dt / r0_length;
+    }
+
+    // Laguerre iterations on the universal Kepler equation, robust where Newton overshoots
+    double c2 = 0.5, c3 = 1.0 / 6;
+    for (int iteration = 0; iteration < 50; iteration++) {
+        double chi2 = chi * chi;
+        double z = alpha * chi2;
+        stumpff(z, c2, c3);
+
+        double f = sigma0 * chi2 * c2 + (1 - alpha * r0_length) * chi2 * chi * c3 + r0_length * chi - sqrt_mu * dt;
+        double df = sigma0 * chi * (1 - z * c3) + (1 - alpha * r0_length) * chi2 * c2 + r0_length;
+        double ddf = sigma0 * (1 - z * c2) + (1 - alpha * r0_length) * chi * (1 - z * c3);
+
+        const double n = 5;
+        double discriminant = std::sqrt(std::abs((n - 1) * (n - 1) * df * df - n * (n - 1) * f * ddf));
+        double denominator = df + (df >= 0 ? discriminant : -discriminant);
+        double delta = denominator != 0 ? n * f / denominator : f / df;
+
+        chi -= delta;
+        if (std::abs(delta) <= 1e-15 * std::max(1.0, std::abs(chi))) break;
+    }
+
+    double chi2 = chi * chi;
+    stumpff(alpha * chi2, c2, c3);
+
+    double f = 1 - chi2 / r0_length * c2;
+    double g = dt - chi2 * chi / sqrt_mu * c3;
+
+    KeplerState state;
+    state.position = f * r0 + g * v0;
+
+    double r_length = glm::length(state.position);
+    double fdot = sqrt_mu / (r_length * r0_length) * chi * (alpha * chi2 * c3 - 1);
+    double gdot = 1 - chi2 / r_length * c2;
+    state.velocity = fdot * r0 + gdot * v0;
+
+    return state;
+}
+
+// advances bodies 0 and 1 as an isolated pair: barycenter in uniform motion, relative orbit by Kepler
+inline void propagateTwoBody(BodyStore& bodies, double G, double dt) {
+    double m0 = bodies.mass[0];
+    double m1 = bodies.mass[1];
+    double total = m0 + m1;
+
+    glm::dvec3 center = (m0 * bodies.position(0) + m1 * bodies.position(1)) / total;
+    glm::dvec3 center_velocity = (m0 * bodies.velocity(0) + m1 * bodies.velocity(1)) / total;
+
+    auto relative = propagateKepler(
+        bodies.position(1) - bodies.position(0),
+        bodies.velocity(1) - bodies.velocity(0),
+        G * total, dt
+    );
+
+    center += center_velocity * dt;
+
+    bodies.setPosition(0, center - relative.position * (m1 / total));
+    bodies.setPosition(1, center + relative.position * (m0 / total));
+    bodies.setVelocity(0, center_velocity - relative.velocity * (m1 / total));
+    bodies.setVelocity(1, center_velocity + relative.velocity * (m0 / total));
+}
@@ -0,0 +1,195 @@
+#pragma once
+
+#include "body_store.h"
+#include "symplectic.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// Kustaanheimo-Stiefel regularization of a perturbed two-body orbit (Stiefel & Scheifele 1971).
+// The relative position x is written as x = L(u) u with a 4-vector u, and time is replaced by the
+// fictitious time s with dt = r ds. The equations of motion become
+//     u'' = (h / 2) u + (r / 2) L(u)^T P
+//     h'  = 2 u' . L(u)^T P
+//     t'  = r
+// with h the Kepler energy and P the perturbing acceleration. Without P this is a harmonic oscillator,
+// so a fixed step in s resolves every orbit with the same number of steps however radial it is,
+// and the collision singularity is gone.
+class KsPair {
+public:
+    double mu = 1;
+    // steps per oscillator period, the steps per orbit of a bound pair
+    double steps_per_orbit = 256;
+
+    uint64_t steps = 0;
+
+    // state
+    glm::dvec4 u = glm::dvec4(0);
+    glm::dvec4 u_prime = glm::dvec4(0);
+    double energy = 0;
+    double time = 0;
+
+    void start(glm::dvec3 r, glm::dvec3 v, double pair_mu, double t0) {
+        mu = pair_mu;
+        time = t0;
+
+        double distance = glm::length(r);
+
+        // of the one-parameter family of u mapping to r pick the one that is well conditioned
+        if (r.x >= 0) {
+            u.x = std::sqrt((distance + r.x) / 2);
+            u.y = r.y / (2 * u.x);
+            u.z = r.z / (2 * u.x);
+            u.w = 0;
+        } else {
+            u.y = std::sqrt((distance - r.x) / 2);
+            u.x = r.y / (2 * u.y);
+            u.w = r.z / (2 * u.y);
+            u.z = 0;
+        }
+
+        u_prime = 0.5 * transposedProduct(u, glm::dvec4(v, 0));
+        energy = glm::dot(v, v) / 2 - mu / distance;
+    }
+
+    glm::dvec3 position() const {
+        return glm::dvec3(product(u, u));
+    }
+
+    glm::dvec3 velocity() const {
+        return glm::dvec3(product(u, u_prime)) * (2 / glm::dot(u, u));
+    }
+
+    // integrates to physical time t_end, perturbation(t, r, v) is the perturbing relative acceleration
+    template<class Perturbation>
+    void integrateTo(double t_end, const Perturbation& perturbation) {
+        // a bound pair oscillates with frequency sqrt(-h / 2) in s, an unbound one grows at sqrt(h / 2)
+        double rate = std::sqrt(std::max(std::abs(energy) / 2, 1e-300));
+        double max_ds = glm::two_pi<double>() / (steps_per_orbit * rate);
+
+        // the remaining time limits the step too, so the last steps home in on t_end
+        for (int i = 0; i < 10000 && std::abs(t_end - time) > 1e-14 * std::max(1.0, std::abs(t_end)); i++) {
+            double ds = (t_end - time) / glm::dot(u, u);
+            step(std::clamp(ds, -max_ds, max_ds), perturbation);
+        }
+    }
+
+private:
+    // L(u) v, the Kustaanheimo-Stiefel matrix applied to v
+    static glm::dvec4 product(glm::dvec4 u, glm::dvec4 v) {
+        return glm::dvec4(
+            u.x * v.x - u.y * v.y - u.z * v.z + u.w * v.w,
+            u.y * v.x + u.x * v.y - u.w * v.z - u.z * v.w,
+            u.z * v.x + u.w * v.y + u.x * v.z + u.y * v.w,
+            u.w * v.x - u.z * v.y + u.y * v.z - u.x * v.w
+        );
+    }
+
+    // L(u)^T v
+    static glm::dvec4 transposedProduct(glm::dvec4 u, glm::dvec4 v) {
+        return glm::dvec4(
+            u.x * v.x + u.y * v.y + u.z * v.z + u.w * v.w,
+            -u.y * v.x + u.x * v.y + u.w * v.z - u.z * v.w,
+            -u.z * v.x - u.w * v.y + u.x * v.z + u.y * v.w,
+            u.w * v.x - u.z * v.y + u.y * v.z - u.x * v.w
+        );
+    }
+
+    struct Derivative {
+        glm::dvec4 du, du_prime;
+        double denergy, dtime;
+    };
+
+    template<class Perturbation>
+    Derivative derivative(glm::dvec4 q, glm::dvec4 q_prime, double h, double t, const Perturbation& perturbation) const {
+        double r = glm::dot(q, q);
+        glm::dvec3 x(product(q, q));
+        glm::dvec3 v = glm::dvec3(product(q, q_prime)) * (2 / r);
+
+        glm::dvec4 p = transposedProduct(q, glm::dvec4(perturbation(t, x, v), 0));
+
+        return {q_prime, (h / 2) * q + (r / 2) * p, 2 * glm::dot(q_prime, p), r};
+    }
+
+    template<class Perturbation>
+    void step(double ds, const Perturbation& perturbation) {
+        auto k1 = derivative(u, u_prime, energy, time, perturbation);
+        auto k2 = derivative(u + ds / 2 * k1.du, u_prime + ds / 2 * k1.du_prime, energy + ds / 2 * k1.denergy, time + ds / 2 * k1.dtime, perturbation);
+        auto k3 = derivative(u + ds / 2 * k2.du, u_prime + ds / 2 * k2.du_prime, energy + ds / 2 * k2.denergy, time + ds / 2 * k2.dtime, perturbation);
+        auto k4 = derivative(u + ds * k3.du, u_prime + ds * k3.du_prime, energy + ds * k3.denergy, time + ds * k3.dtime, perturbation);
+
+        u += ds / 6 * (k1.du + 2.0 * k2.du + 2.0 * k3.du + k4.du);
+        u_prime += ds / 6 * (k1.du_prime + 2.0 * k2.du_prime + 2.0 * k3.du_prime + k4.du_prime);
+        energy += ds / 6 * (k1.denergy + 2 * k2.denergy + 2 * k3.denergy + k4.denergy);
+        time += ds / 6 * (k1.dtime + 2 * k2.dtime + 2 * k3.dtime + k4.dtime);
+
+        steps++;
+    }
+};
+
+// Advances bodies 0 and 1 as a regularized pair for one step h, the rest with the splitting scheme.
+// The pair's center of mass stands in for it in the outer step, the other bodies perturb the relative
+// orbit from their positions interpolated over the step.
+template<class Forces>
+void regularizedPairStep(KsPair& ks, IntegratorKind integrator, BodyStore& bodies, double h, Forces& forces) {
+    size_t n = bodies.size();
+    double m0 = bodies.mass[0];
+    double m1 = bodies.mass[1];
+    double pair_mass = m0 + m1;
+
+    glm::dvec3 center = (m0 * bodies.position(0) + m1 * bodies.position(1)) / pair_mass;
+    glm::dvec3 center_velocity = (m0 * bodies.velocity(0) + m1 * bodies.velocity(1)) / pair_mass;
+
+    BodyStore outer;
+    outer.addBody(pair_mass, center, center_velocity);
+    for (size_t i = 2; i < n; i++) outer.addBody(bodies.mass[i], bodies.position(i), bodies.velocity(i));
+
+    BodyStore outer_start = outer;
+    symplecticStep(integrator, outer, h, forces);
+
+    double G = forces.G;
+    double eps2 = forces.softening * forces.softening;
+
+    // tidal acceleration of the others on the relative orbit
+    auto perturbation = [&](double t, glm::dvec3 r, glm::dvec3) {
+        double f = std::clamp(t / h, 0.0, 1.0);
+        glm::dvec3 c = glm::mix(outer_start.position(0), outer.position(0), f);
+        glm::dvec3 p0 = c - r * (m1 / pair_mass);
+        glm::dvec3 p1 = c + r * (m0 / pair_mass);
+
+        glm::dvec3 acceleration(0);
+        for (size_t i = 1; i < outer.size(); i++) {
+            glm::dvec3 p = glm::mix(outer_start.position(i), outer.position(i), f);
+            glm::dvec3 d0 = p - p0;
+            glm::dvec3 d1 = p - p1;
+
+            double r0 = std::sqrt(glm::dot(d0, d0) + eps2);
+            double r1 = std::sqrt(glm::dot(d1, d1) + eps2);
+
+            acceleration += G * outer.mass[i] * (d1 / (r1 * r1 * r1) - d0 / (r0 * r0 * r0));
+        }
+        return acceleration;
+    };
+
+    ks.start(bodies.position(1) - bodies.position(0), bodies.velocity(1) - bodies.velocity(0), G * pair_mass, 0);
+    ks.integrateTo(h, perturbation);
+
+    glm::dvec3 r = ks.position();
+    glm::dvec3 v = ks.velocity();
+
+    bodies.setPosition(0, outer.position(0) - r * (m1 / pair_mass));
+    bodies.setPosition(1, outer.position(0) + r * (m0 / pair_mass));
+    bodies.setVelocity(0, outer.velocity(0) - v * (m1 / pair_mass));
+    bodies.setVelocity(1, outer.velocity(0) + v * (m0 / pair_mass));
+
+    for (size_t i = 2; i < n; i++) {
+        bodies.setPosition(i, outer.position(i - 1));
+        bodies.setVelocity(i, outer.velocity(i - 1));
+    }
+
+    bodies.accelerations_valid = false;
+}
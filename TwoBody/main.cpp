@@ -16,12 +16,26 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 
+#include <array>
 #include <filesystem>
+#include <random>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <sstream>
 #include <vector>
 
+#include "conservation.h"
+#include "events.h"
+#include "parareal.h"
+#include "patched_conics.h"
+#include "reproducibility.h"
+#include "secular.h"
+#include "simulation.h"
+#include "thread_pool.h"
+#include "time_base.h"
+#include "time_warp.h"
+
 std::string resource_folder_dir;
 
 std::string readFromFile(std::string path) {
@@ -46,7 +60,44 @@ std::string readFromFile(std::string path) {
     return "";
 }
 
-GLuint generateTexture(std::string path, int textureUnitIndex) {
+// An image file decoded on the pool, so the files of all the textures load side by side while the GL calls stay on
+// the thread that owns the context. The pixels are shared with the decoding job and freed with the last copy.
+class DecodedImage {
+public:
+    std::string path;
+
+    explicit DecodedImage(std::string path) : path(path), pixels(std::make_shared<Pixels>()) {
+        std::shared_ptr<Pixels> target = pixels;
+        decoding = ThreadPool::global().submit([target, path] {
+            target->data = stbi_load(path.c_str(), &target->width, &target->height, &target->channels, 0);
+        });
+    }
+
+    // waits for the decoding, null when the file could not be read
+    const unsigned char* data(int& width, int& height) const {
+        ThreadPool::global().wait(decoding);
+        width = pixels->width;
+        height = pixels->height;
+        return pixels->data;
+    }
+
+private:
+    struct Pixels {
+        int width = 0;
+        int height = 0;
+        int channels = 0;
+        unsigned char* data = nullptr;
+
+        ~Pixels() {
+            stbi_image_free(data);
+        }
+    };
+
+    std::shared_ptr<Pixels> pixels;
+    ThreadPool::JobHandle decoding;
+};
+
+GLuint generateTexture(const DecodedImage& image, int textureUnitIndex) {
     GLuint texture;
     glActiveTexture(GL_TEXTURE0 + textureUnitIndex);
     glGenTextures(1, &texture);
@@ -58,29 +109,25 @@ GLuint generateTexture(std::string path, int textureUnitIndex) {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    // load and generate the texture
-    stbi_set_flip_vertically_on_load(true);
-    
-    int width, height, nrChannels;
-    unsigned char* data = stbi_load(path.c_str(), &width, &height, &nrChannels, 0);
+    // generate the texture from the decoded file
+    int width, height;
+    const unsigned char* data = image.data(width, height);
     
     if (data) {
         glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
         glGenerateMipmap(GL_TEXTURE_2D);
     } else {
-        auto message = std::string("ERROR::TEXTURE::LOADING_FAILED\n") + "Path is " + path + "\n";
+        auto message = std::string("ERROR::TEXTURE::LOADING_FAILED\n") + "Path is " + image.path + "\n";
 
         std::cout << message << std::endl;
 
         throw std::runtime_error(message);
     }
 
-    stbi_image_free(data);
-
     return texture;
 }
 
-GLuint generateCubemap(const std::vector<std::string>& faces, int textureUnitIndex) {
+GLuint generateCubemap(const std::vector<DecodedImage>& faces, int textureUnitIndex) {
     assert(faces.size() == 6);
 
     GLuint texture;
@@ -88,21 +135,19 @@ GLuint generateCubemap(const std::vector<std::string>& faces, int textureUnitInd
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_CUBE_MAP, texture);
 
-    int width, height, nrChannels;
+    int width, height;
     for (unsigned int i = 0; i < faces.size(); i++)
     {
-        unsigned char* data = stbi_load(faces[i].c_str(), &width, &height, &nrChannels, 0);
+        const unsigned char* data = faces[i].data(width, height);
         if (data) {
             glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
         } else {
-            auto message = std::string("ERROR::CUBEMAP_TEXTURE::LOADING_FAILED\n") + "Path is " + faces[i] + "\n";
+            auto message = std::string("ERROR::CUBEMAP_TEXTURE::LOADING_FAILED\n") + "Path is " + faces[i].path + "\n";
 
             std::cout << message << std::endl;
 
             throw std::runtime_error(message);
         }
-
-        stbi_image_free(data);
     }
 
     glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
@@ -216,25 +261,32 @@ struct TexturedVertex {
     }
 };
 
+// Orbits a target given in double precision world coordinates. The camera is the floating origin:
+// the view transform only rotates and everything drawn is placed relative to the camera position in double,
+// so the float offsets reaching the GPU are small near the camera whatever the scene scale.
 class Camera {
 public:
-    glm::vec3 pos;
+    glm::dvec3 target;
+    glm::dvec3 pos;
     glm::vec3 front;
     glm::vec3 right;
     glm::vec3 up;
 
     float pitch;
     float yaw;
-    float distance;
+    double distance;
     float fov;
 
-    Camera(float pitch, float yaw, float distance, float fov) : pitch(pitch), yaw(yaw), distance(distance), fov(fov) {
+    double min_distance = 1;
+    double max_distance = 1e6;
+
+    Camera(float pitch, float yaw, double distance, float fov) : target(0), pitch(pitch), yaw(yaw), distance(distance), fov(fov) {
         update();
     }
 
     void update() {
         // normalize camera params
-        distance = glm::clamp(distance, 1.0f, 30.0f);
+        distance = glm::clamp(distance, min_distance, max_distance);
         pitch = glm::clamp(pitch, -0.9f * 90.0f, 0.9f * 90.0f);
 
         while (yaw < 0) yaw += 360;
@@ -250,8 +302,7 @@ public:
             cos(rad_pitch) * sin(rad_yaw)
         ));
 
-        glm::vec3 target(0, 0, 0);
-        pos = -direction * distance;
+        pos = target - glm::dvec3(direction) * distance;
 
         glm::vec3 worldUp(0, 1, 0);
 
@@ -263,7 +314,20 @@ public:
     glm::mat4 viewTransform() {
         update();
 
-        return glm::lookAt(pos, pos + front, up);
+        return glm::lookAt(glm::vec3(0), front, up);
+    }
+
+    // the near plane follows the zoom, far_extent is the distance to the farthest thing drawn
+    glm::mat4 projTransform(float aspect, double far_extent) const {
+        double near_plane = 0.01 * distance;
+        double far_plane = glm::max(100 * distance, 1.1 * far_extent);
+
+        return glm::perspective(fov, aspect, float(near_plane), float(far_plane));
+    }
+
+    // world position to camera relative, this is where double precision ends
+    glm::vec3 relative(const glm::dvec3& world) const {
+        return glm::vec3(world - pos);
     }
 };
 
@@ -272,6 +336,8 @@ public:
     glm::mat4 modelTransform;
     std::vector<glm::vec3> vertices;
     glm::vec4 color;
+    // GL_LINES draws separate segments, e.g. one marker per pair of vertices
+    GLenum primitive = GL_LINE_STRIP;
 
     static bool isPrepared;
     static ShaderProgram shaderProgram;
@@ -354,7 +420,7 @@ public:
 
         shaderProgram.setVec4("color", color);
 
-        glDrawArrays(GL_LINE_STRIP, 0, vertices.size());
+        glDrawArrays(primitive, 0, vertices.size());
     }
 };
 
@@ -468,6 +534,8 @@ public:
     glm::mat4 modelTransform;
     float r;
     GLuint texture;
+    // lit from inside, for the Sun
+    bool emissive = false;
 
     static bool isPrepared;
     static std::vector<TexturedVertex> vertices;
@@ -621,6 +689,406 @@ GLuint Sphere::vertex_buffer_obj;
 GLuint Sphere::vertex_array_obj;
 GLuint Sphere::element_buffer_obj;
 
+const double earth_mass = 1.0;
+const double moon_mass = earth_mass / 81.3;
+const double sun_mass = earth_mass * 332946.0;
+const double jupiter_mass = earth_mass * 317.83;
+const double saturn_mass = earth_mass * 95.16;
+
+// sidereal year measured in sidereal months
+const double year_in_months = 365.256 / 27.3217;
+
+// apparent radius of the Sun seen from the Earth, radians
+const double sun_angular_radius = 4.652e-3;
+
+// body sizes for drawing at real scale, where the Moon's mean distance is 60.27 Earth radii
+const double moon_distance_in_earth_radii = 60.27;
+const double moon_radius_in_earth_radii = 0.2727;
+const double jupiter_radius_in_earth_radii = 11.21;
+const double saturn_radius_in_earth_radii = 9.45;
+
+// principal moments, polar moment C / (M R^2) and the dynamical ellipticities
+const double earth_polar_moment = 0.3307;
+const double earth_dynamical_ellipticity = 3.2738e-3; // (C - A) / C
+const double moon_polar_moment = 0.3929;
+const double moon_beta = 6.316e-4; // (C - A) / B
+const double moon_gamma = 2.279e-4; // (B - A) / C
+
+enum class SceneKind {
+    EarthMoon,
+    SunEarthMoon,
+    Cluster,
+    Satellite,
+    Count
+};
+
+const char* sceneName(SceneKind kind) {
+    switch (kind) {
+    case SceneKind::EarthMoon: return "Earth and Moon";
+    case SceneKind::SunEarthMoon: return "Sun, Earth, Moon, Jupiter, Saturn";
+    case SceneKind::Cluster: return "Star cluster with hard binaries";
+    case SceneKind::Satellite: return "Earth, Moon and a low orbit satellite";
+    default: return "";
+    }
+}
+
+// camera targets of a scene, target 0 is the Earth-Moon barycenter and target k follows body k - 1
+std::vector<const char*> cameraTargetNames(SceneKind kind) {
+    switch (kind) {
+    case SceneKind::SunEarthMoon: return {"Earth-Moon barycenter", "Earth", "Moon", "Sun", "Jupiter", "Saturn"};
+    case SceneKind::Cluster: return {"Center of mass"};
+    case SceneKind::Satellite: return {"Earth-Moon barycenter", "Earth", "Moon", "Satellite"};
+    default: return {"Earth-Moon barycenter", "Earth", "Moon"};
+    }
+}
+
+glm::mat4 orbitPlaneTransform(float pitch, float roll, float periapsis = 0) {
+    auto transform = glm::rotate(glm::mat4(1), glm::radians(pitch), glm::vec3(1, 0, 0));
+    transform = glm::rotate(transform, glm::radians(roll), glm::vec3(0, 0, 1));
+    return glm::rotate(transform, glm::radians(periapsis), glm::vec3(0, 1, 0));
+}
+
+// offset of the ellipse center from the focus occupied by the Earth, in orbit plane coordinates
+glm::vec3 orbitCenterOffset(float radius_x, float radius_z) {
+    float a = glm::max(radius_x, radius_z);
+    float b = glm::min(radius_x, radius_z);
+    float c = glm::sqrt(a * a - b * b);
+
+    return radius_x >= radius_z ? glm::vec3(-c, 0, 0) : glm::vec3(0, 0, -c);
+}
+
+// relative Moon state at periapsis of the Keplerian orbit described by the Moon panel sliders, mu = G (M + m)
+void sliderOrbitPeriapsis(float radius_x, float radius_z, float pitch, float roll, float periapsis, double& mu, glm::dvec3& r, glm::dvec3& v) {
+    double a = glm::max(radius_x, radius_z);
+    double b = glm::min(radius_x, radius_z);
+    double e = glm::sqrt(1 - (b * b) / (a * a));
+
+    // G is picked so the mean motion is one radian per unit of simulation time,
+    // this way "Moon traverse speed" keeps the meaning of the old parametric angle rate
+    mu = a * a * a;
+
+    glm::dmat3 plane(glm::mat3(orbitPlaneTransform(pitch, roll, periapsis)));
+    glm::dvec3 periapsis_dir = plane * (radius_x >= radius_z ? glm::dvec3(1, 0, 0) : glm::dvec3(0, 0, 1));
+    glm::dvec3 velocity_dir = glm::cross(plane * glm::dvec3(0, 1, 0), periapsis_dir);
+
+    double periapsis_distance = a * (1 - e);
+    double periapsis_speed = glm::sqrt(mu * (1 + e) / periapsis_distance);
+
+    r = periapsis_dir * periapsis_distance;
+    v = velocity_dir * periapsis_speed;
+}
+
+// puts Earth and Moon at periapsis of the Keplerian orbit described by the Moon panel sliders
+void setupEarthMoonOrbit(Simulation& simulation, float radius_x, float radius_z, float pitch, float roll, float periapsis) {
+    double mu;
+    glm::dvec3 r, v;
+    sliderOrbitPeriapsis(radius_x, radius_z, pitch, roll, periapsis, mu, r, v);
+
+    double total_mass = earth_mass + moon_mass;
+    simulation.gravity.G = mu / total_mass;
+
+    // relative orbit split around the barycenter
+    simulation.bodies.clear();
+    simulation.bodies.addBody(earth_mass, -r * (moon_mass / total_mass), -v * (moon_mass / total_mass));
+    simulation.bodies.addBody(moon_mass, r * (earth_mass / total_mass), v * (earth_mass / total_mass));
+    simulation.reset(0);
+}
+
+// Moves bodies 0 and 1 onto the slider orbit at the simulation's time, periapsis at time 0, around their current
+// barycenter. Every other body keeps its state, the secular mode redraws the pair this way each frame.
+void placeEarthMoonPair(Simulation& simulation, float radius_x, float radius_z, float pitch, float roll, float periapsis) {
+    double mu;
+    glm::dvec3 r0, v0;
+    sliderOrbitPeriapsis(radius_x, radius_z, pitch, roll, periapsis, mu, r0, v0);
+
+    double t = simulation.stateTime();
+    KeplerState relative = propagateKepler(r0, v0, mu, t);
+
+    BodyStore bodies = simulation.bodies;
+    double m0 = bodies.mass[0], m1 = bodies.mass[1];
+    double total_mass = m0 + m1;
+    glm::dvec3 center = (m0 * bodies.position(0) + m1 * bodies.position(1)) / total_mass;
+    glm::dvec3 center_velocity = (m0 * bodies.velocity(0) + m1 * bodies.velocity(1)) / total_mass;
+
+    bodies.setPosition(0, center - relative.position * (m1 / total_mass));
+    bodies.setVelocity(0, center_velocity - relative.velocity * (m1 / total_mass));
+    bodies.setPosition(1, center + relative.position * (m0 / total_mass));
+    bodies.setVelocity(1, center_velocity + relative.velocity * (m0 / total_mass));
+    simulation.setState(bodies, t);
+}
+
+// adds a body on a circular orbit around everything already in the store, keeping the total center of mass in place
+void addCircularJacobiBody(BodyStore& bodies, double G, double mass, double distance, double angle, double radius = 0) {
+    double interior_mass = bodies.totalMass();
+    double total_mass = interior_mass + mass;
+
+    glm::dvec3 center = bodies.centerOfMass();
+    glm::dvec3 center_velocity = bodies.centerOfMassVelocity();
+
+    glm::dvec3 r = distance * glm::dvec3(glm::cos(angle), 0, -glm::sin(angle));
+    glm::dvec3 v = glm::sqrt(G * total_mass / distance) * glm::dvec3(-glm::sin(angle), 0, -glm::cos(angle));
+
+    for (size_t i = 0; i < bodies.size(); i++) {
+        bodies.setPosition(i, bodies.position(i) - r * (mass / total_mass));
+        bodies.setVelocity(i, bodies.velocity(i) - v * (mass / total_mass));
+    }
+
+    bodies.addBody(mass, center + r * (interior_mass / total_mass), center_velocity + v * (interior_mass / total_mass), radius);
+}
+
+// astronomical unit in scene units, so that a year lasts year_in_months lunar orbits
+double astronomicalUnit(double moon_semi_major_axis) {
+    return moon_semi_major_axis * glm::pow(sun_mass / (earth_mass + moon_mass) * year_in_months * year_in_months, 1.0 / 3);
+}
+
+// Earth-Moon pair from the sliders, then the Sun and the outer planets at their real distance ratios.
+// Bodies are ordered innermost first, which is the Jacobi order the Wisdom-Holman map expects.
+// Their sizes follow the scene's length unit so the Sun covers its real angular size as seen from the Earth.
+void setupSunEarthMoon(Simulation& simulation, float radius_x, float radius_z, float pitch, float roll, float periapsis) {
+    setupEarthMoonOrbit(simulation, radius_x, radius_z, pitch, roll, periapsis);
+
+    auto& bodies = simulation.bodies;
+    double G = simulation.gravity.G;
+    double au = astronomicalUnit(glm::max(radius_x, radius_z));
+    double earth_radius_unit = glm::max(radius_x, radius_z) / moon_distance_in_earth_radii;
+
+    addCircularJacobiBody(bodies, G, sun_mass, au, 0, sun_angular_radius * au);
+    addCircularJacobiBody(bodies, G, jupiter_mass, 5.2044 * au, 2.0, jupiter_radius_in_earth_radii * earth_radius_unit);
+    addCircularJacobiBody(bodies, G, saturn_mass, 9.5826 * au, 4.0, saturn_radius_in_earth_radii * earth_radius_unit);
+
+    simulation.reset(0);
+}
+
+// Earth-Moon pair from the sliders plus a satellite 400 km up, inclined like the ISS.
+// The Sun is not a body here, it acts through the third-body and radiation pressure terms.
+void setupSatellite(Simulation& simulation, float radius_x, float radius_z, float pitch, float roll, float periapsis, double earth_radius) {
+    setupEarthMoonOrbit(simulation, radius_x, radius_z, pitch, roll, periapsis);
+
+    SunEphemeris sun;
+    sun.mass = sun_mass;
+    sun.distance = astronomicalUnit(glm::max(radius_x, radius_z));
+    sun.radius = sun.distance * sun_angular_radius;
+    sun.rate = 1 / year_in_months;
+
+    simulation.third_body.sun = sun;
+    simulation.radiation.sun = sun;
+
+    auto& bodies = simulation.bodies;
+    double distance = earth_radius * (1 + 400 / simulation.drag.radius_km);
+    double inclination = glm::radians(51.6);
+    double speed = glm::sqrt(simulation.gravity.G * earth_mass / distance);
+
+    // the equator is the XZ plane and the Earth turns towards -Z at +X
+    glm::dvec3 direction(1, 0, 0);
+    glm::dvec3 velocity_direction(0, glm::sin(inclination), -glm::cos(inclination));
+
+    bodies.addBody(earth_mass * 1e-20, bodies.position(0) + direction * distance, bodies.velocity(0) + velocity_direction * speed);
+
+    simulation.reset(0);
+}
+
+// Earth and Moon as rigid bodies with the drawn spheres' Y as their poles. The Earth starts turned by angle about
+// world Y and spinning at spin, the Moon synchronous with its long axis X towards the Earth and its pole along moon_pole.
+// flattening multiplies the real ellipticities so that precession is fast enough to watch.
+void setupRotation(Simulation& simulation, double earth_radius, double moon_radius, double spin, double angle, glm::dvec3 moon_pole, double flattening, bool tidal_torque) {
+    auto& rotation = simulation.rotation;
+    auto& bodies = simulation.bodies;
+    rotation.clear();
+    rotation.tidal_torque = tidal_torque;
+
+    double earth_c = earth_polar_moment * bodies.mass[0] * earth_radius * earth_radius;
+    double earth_a = earth_c * (1 - earth_dynamical_ellipticity * flattening);
+    rotation.addBody(0, glm::dvec3(earth_a, earth_c, earth_a), glm::angleAxis(angle, glm::dvec3(0, 1, 0)), glm::dvec3(0, spin, 0));
+
+    double moon_c = moon_polar_moment * bodies.mass[1] * moon_radius * moon_radius;
+    double moon_b = moon_c * (1 + moon_gamma * flattening) / (1 + moon_beta * flattening);
+    double moon_a = moon_b - moon_gamma * flattening * moon_c;
+
+    glm::dvec3 r = bodies.position(1) - bodies.position(0);
+    glm::dvec3 v = bodies.velocity(1) - bodies.velocity(0);
+    double mu = simulation.gravity.G * (bodies.mass[0] + bodies.mass[1]);
+    double semi_major_axis = 1 / (2 / glm::length(r) - glm::dot(v, v) / mu);
+    double mean_motion = glm::sqrt(mu / (semi_major_axis * semi_major_axis * semi_major_axis));
+
+    glm::dvec3 pole = glm::normalize(moon_pole);
+    glm::dvec3 long_axis = glm::normalize(-r - pole * glm::dot(-r, pole));
+    glm::dquat orientation = glm::quat_cast(glm::dmat3(long_axis, pole, glm::cross(long_axis, pole)));
+
+    // locked means turning with the orbit, whichever way round the pole was drawn
+    double sense = glm::dot(glm::cross(r, v), pole) < 0 ? -1 : 1;
+    rotation.addBody(1, glm::dvec3(moon_a, moon_c, moon_b), orientation, pole * (sense * mean_motion));
+}
+
+ForceModelKind sceneForceModel(SceneKind kind, bool use_earth_field) {
+    switch (kind) {
+    case SceneKind::Satellite: return ForceModelKind::NearEarth;
+    case SceneKind::Cluster: return ForceModelKind::PointMass;
+    default: return use_earth_field ? ForceModelKind::Geopotential : ForceModelKind::PointMass;
+    }
+}
+
+// Plummer sphere sampled as in Aarseth, Henon & Wielen 1974, in units with G = 1 and total mass 1.
+// The first binary_count pairs are then turned into tight circular binaries, which is what makes a
+// single global timestep wasteful.
+void setupCluster(Simulation& simulation, int count, int binary_count, double radius, unsigned seed) {
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    auto isotropic = [&](double length) {
+        double cos_theta = 2 * uniform(random) - 1;
+        double sin_theta = glm::sqrt(1 - cos_theta * cos_theta);
+        double phi = 2 * M_PI * uniform(random);
+        return length * glm::dvec3(sin_theta * glm::cos(phi), cos_theta, sin_theta * glm::sin(phi));
+    };
+
+    // scale from Plummer units to a virial radius of `radius`
+    double length_scale = 3 * M_PI / 16 * radius;
+    double velocity_scale = 1 / glm::sqrt(length_scale);
+    double body_mass = 1.0 / count;
+
+    auto& bodies = simulation.bodies;
+    bodies.clear();
+
+    for (int i = 0; i < count; i++) {
+        double r;
+        do {
+            r = 1 / glm::sqrt(glm::pow(uniform(random), -2.0 / 3) - 1);
+        } while (r > 10);
+
+        double q, g;
+        do {
+            q = uniform(random);
+            g = 0.1 * uniform(random);
+        } while (g > q * q * glm::pow(1 - q * q, 3.5));
+
+        double speed = q * glm::sqrt(2.0) * glm::pow(1 + r * r, -0.25);
+
+        bodies.addBody(body_mass, isotropic(r * length_scale), isotropic(speed * velocity_scale));
+    }
+
+    glm::dvec3 center = bodies.centerOfMass();
+    glm::dvec3 center_velocity = bodies.centerOfMassVelocity();
+    for (size_t i = 0; i < bodies.size(); i++) {
+        bodies.setPosition(i, bodies.position(i) - center);
+        bodies.setVelocity(i, bodies.velocity(i) - center_velocity);
+    }
+
+    // the pair keeps the first body's place and motion as its center of mass
+    double separation = 0.005 * radius;
+    for (int k = 0; k < binary_count && 2 * k + 1 < count; k++) {
+        size_t a = 2 * k;
+        size_t b = 2 * k + 1;
+
+        glm::dvec3 axis = isotropic(1);
+        glm::dvec3 normal = glm::normalize(glm::cross(axis, isotropic(1)));
+        double orbital_speed = glm::sqrt(2 * body_mass / separation);
+
+        glm::dvec3 center_position = bodies.position(a);
+        glm::dvec3 center_velocity = bodies.velocity(a);
+
+        bodies.setPosition(a, center_position - axis * (separation / 2));
+        bodies.setPosition(b, center_position + axis * (separation / 2));
+        bodies.setVelocity(a, center_velocity - glm::cross(normal, axis) * (orbital_speed / 2));
+        bodies.setVelocity(b, center_velocity + glm::cross(normal, axis) * (orbital_speed / 2));
+    }
+
+    // the kernel and reproducibility settings of the gravity stay as they are
+    simulation.gravity.G = 1;
+    simulation.gravity.softening = 0;
+    simulation.reset(0);
+}
+
+// Exponential disk of scale length radius / 4 cut at radius, a thin sech^2 layer of a twentieth of that, in units with
+// G = 1 and total mass 1. Every body starts on the circular orbit around the mass inside its radius, taken as spherical,
+// with a tenth of that speed in random motion: a smooth collisionless system as the particle-mesh solver expects,
+// and cold enough to grow spiral arms and a bar.
+void setupDisk(Simulation& simulation, int count, double radius, unsigned seed) {
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    std::normal_distribution<double> normal(0, 1);
+
+    double scale = radius / 4;
+    double thickness = scale / 20;
+    double body_mass = 1.0 / count;
+
+    auto& bodies = simulation.bodies;
+    bodies.clear();
+
+    for (int i = 0; i < count; i++) {
+        // the surface density R e^(-R / scale) per radius is a gamma distribution of shape 2
+        double r;
+        do {
+            r = -scale * glm::log(uniform(random) * uniform(random));
+        } while (r > radius);
+
+        double phi = 2 * M_PI * uniform(random);
+        double height = thickness * glm::atanh(glm::clamp(2 * uniform(random) - 1, -0.999, 0.999));
+
+        double x = r / scale;
+        double enclosed = 1 - (1 + x) * glm::exp(-x);
+        double speed = glm::sqrt(enclosed / glm::max(r, 1e-3 * scale));
+        glm::dvec3 dispersion = 0.1 * speed * glm::dvec3(normal(random), 0.5 * normal(random), normal(random));
+
+        glm::dvec3 position(r * glm::cos(phi), height, r * glm::sin(phi));
+        glm::dvec3 velocity = speed * glm::dvec3(-glm::sin(phi), 0, glm::cos(phi)) + dispersion;
+        bodies.addBody(body_mass, position, velocity);
+    }
+
+    glm::dvec3 center = bodies.centerOfMass();
+    glm::dvec3 center_velocity = bodies.centerOfMassVelocity();
+    for (size_t i = 0; i < bodies.size(); i++) {
+        bodies.setPosition(i, bodies.position(i) - center);
+        bodies.setVelocity(i, bodies.velocity(i) - center_velocity);
+    }
+
+    simulation.gravity.G = 1;
+    simulation.gravity.softening = 0;
+    simulation.reset(0);
+}
+
+// major bodies of the patched-conic preview and what each orbits, the Moon inside the Earth's sphere of influence
+std::vector<size_t> patchedConicParents(SceneKind scene) {
+    const size_t root = BodyStore::npos;
+    if (scene == SceneKind::SunEarthMoon) return {2, 0, root, 2, 2};
+    return {root, 0};
+}
+
+// Seeds the patched-conic model from the scene's bodies and launches count craft from a parking orbit 5% above
+// the Earth in the Moon's orbit plane, at random phases, with apoapsides spread around the Moon's distance.
+// Craft listed in full_run also join the simulation as massless bodies, to be integrated alongside the preview.
+void launchPatchedCraft(PatchedConics& patched, Simulation& simulation, SceneKind scene, int count, double spread,
+    double earth_radius, const std::vector<size_t>& full_run, unsigned seed) {
+    auto& bodies = simulation.bodies;
+    patched.setMajors(bodies, patchedConicParents(scene), simulation.gravity.G, simulation.stateTime());
+
+    std::mt19937 random(seed);
+    std::uniform_real_distribution<double> uniform(0, 1);
+
+    glm::dvec3 moon_offset = bodies.position(1) - bodies.position(0);
+    glm::dvec3 normal = glm::normalize(glm::cross(moon_offset, bodies.velocity(1) - bodies.velocity(0)));
+    glm::dvec3 reference = glm::normalize(moon_offset);
+    double mu = simulation.gravity.G * bodies.mass[0];
+    double parking = 1.05 * earth_radius;
+
+    std::vector<glm::dvec3> positions, velocities;
+    for (int i = 0; i < count; i++) {
+        double phase = 2 * M_PI * uniform(random);
+        double apoapsis = glm::length(moon_offset) * (1 + spread * (2 * uniform(random) - 1));
+        double speed = glm::sqrt(2 * mu * apoapsis / (parking * (parking + apoapsis)));
+
+        glm::dvec3 direction = reference * glm::cos(phase) + glm::cross(normal, reference) * glm::sin(phase);
+        positions.push_back(bodies.position(0) + direction * parking);
+        velocities.push_back(bodies.velocity(0) + glm::cross(normal, direction) * speed);
+
+        patched.addCraft(positions.back(), velocities.back());
+    }
+
+    for (size_t i : full_run) {
+        if (i < positions.size()) bodies.addBody(0, positions[i], velocities[i]);
+    }
+    if (!full_run.empty()) simulation.reset(simulation.stateTime());
+}
+
 Camera camera(-25, 275, 16, M_PI_4);
 bool camera_position_locked = true;
 
@@ -628,9 +1096,8 @@ bool mouseDragStart = true;
 float mouseLastX;
 float mouseLastY;
 
-float executionLastFrame = 0;
-float executionCurrentFrame = 0;
-float executionDeltaTime;
+FrameClock executionClock;
+double executionDeltaTime;
 
 void find_resource_location() {
     const std::vector<std::string> location_candidates{
@@ -707,9 +1174,46 @@ void mouse_scroll_callback(GLFWwindow* window, double xoffset, double yoffset) {
     ImGuiIO& io = ImGui::GetIO();
     if (io.WantCaptureMouse) return;
 
-    float sensitivity = 0.75f;
+    // zooming is proportional to the distance so the same scroll works from a planet's surface to the outer planets
+    double sensitivity = 1.1;
+
+    camera.distance *= glm::pow(sensitivity, -yoffset);
+}
+
+// Seeds the secular model from the current Earth-Moon orbit with the Sun as the perturber.
+// The Sun's orbit is circular in the XZ plane in both scenes, the outer planets are left out.
+void startSecularEvolution(SecularKozaiLidov& secular, const Simulation& simulation) {
+    const auto& bodies = simulation.bodies;
+    double G = simulation.gravity.G;
+
+    secular.setFromRelativeOrbit(bodies.position(1) - bodies.position(0), bodies.velocity(1) - bodies.velocity(0),
+        G * (bodies.mass[0] + bodies.mass[1]), G);
+
+    secular.perturber.mass = sun_mass;
+    secular.perturber.semi_major_axis = astronomicalUnit(secular.semi_major_axis);
+    secular.perturber.eccentricity = 0;
+    secular.perturber.normal = glm::dvec3(0, 1, 0);
+}
+
+// inverse of orbitPlaneTransform and setupEarthMoonOrbit, the major axis always goes to radius_x
+void secularElementsToSliders(const SecularKozaiLidov& secular, float& radius_x, float& radius_z, float& pitch, float& roll, float& periapsis) {
+    glm::dvec3 normal = glm::normalize(secular.j);
+    double eccentricity = secular.eccentricity();
+
+    radius_x = float(secular.semi_major_axis);
+    radius_z = float(secular.semi_major_axis * glm::sqrt(glm::max(1 - eccentricity * eccentricity, 0.0)));
+
+    // normal = Rx(pitch) Rz(roll) Y = (-sin roll, cos roll cos pitch, cos roll sin pitch)
+    roll = float(glm::degrees(glm::asin(glm::clamp(-normal.x, -1.0, 1.0))));
+    pitch = float(glm::degrees(glm::atan(normal.z, normal.y)));
 
-    camera.distance += -1 * yoffset * sensitivity;
+    // periapsis direction is undefined on a circular orbit, keep the last angle
+    if (eccentricity > 1e-9) {
+        glm::dmat3 plane(glm::mat3(orbitPlaneTransform(pitch, roll)));
+        glm::dvec3 local = glm::transpose(plane) * (secular.e / eccentricity);
+
+        periapsis = float(glm::degrees(glm::atan(-local.z, local.x)));
+    }
 }
 
 int main() {
@@ -769,16 +1273,16 @@ int main() {
     glm::vec3 world_up(0, 1, 0);
     
     bool show_imgui_settings_window = true;
+    int camera_target = 0;
 
     glm::vec3 light_source_dir(1, 1, 1);
     glm::vec3 light_source_color(1, 1, 1);
     
     bool show_earth_axis = true;
     float earth_rotation_speed = 1.35f * 90;
-    float earth_angle = 0;
+    double earth_angle = 0;
     
-    float moon_orbit_position = 0;
-    float moon_angle = 0;
+    double moon_angle = 0;
     float moon_rotation_speed = 11.0f * 90;
     glm::vec3 moon_rotation_axis(0.5f, 1.0f, 0.05f);
     float moon_orbit_traverse_speed = 1.0f;
@@ -786,27 +1290,178 @@ int main() {
     float moon_orbit_radius_z = 3;
     float moon_orbit_pitch = 90 / 8;
     float moon_orbit_roll = 90 / 5;
+    float moon_orbit_periapsis = 0;
     bool ignore_textures = false;
     bool show_orbit = true;
     bool show_moon_axis = true;
 
-    auto earth_texture = generateTexture(resource_folder_dir + "earth2048.bmp", 0);
-    auto moon_texture = generateTexture(resource_folder_dir + "moon1024.bmp", 0);
-    auto skybox_texture = generateCubemap({
-        resource_folder_dir + "bkg1_right.png",
-        resource_folder_dir + "bkg1_left.png",
-        resource_folder_dir + "bkg1_bot.png", // swapped tex 3 and 4 for whatever reason
-        resource_folder_dir + "bkg1_top.png",
-        resource_folder_dir + "bkg1_front.png",
-        resource_folder_dir + "bkg1_back.png"
-    }, 0);
+    Simulation simulation(2 * M_PI / 2048);
+    std::array<float, 5> applied_orbit_params;
+    SceneKind scene = SceneKind::EarthMoon;
+    int steps_per_orbit = 2048;
+    float energy_error_budget = 1e-6f;
+    double seek_time = 0;
+
+    int parareal_slices = 16;
+    int parareal_span_orbits = 64;
+    int parareal_coarse_ratio = 8;
+    float parareal_tolerance = 1e-8f;
+    PararealReport parareal_report;
+
+    int reproducibility_steps = 256;
+    ReproducibilityReport reproducibility_report;
+
+    SphericalHarmonicField earth_field;
+    std::string earth_field_status;
+    char earth_field_file[256] = "egm2008_degree4.gfc";
+    bool use_earth_field = false;
+    int earth_field_degree = 4;
+
+    auto load_earth_field = [&]() {
+        try {
+            earth_field = SphericalHarmonicField::loadIcgem(resource_folder_dir + earth_field_file, 2190);
+            earth_field_degree = earth_field.degree;
+            earth_field_status = "Loaded " + earth_field.name + ", degree " + std::to_string(earth_field.degree);
+        } catch (std::runtime_error& error) {
+            use_earth_field = false;
+            earth_field_status = error.what();
+        }
+    };
+    load_earth_field();
+
+    int cluster_size = 256;
+    // the direct sum keeps up to cluster_direct_limit bodies, the tree, multipole and mesh solvers go on to cluster_tree_limit
+    const int cluster_direct_limit = 16384;
+    const int cluster_tree_limit = 2097152;
+    // above this many bodies the cluster is drawn as points instead of one sphere each
+    const size_t cluster_sphere_limit = 4096;
+    int cluster_binaries = 8;
+    // Plummer sphere or exponential disk
+    int cluster_shape = 0;
+    float cluster_body_radius = 0.01f;
+
+    bool secular_mode = false;
+    SecularKozaiLidov secular;
+    float secular_years_per_second = 10;
+    int secular_steps_last_frame = 0;
+
+    bool rigid_rotation = false;
+    bool tidal_torque = true;
+    float flattening_scale = 1;
+
+    // patched-conic preview of many craft, a few of which can be integrated in full alongside
+    bool patched_preview = false;
+    PatchedConics patched;
+    int patched_craft_count = 1000;
+    float patched_spread = 0.1f;
+    int patched_selected = 0;
+    float patched_preview_span = 2;
+    int patched_full_count = 4;
+    std::vector<size_t> patched_full_run;
+    FrameClock patched_clock;
+    double patched_advance_seconds = 0;
+    const double patched_max_advance = 0.5;
+
+    bool propagate_uncertainty = false;
+    float position_sigma = 0.02f;
+    float velocity_sigma = 0.002f;
+
+    ConservationMonitor monitor;
+    bool pause_on_alarm = true;
+    bool paused = false;
+
+    TimeWarpScheduler time_warp;
+    const double min_warp = 1;
+    bool was_coasting = false;
+
+    // direct summation throughput, taken over about a second
+    double direct_interaction_rate = 0;
+    double direct_interactions_per_frame = 0;
+    double direct_sample_seconds = 0;
+    int direct_sample_frames = 0;
+
+    EventFinder event_finder;
+    EventTimeline event_timeline;
+    float event_span_years = 100;
+    int event_selected = -1;
+
+    // contacts the monitor has been restarted for, merges and bounces change the conserved values
+    uint64_t seen_contacts = 0;
+
+    GLuint earth_texture, moon_texture, skybox_texture;
+    {
+        // every file starts decoding before the first upload, each upload only waits for its own file
+        stbi_set_flip_vertically_on_load(true);
+        DecodedImage earth_image(resource_folder_dir + "earth2048.bmp");
+        DecodedImage moon_image(resource_folder_dir + "moon1024.bmp");
+        std::vector<DecodedImage> skybox_faces = {
+            DecodedImage(resource_folder_dir + "bkg1_right.png"),
+            DecodedImage(resource_folder_dir + "bkg1_left.png"),
+            DecodedImage(resource_folder_dir + "bkg1_bot.png"), // swapped tex 3 and 4 for whatever reason
+            DecodedImage(resource_folder_dir + "bkg1_top.png"),
+            DecodedImage(resource_folder_dir + "bkg1_front.png"),
+            DecodedImage(resource_folder_dir + "bkg1_back.png")
+        };
+
+        earth_texture = generateTexture(earth_image, 0);
+        moon_texture = generateTexture(moon_image, 0);
+        skybox_texture = generateCubemap(skybox_faces, 0);
+    }
 
     SkyBox skybox(skybox_texture);
 
     Sphere earth(glm::mat4(1), 1, earth_texture);
     Sphere moon(glm::mat4(1), 0.5, moon_texture);
+    Sphere moon_uncertainty(glm::mat4(1), 1, moon_texture);
+
+    auto reset_simulation = [&]() {
+        if (scene == SceneKind::Cluster) {
+            if (cluster_shape == 1) {
+                setupDisk(simulation, cluster_size, 10, 1);
+            } else {
+                setupCluster(simulation, cluster_size, cluster_binaries, 5, 1);
+            }
+            simulation.bodies.radius.assign(simulation.bodies.size(), cluster_body_radius);
+        } else if (scene == SceneKind::Satellite) {
+            setupSatellite(simulation, moon_orbit_radius_x, moon_orbit_radius_z, moon_orbit_pitch, moon_orbit_roll, moon_orbit_periapsis, earth.r);
+        } else if (scene == SceneKind::SunEarthMoon) {
+            setupSunEarthMoon(simulation, moon_orbit_radius_x, moon_orbit_radius_z, moon_orbit_pitch, moon_orbit_roll, moon_orbit_periapsis);
+        } else {
+            setupEarthMoonOrbit(simulation, moon_orbit_radius_x, moon_orbit_radius_z, moon_orbit_pitch, moon_orbit_roll, moon_orbit_periapsis);
+        }
+        applied_orbit_params = {moon_orbit_radius_x, moon_orbit_radius_z, moon_orbit_pitch, moon_orbit_roll, moon_orbit_periapsis};
+
+        // craft launch from the new state, the fully integrated ones join the store behind the scene's bodies
+        bool patched_scene = scene == SceneKind::EarthMoon || scene == SceneKind::SunEarthMoon;
+        if (patched_preview && patched_scene && !secular_mode) {
+            launchPatchedCraft(patched, simulation, scene, patched_craft_count, patched_spread, earth.r, patched_full_run, 1);
+        } else {
+            patched.clearCraft();
+        }
+
+        // rigid bodies start from the drawn spin, the sliders' rate per second becomes a rate per unit of simulation time
+        if (rigid_rotation && scene != SceneKind::Cluster) {
+            glm::dvec3 moon_pole = glm::mat3(orbitPlaneTransform(moon_orbit_pitch, moon_orbit_roll, moon_orbit_periapsis)) * glm::normalize(moon_rotation_axis);
+            // a stopped simulation has no rate per unit time, the slowest nonzero speed stands in for it
+            double spin = glm::radians(double(earth_rotation_speed)) / std::max(double(moon_orbit_traverse_speed), 0.01);
+            setupRotation(simulation, earth.r, moon.r, spin, glm::radians(earth_angle), moon_pole, flattening_scale, tidal_torque);
+        } else {
+            simulation.rotation.clear();
+        }
+
+        monitor.start(simulation);
+        seen_contacts = simulation.collisions.total_contacts;
+    };
+    reset_simulation();
+
+    // craft are drawn around the drawn position of their parent, which the model's own orbit only approximates
+    auto patched_parent_position = [&](size_t k) {
+        size_t body = simulation.bodyFromReset(k);
+        return body != BodyStore::npos ? simulation.renderPosition(body) : patched.majorPosition(k, patched.time);
+    };
 
     std::vector<std::reference_wrapper<Sphere>> spheres{earth, moon};
+    std::vector<Sphere> markers;
 
     const glm::vec4 lightBlueColor(0.5, 0.5, 1, 1);
     const glm::vec4 lightRedColor(1, 0.5, 0.5, 1);
@@ -816,14 +1471,22 @@ int main() {
     PolyLine moon_orbit(glm::mat4(1), {}, lightBlueColor);
     moon_orbit.generateCircle(256);
 
+    PolyLine craft_near_earth(glm::mat4(1), {}, lightBlueColor);
+    PolyLine craft_near_moon(glm::mat4(1), {}, lightRedColor);
+    PolyLine craft_path(glm::mat4(1), {}, glm::vec4(1, 1, 0.5, 1));
+    craft_near_earth.primitive = GL_LINES;
+    craft_near_moon.primitive = GL_LINES;
+
+    PolyLine cluster_points(glm::mat4(1), {}, glm::vec4(1, 0.95f, 0.8f, 1));
+    cluster_points.primitive = GL_POINTS;
+    double cluster_points_extent = 0;
+
     std::vector<std::reference_wrapper<PolyLine>> polylines;
 
     // main loop
     while (!glfwWindowShouldClose(window)) {
         // prepare
-        executionLastFrame = executionCurrentFrame;
-        executionCurrentFrame = glfwGetTime();
-        executionDeltaTime = executionCurrentFrame - executionLastFrame;
+        executionDeltaTime = executionClock.tick();
 
         int display_width, display_height;
         glfwGetFramebufferSize(window, &display_width, &display_height);
@@ -832,57 +1495,240 @@ int main() {
         glfwPollEvents();
 
         // update
-        earth_angle += executionDeltaTime * earth_rotation_speed;
-        moon_angle += executionDeltaTime * moon_rotation_speed;
+        earth_angle = std::fmod(earth_angle + executionDeltaTime * earth_rotation_speed, 360.0);
+        moon_angle = std::fmod(moon_angle + executionDeltaTime * moon_rotation_speed, 360.0);
+
+        // orbit sliders define the initial conditions, editing them restarts the simulation
+        std::array<float, 5> orbit_params{moon_orbit_radius_x, moon_orbit_radius_z, moon_orbit_pitch, moon_orbit_roll, moon_orbit_periapsis};
+        if (orbit_params != applied_orbit_params) {
+            reset_simulation();
+            if (secular_mode) startSecularEvolution(secular, simulation);
+        }
+
+        // forces are picked by the scene and sized by the drawn bodies, a non-spherical Earth turns
+        // with the simulation clock and the drawn Earth follows it
+        simulation.force_model = sceneForceModel(scene, use_earth_field);
+        simulation.geopotential.field = &earth_field;
+        simulation.geopotential.radius = earth.r;
+        simulation.geopotential.degree = earth_field_degree;
+        simulation.zonal.radius = earth.r;
+        simulation.drag.radius = earth.r;
+        simulation.radiation.earth_radius = earth.r;
+        simulation.radiation.moon_radius = moon.r;
+        if (scene != SceneKind::Cluster) {
+            size_t moon_index = simulation.bodyFromReset(1);
+            simulation.bodies.radius[0] = earth.r;
+            if (moon_index != BodyStore::npos) simulation.bodies.radius[moon_index] = moon.r;
+        }
+        if (simulation.force_model != ForceModelKind::PointMass) {
+            earth_angle = glm::degrees(simulation.geopotential.angle(simulation.preciseTime()));
+        }
+
+        if (!paused) {
+            // coasting orders bodies innermost first, which a cluster has no notion of
+            time_warp.allow_coasting = scene != SceneKind::Cluster;
+            time_warp.advance(simulation, executionDeltaTime, moon_orbit_traverse_speed);
+        }
 
-        if (earth_angle > 360) earth_angle -= 360;
-        if (moon_angle > 360) moon_angle -= 360;
+        if (secular_mode) {
+            // the secular model owns the orbit elements and writes them back into the sliders, without a restart;
+            // the rest of the scene runs on and the Moon is placed on the current osculating ellipse around it
+            double year = 2 * M_PI * year_in_months;
+            secular_steps_last_frame = secular.advance(glm::min(executionDeltaTime, 0.25) * secular_years_per_second * year, 20000);
 
-        moon_orbit_position += executionDeltaTime * moon_orbit_traverse_speed;
+            secularElementsToSliders(secular, moon_orbit_radius_x, moon_orbit_radius_z, moon_orbit_pitch, moon_orbit_roll, moon_orbit_periapsis);
+            applied_orbit_params = {moon_orbit_radius_x, moon_orbit_radius_z, moon_orbit_pitch, moon_orbit_roll, moon_orbit_periapsis};
+            placeEarthMoonPair(simulation, moon_orbit_radius_x, moon_orbit_radius_z, moon_orbit_pitch, moon_orbit_roll, moon_orbit_periapsis);
+        }
+
+        direct_sample_seconds += executionDeltaTime;
+        direct_sample_frames++;
+        if (direct_sample_seconds >= 1) {
+            auto& direct = simulation.gravity.direct;
+            direct_interaction_rate = direct.interactionsPerSecond();
+            direct_interactions_per_frame = double(direct.interactions) / direct_sample_frames;
+            direct.resetStatistics();
+            direct_sample_seconds = 0;
+            direct_sample_frames = 0;
+        }
+
+        if (simulation.collisions.total_contacts != seen_contacts) {
+            seen_contacts = simulation.collisions.total_contacts;
+            monitor.start(simulation);
+        }
+        // coasting leaves the interactions out and with them the conserved values, and the secular mode moves the pair
+        // off its integrated orbit on purpose; the monitor starts over after either
+        bool coasting = (time_warp.strategy == WarpStrategy::Coasting && !paused) || secular_mode;
+        if (was_coasting && !coasting) monitor.start(simulation);
+        was_coasting = coasting;
+
+        if (!coasting) monitor.update(simulation);
+        if (monitor.alarm && pause_on_alarm) paused = true;
+
+        if (patched.size() > 0 && !secular_mode) {
+            patched_clock.tick();
+            // at high warp the preview runs behind the simulation rather than stalling the frame
+            patched.advance(glm::min(simulation.time(), patched.time + patched_max_advance));
+            patched_advance_seconds = patched_clock.tick();
+        }
+
+        // scene bodies are looked up by their index at setup, merges may have removed or renumbered them,
+        // the Earth always survives as the lower index
+        size_t moon_body = scene == SceneKind::Cluster ? BodyStore::npos : simulation.bodyFromReset(1);
+        bool has_moon = moon_body != BodyStore::npos;
+
+        // the camera follows the Earth-Moon barycenter or a body, everything is drawn relative to it
+        glm::dvec3 earth_render_position = simulation.renderPosition(0);
+        glm::dvec3 moon_render_position = has_moon ? simulation.renderPosition(moon_body) : earth_render_position;
+        glm::dvec3 barycenter = (earth_mass * earth_render_position + moon_mass * moon_render_position) / (earth_mass + moon_mass);
+
+        camera_target = glm::min(camera_target, int(cameraTargetNames(scene).size()) - 1);
+        size_t target_body = camera_target > 0 ? simulation.bodyFromReset(camera_target - 1) : BodyStore::npos;
+        if (scene == SceneKind::Cluster) camera.target = glm::dvec3(0);
+        else if (target_body == BodyStore::npos) camera.target = barycenter;
+        else camera.target = simulation.renderPosition(target_body);
+        camera.update();
+
+        glm::vec3 earth_position = camera.relative(earth_render_position);
+        glm::vec3 moon_position = camera.relative(moon_render_position);
+
+        size_t sun_body = simulation.bodyFromReset(2);
+        if (scene == SceneKind::SunEarthMoon && sun_body != BodyStore::npos && sun_body != 0) {
+            light_source_dir = glm::normalize(glm::vec3(simulation.renderPosition(sun_body) - earth_render_position));
+        } else if (scene == SceneKind::Satellite) {
+            light_source_dir = glm::normalize(glm::vec3(simulation.radiation.sun.position(simulation.time()) - earth_render_position));
+        }
         
+        // rigid bodies are drawn with their integrated attitude, the Earth only while nothing else turns its field
+        size_t earth_spin = simulation.rotation.find(0);
+        size_t moon_spin = simulation.rotation.find(moon_body);
+        bool rigid_earth = earth_spin < simulation.rotation.size() && simulation.force_model == ForceModelKind::PointMass;
+        bool rigid_moon = moon_spin < simulation.rotation.size();
+
         // transformations applied in reverse order (why opengl!?)
-        earth
-            .resetTransform()
-            .rotate(glm::radians(earth_angle), world_up);
+        if (rigid_earth) {
+            earth.setTransform(glm::translate(glm::mat4(1), earth_position) * glm::mat4(glm::mat4_cast(simulation.renderOrientation(earth_spin))));
+        } else {
+            earth
+                .resetTransform()
+                .translate(earth_position)
+                .rotate(glm::radians(float(earth_angle)), world_up);
+        }
 
         moon_orbit
-            .resetTransform()
-            .rotate(glm::radians(moon_orbit_pitch), glm::vec3(1, 0, 0))
-            .rotate(glm::radians(moon_orbit_roll), glm::vec3(0, 0, 1))
+            .setTransform(glm::translate(glm::mat4(1), earth_position) * orbitPlaneTransform(moon_orbit_pitch, moon_orbit_roll, moon_orbit_periapsis))
+            .translate(orbitCenterOffset(moon_orbit_radius_x, moon_orbit_radius_z))
             .scale(moon_orbit_radius_x, 1, moon_orbit_radius_z);
 
-        moon
-            .resetTransform()
-            .rotate(glm::radians(moon_orbit_pitch), glm::vec3(1, 0, 0))
-            .rotate(glm::radians(moon_orbit_roll), glm::vec3(0, 0, 1))
-            .translate(glm::vec3(moon_orbit_radius_x * glm::sin(moon_orbit_position), 0, 0))
-            .translate(glm::vec3(0, 0, moon_orbit_radius_z * glm::cos(moon_orbit_position)))
-            .rotate(glm::radians(moon_angle), moon_rotation_axis);
+        if (rigid_moon) {
+            moon.setTransform(glm::translate(glm::mat4(1), moon_position) * glm::mat4(glm::mat4_cast(simulation.renderOrientation(moon_spin))));
+        } else {
+            moon
+                .setTransform(glm::translate(glm::mat4(1), moon_position) * orbitPlaneTransform(moon_orbit_pitch, moon_orbit_roll, moon_orbit_periapsis))
+                .rotate(glm::radians(float(moon_angle)), moon_rotation_axis);
+        }
+
+        bool show_uncertainty = propagate_uncertainty && simulation.mode == SteppingMode::Symplectic && has_moon;
+        if (show_uncertainty) {
+            glm::dmat3 covariance = simulation.stm.positionCovariance(moon_body, position_sigma, velocity_sigma);
+            moon_uncertainty.setTransform(covarianceEllipsoidTransform(moon_position, covariance, 3));
+        }
 
         polylines.clear();
+        spheres.clear();
+
+        cluster_points_extent = 0;
+        if (scene == SceneKind::Cluster && simulation.bodies.size() > cluster_sphere_limit) {
+            markers.clear();
+            cluster_points.vertices.resize(simulation.bodies.size());
+            for (size_t i = 0; i < simulation.bodies.size(); i++) {
+                cluster_points.vertices[i] = camera.relative(simulation.renderPosition(i));
+                cluster_points_extent = glm::max(cluster_points_extent, double(glm::length(cluster_points.vertices[i])));
+            }
+            polylines.emplace_back(cluster_points);
+        } else if (scene == SceneKind::Cluster) {
+            // every body is drawn as a small sphere, bodies grown by merging at their size
+            markers.assign(simulation.bodies.size(), Sphere(glm::mat4(1), 0.08f, moon_texture));
+            for (size_t i = 0; i < markers.size(); i++) {
+                markers[i].r = glm::max(markers[i].r, float(simulation.bodies.radius[i]));
+                markers[i].setTransform(glm::translate(glm::mat4(1), camera.relative(simulation.renderPosition(i))));
+            }
+            spheres.assign(markers.begin(), markers.end());
+        } else {
+            spheres.emplace_back(earth);
+            if (has_moon) spheres.emplace_back(moon);
+
+            // every other body is drawn at its own size, satellites and fragments without one as small spheres
+            markers.clear();
+            for (size_t i = 1; i < simulation.bodies.size(); i++) {
+                if (i == moon_body) continue;
+
+                Sphere marker(glm::translate(glm::mat4(1), camera.relative(simulation.renderPosition(i))), 0.03f, moon_texture);
+                if (simulation.bodies.radius[i] > 0) marker.r = float(simulation.bodies.radius[i]);
+                marker.emissive = scene == SceneKind::SunEarthMoon && i == sun_body;
+                markers.push_back(marker);
+            }
+            for (Sphere& marker : markers) spheres.emplace_back(marker);
+        }
 
-        if (show_earth_axis) {
+        if (show_earth_axis && scene != SceneKind::Cluster) {
             earth_axis.modelTransform = earth.modelTransform;
             earth_axis.vertices = earth.getAxisSegment(world_up);
             polylines.emplace_back(earth_axis);
         }
         
-        if (show_moon_axis) {
+        if (show_moon_axis && has_moon) {
             moon_axis.modelTransform = moon.modelTransform;
-            moon_axis.vertices = moon.getAxisSegment(moon_rotation_axis);
+            moon_axis.vertices = moon.getAxisSegment(rigid_moon ? glm::vec3(0, 1, 0) : moon_rotation_axis);
             polylines.emplace_back(moon_axis);
         }
 
-        if (show_orbit) {
+        if (show_orbit && has_moon) {
             polylines.emplace_back(moon_orbit);
         }
 
+        // patched-conic craft as small crosses, red inside the Moon's sphere of influence, and the selected one's path ahead
+        if (patched.size() > 0) {
+            std::vector<glm::dvec3> parent_positions(patched.majorCount());
+            for (size_t k = 0; k < parent_positions.size(); k++) parent_positions[k] = patched_parent_position(k);
+
+            float cross_size = float(camera.distance * 0.004);
+            craft_near_earth.vertices.clear();
+            craft_near_moon.vertices.clear();
+            for (size_t i = 0; i < patched.size(); i++) {
+                glm::vec3 center = camera.relative(parent_positions[patched.parent[i]] + patched.relativePosition(i));
+                auto& crosses = patched.parent[i] == 1 ? craft_near_moon.vertices : craft_near_earth.vertices;
+
+                for (int axis = 0; axis < 3; axis++) {
+                    glm::vec3 offset(0);
+                    offset[axis] = cross_size;
+                    crosses.push_back(center - offset);
+                    crosses.push_back(center + offset);
+                }
+            }
+            polylines.emplace_back(craft_near_earth);
+            polylines.emplace_back(craft_near_moon);
+
+            patched_selected = glm::clamp(patched_selected, 0, int(patched.size()) - 1);
+            size_t selected_parent = patched.parent[patched_selected];
+            glm::dvec3 shift = parent_positions[selected_parent] - patched.majorPosition(selected_parent, patched.time);
+
+            craft_path.vertices.clear();
+            for (const glm::dvec3& point : patched.previewPath(patched_selected, patched_preview_span, 512)) {
+                craft_path.vertices.push_back(camera.relative(point + shift));
+            }
+            polylines.emplace_back(craft_path);
+        }
+
         // draw
         glClearColor(0.2f, 0.1f, 0.3f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+        double far_extent = cluster_points_extent;
+        for (Sphere& sphere : spheres) far_extent = glm::max(far_extent, double(glm::length(glm::vec3(sphere.center()))) + sphere.r);
+
         auto viewTransform = camera.viewTransform();
-        auto projTransform = glm::perspective(camera.fov, float(display_width) / display_height, 0.1f, 100.0f);
+        auto projTransform = camera.projTransform(float(display_width) / display_height, far_extent);
 
         {
             auto vertexTransform = projTransform * glm::mat4(glm::mat3(viewTransform)); // no translation in viewTransform
@@ -911,15 +1757,26 @@ int main() {
 
             sphere.shaderProgram.use();
             sphere.shaderProgram.setMatrix4fv("vertexTransform", vertexTransform);
-            sphere.shaderProgram.setVec3("cameraPos", camera.pos);
             sphere.shaderProgram.setVec3("lightDirection", light_source_dir);
             sphere.shaderProgram.setVec3("lightColor", light_source_color);
-            sphere.shaderProgram.setVec3("cameraPos", camera.pos);
             sphere.shaderProgram.setFloat("ignoreTextures", ignore_textures);
+            sphere.shaderProgram.setFloat("emissive", sphere.emissive);
 
             sphere.draw();
         }
 
+        if (show_uncertainty) {
+            auto vertexTransform = projTransform * viewTransform * moon_uncertainty.modelTransform;
+
+            moon_uncertainty.shaderProgram.setMatrix4fv("vertexTransform", vertexTransform);
+            moon_uncertainty.shaderProgram.setFloat("ignoreTextures", true);
+            moon_uncertainty.shaderProgram.setFloat("emissive", false);
+
+            glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+            moon_uncertainty.draw();
+            glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+        }
+
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
@@ -930,6 +1787,16 @@ int main() {
 
             ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
 
+            ImGui::SliderScalar("Time warp", ImGuiDataType_Double, &time_warp.warp, &min_warp, &time_warp.max_warp, "%.0fx", ImGuiSliderFlags_Logarithmic);
+            ImGui::Text("Achieved %.3gx, %s, %d steps in %.2f ms", time_warp.achieved_warp, warpStrategyName(time_warp.strategy),
+                time_warp.steps_last_frame, time_warp.physics_seconds * 1e3);
+            if (simulation.stride > 1) ImGui::Text("Fixed steps %d times longer", simulation.stride);
+
+            if (monitor.alarm) {
+                ImGui::TextColored(ImVec4(1, 0.3f, 0.3f, 1), "Conservation alarm: %s drift %.2e at t = %.3f",
+                    monitor.alarm_quantity, monitor.alarm_drift, monitor.alarm_time);
+            }
+
             ImGui::Checkbox("Ignore textures", &ignore_textures);
 
             ImGui::DragFloat3("Light direction", (float*)&light_source_dir, 0.01f, -1.0f, 1.0f);
@@ -941,29 +1808,550 @@ int main() {
                 ImGui::SliderFloat("Camera yaw", &camera.yaw, 0.0f, 360.0f);
                 ImGui::Text("Drag scene holding LMB to rotate camera");
 
-                ImGui::SliderFloat("Camera distance", &camera.distance, 1.0f, 30.0f);
+                ImGui::SliderScalar("Camera distance", ImGuiDataType_Double, &camera.distance, &camera.min_distance, &camera.max_distance, "%.2f", ImGuiSliderFlags_Logarithmic);
                 ImGui::Text("Use mouse scroll to adjust camera distance");
+
+                auto target_names = cameraTargetNames(scene);
+                ImGui::Combo("Camera target", &camera_target, target_names.data(), int(target_names.size()));
+            }
+
+            if (ImGui::CollapsingHeader("Simulation")) {
+                if (ImGui::BeginCombo("Scene", sceneName(scene))) {
+                    for (int k = 0; k < int(SceneKind::Count); k++) {
+                        if (ImGui::Selectable(sceneName(SceneKind(k)), SceneKind(k) == scene)) {
+                            scene = SceneKind(k);
+                            reset_simulation();
+
+                            // one global step would be set by the tightest binary
+                            if (scene == SceneKind::Cluster) {
+                                simulation.setMode(SteppingMode::BlockHermite);
+                                secular_mode = false;
+                            }
+
+                            // the satellite orbits ~17 times per lunar month, drag and shadow entry want adaptive steps
+                            if (scene == SceneKind::Satellite) {
+                                simulation.setMode(SteppingMode::Adaptive);
+                                secular_mode = false;
+                            }
+                        }
+                    }
+                    ImGui::EndCombo();
+                }
+                if (scene == SceneKind::SunEarthMoon || scene == SceneKind::Satellite) ImGui::Text("Light direction follows the Sun");
+
+                ImGui::Text("Simulation time %.3f (%llu steps)", simulation.time(), (unsigned long long)simulation.step_count);
+
+                float budget_ms = float(time_warp.budget * 1e3);
+                if (ImGui::SliderFloat("Physics budget, ms", &budget_ms, 1, 30, "%.1f")) time_warp.budget = budget_ms * 1e-3;
+                ImGui::Text("Relative energy error %.3e", simulation.relativeEnergyError());
+
+                if (simulation.isTwoBody()) {
+                    ImGui::Text("Position error against Kepler solution %.3e", simulation.analyticPositionError());
+
+                    ImGui::InputDouble("Seek time", &seek_time, 0, 0, "%.3f");
+                    ImGui::SameLine();
+                    if (ImGui::Button("Seek")) simulation.seek(seek_time);
+                    ImGui::Text("One orbit takes %.4f time units", 2 * M_PI);
+                }
+
+                const char* mode_names[] = {"Symplectic, fixed step", "Adaptive IAS15 with dense output", "Wisdom-Holman, fixed step", "Block Hermite, individual steps"};
+                int mode = int(simulation.mode);
+                if (ImGui::Combo("Stepping", &mode, mode_names, IM_ARRAYSIZE(mode_names))) simulation.setMode(SteppingMode(mode));
+
+                if (simulation.mode == SteppingMode::Symplectic || simulation.mode == SteppingMode::WisdomHolman) {
+                    if (ImGui::SliderInt("Steps per orbit", &steps_per_orbit, 8, 65536, "%d", ImGuiSliderFlags_Logarithmic)) {
+                        simulation.setFixedStep(2 * M_PI / steps_per_orbit);
+                    }
+                    ImGui::SliderInt("Longest stride at high warp", &time_warp.max_stride, 1, 1024, "%d", ImGuiSliderFlags_Logarithmic);
+                }
+
+                if (simulation.mode == SteppingMode::Adaptive) {
+                    float ias15_epsilon = simulation.ias15.epsilon;
+                    if (ImGui::InputFloat("IAS15 tolerance", &ias15_epsilon, 0, 0, "%.1e")) simulation.ias15.epsilon = glm::max(ias15_epsilon, 1e-16f);
+
+                    ImGui::Text("Step %.3e, accepted %llu, rejected %llu", simulation.ias15.dt,
+                        (unsigned long long)simulation.ias15.steps_accepted, (unsigned long long)simulation.ias15.steps_rejected);
+                } else if (simulation.mode == SteppingMode::Symplectic) {
+                    if (ImGui::BeginCombo("Integrator", integratorName(simulation.integrator))) {
+                        for (int k = 0; k < int(IntegratorKind::Count); k++) {
+                            auto kind = IntegratorKind(k);
+                            if (ImGui::Selectable(integratorName(kind), kind == simulation.integrator)) {
+                                simulation.integrator = kind;
+                            }
+                        }
+                        ImGui::EndCombo();
+                    }
+                    ImGui::Text("Force evaluations per step: %d", integratorForceEvaluations(simulation.integrator));
+
+                    ImGui::InputFloat("Energy error budget", &energy_error_budget, 0, 0, "%.1e");
+                    if (ImGui::Button("Pick cheapest integrator within budget")) {
+                        // one full orbit is the trial span, mean motion is one radian per time unit
+                        simulation.integrator = cheapestIntegratorWithin(simulation, energy_error_budget, 2 * M_PI);
+                    }
+
+                    ImGui::Checkbox("Regularize close Earth-Moon passes", &simulation.regularize_pair);
+                    if (simulation.regularize_pair) {
+                        ImGui::InputDouble("Above eccentricity", &simulation.regularize_eccentricity, 0, 0, "%.4f");
+                        ImGui::InputDouble("Below separation", &simulation.regularize_separation, 0, 0, "%.3f");
+                        ImGui::Text("Regularized segments %llu, KS steps %llu", (unsigned long long)simulation.regularized_segments,
+                            (unsigned long long)simulation.ks.steps);
+                    }
+                }
+
+                if (ImGui::Checkbox("Propagate Moon uncertainty", &propagate_uncertainty)) simulation.setPropagateStm(propagate_uncertainty);
+                if (propagate_uncertainty) {
+                    ImGui::InputFloat("Initial position sigma", &position_sigma, 0, 0, "%.1e");
+                    ImGui::InputFloat("Initial velocity sigma", &velocity_sigma, 0, 0, "%.1e");
+                    ImGui::Text("Wireframe shows the 3-sigma position ellipsoid");
+                    if (simulation.mode != SteppingMode::Symplectic) ImGui::Text("Only propagated in symplectic mode");
+                }
+
+                if (ImGui::TreeNode("Parareal")) {
+                    ImGui::SliderInt("Time slices", &parareal_slices, 2, 256);
+                    ImGui::SliderInt("Span, orbits", &parareal_span_orbits, 1, 4096, "%d", ImGuiSliderFlags_Logarithmic);
+                    ImGui::SliderInt("Coarse step ratio", &parareal_coarse_ratio, 2, 64);
+                    ImGui::InputFloat("Tolerance", &parareal_tolerance, 0, 0, "%.1e");
+                    if (simulation.collisions.enabled) ImGui::Text("Collisions are off within the slices, the body count must stay fixed");
+
+                    if (ImGui::Button("Run from current state")) {
+                        // fine propagator is the current stepping setup, coarse one is a cheap fixed-step variant of it
+                        Simulation coarse_settings = simulation;
+                        coarse_settings.integrator = simulation.mode == SteppingMode::Symplectic ? simulation.integrator : IntegratorKind::Yoshida4;
+                        coarse_settings.mode = simulation.mode == SteppingMode::WisdomHolman ? SteppingMode::WisdomHolman : SteppingMode::Symplectic;
+
+                        SimulationPropagator coarse(coarse_settings, simulation.fixed_dt * parareal_coarse_ratio);
+                        SimulationPropagator fine(simulation, simulation.fixed_dt);
+
+                        BodyStore state = simulation.bodies;
+                        double t_start = simulation.stateTime();
+                        double t_end = t_start + 2 * M_PI * parareal_span_orbits;
+
+                        parareal_report = parareal(state, t_start, t_end, parareal_slices, coarse, fine,
+                            parareal_tolerance, parareal_slices, ThreadPool::global());
+
+                        simulation.setState(state, t_end);
+                    }
+
+                    if (parareal_report.iterations > 0) {
+                        ImGui::Text("%s after %d iterations on %u threads", parareal_report.converged ? "Converged" : "Stopped",
+                            parareal_report.iterations, ThreadPool::global().size());
+                        ImGui::Text("Wall %.3f s, serial fine estimate %.3f s", parareal_report.wall_seconds, parareal_report.serial_fine_seconds);
+                        ImGui::Text("Speedup %.2fx, last update %.2e", parareal_report.speedup, parareal_report.last_update);
+                    }
+
+                    ImGui::TreePop();
+                }
+
+                if (ImGui::TreeNode("Reproducibility")) {
+                    ImGui::Checkbox("Thread count independent gravity", &simulation.gravity.reproducible);
+                    ImGui::Text("Parallel from %zu bodies, %zu now", simulation.gravity.parallel_threshold, simulation.bodies.size());
+                    ImGui::SliderInt("Steps", &reproducibility_steps, 1, 65536, "%d", ImGuiSliderFlags_Logarithmic);
+
+                    if (ImGui::Button("Hash state after the steps on 1, 2, 4 and all threads")) {
+                        // the single thread run is repeated to catch differences between restarts
+                        unsigned all = std::max(1u, std::thread::hardware_concurrency());
+                        reproducibility_report = reproducibilityCheck(simulation, uint64_t(reproducibility_steps), {1, 1, 2, 4, all});
+                    }
+
+                    for (const auto& run : reproducibility_report.runs) {
+                        ImGui::Text("%2u threads  %016llx  %.3f s", run.threads, (unsigned long long)run.hash, run.seconds);
+                    }
+                    if (!reproducibility_report.runs.empty()) {
+                        ImGui::Text(reproducibility_report.identical ? "All states bit-identical" : "States differ");
+                    }
+
+                    ImGui::TreePop();
+                }
+
+                if (scene == SceneKind::Cluster) {
+                    int cluster_limit = simulation.gravity.solver == GravitySolver::Direct ? cluster_direct_limit : cluster_tree_limit;
+                    bool resize = ImGui::SliderInt("Cluster bodies", &cluster_size, 16, cluster_limit, "%d", ImGuiSliderFlags_Logarithmic);
+                    resize |= ImGui::Combo("Shape", &cluster_shape, "Plummer sphere with hard binaries\0Exponential disk\0");
+                    if (cluster_shape == 0) resize |= ImGui::SliderInt("Hard binaries", &cluster_binaries, 0, 64);
+                    resize |= ImGui::SliderFloat("Body radius", &cluster_body_radius, 0.001f, 0.5f, "%.3f", ImGuiSliderFlags_Logarithmic);
+                    if (resize) reset_simulation();
+                }
+
+                if (ImGui::TreeNode("Gravity solver")) {
+                    auto& gravity = simulation.gravity;
+                    auto& tree = gravity.tree;
+                    int solver = int(gravity.solver);
+                    if (ImGui::Combo("Solver", &solver, "Direct summation\0Barnes-Hut tree\0Fast multipole method\0Particle mesh\0")) {
+                        gravity.solver = GravitySolver(solver);
+                        // a cluster grown for the faster solvers is cut back to what the direct sum can carry
+                        if (gravity.solver == GravitySolver::Direct && scene == SceneKind::Cluster && cluster_size > cluster_direct_limit) {
+                            cluster_size = cluster_direct_limit;
+                            reset_simulation();
+                        }
+                    }
+
+                    if (gravity.solver == GravitySolver::BarnesHut) {
+                        float theta = float(tree.theta);
+                        if (ImGui::SliderFloat("Opening angle", &theta, 0.1f, 1.2f, "%.2f")) tree.theta = theta;
+                        ImGui::Checkbox("Quadrupole moments", &tree.quadrupole);
+                        int leaf_size = int(tree.leaf_size);
+                        if (ImGui::SliderInt("Bodies per leaf", &leaf_size, 1, 64)) tree.leaf_size = uint32_t(leaf_size);
+
+                        ImGui::Text("%zu nodes, %zu levels", tree.node_count, tree.depth);
+                        ImGui::Text("Build %.2f ms, walk %.2f ms", 1000 * tree.build_seconds, 1000 * tree.walk_seconds);
+                        ImGui::Text("%.0f interactions per body", simulation.bodies.size() > 0 ? double(tree.interactions) / simulation.bodies.size() : 0.0);
+                    }
+
+                    if (gravity.solver == GravitySolver::FastMultipole) {
+                        auto& multipole = gravity.multipole;
+                        ImGui::SliderInt("Expansion order", &multipole.order, 1, FastMultipole::max_order);
+                        float theta = float(multipole.theta);
+                        if (ImGui::SliderFloat("Opening angle", &theta, 0.2f, 0.9f, "%.2f")) multipole.theta = theta;
+                        int leaf_size = int(multipole.leaf_size);
+                        if (ImGui::SliderInt("Bodies per leaf", &leaf_size, 1, 256)) multipole.leaf_size = uint32_t(leaf_size);
+
+                        ImGui::Text("%zu cells, %zu levels", multipole.cell_count, multipole.depth);
+                        ImGui::Text("Build %.2f ms, walk %.2f ms", 1000 * multipole.build_seconds, 1000 * multipole.traversal_seconds);
+                        ImGui::Text("M2L %.2f ms, L2L, L2P and near field %.2f ms", 1000 * multipole.m2l_seconds, 1000 * multipole.evaluation_seconds);
+                        ImGui::Text("%llu cell pairs, %.0f direct pairs per body", (unsigned long long)multipole.m2l_count,
+                            simulation.bodies.size() > 0 ? double(multipole.p2p_count) / simulation.bodies.size() : 0.0);
+                    }
+
+                    if (gravity.solver == GravitySolver::ParticleMesh) {
+                        auto& mesh = gravity.mesh;
+                        int resolution = mesh.cells <= 32 ? 0 : mesh.cells <= 64 ? 1 : 2;
+                        if (ImGui::Combo("Mesh", &resolution, "32^3\0" "64^3\0" "128^3\0")) mesh.cells = 32 << resolution;
+
+                        ImGui::Text("Cell size %.3g, padded to %d^3 for isolated boundaries", mesh.cell_size, 2 * mesh.cells);
+                        ImGui::Text("Assign %.2f ms, FFT %.2f ms, interpolate %.2f ms",
+                            1000 * mesh.assign_seconds, 1000 * mesh.fft_seconds, 1000 * mesh.interpolate_seconds);
+                    }
+
+                    if (gravity.solver != GravitySolver::Direct && simulation.mode == SteppingMode::BlockHermite) {
+                        ImGui::Text("Block Hermite sums its own forces and jerks directly");
+                    }
+
+                    ImGui::TreePop();
+                }
+
+                if (simulation.gravity.solver == GravitySolver::Direct && ImGui::TreeNode("Direct summation")) {
+                    auto& direct = simulation.gravity.direct;
+                    int level = int(direct.level);
+                    if (ImGui::Combo("Instruction set", &level, "Scalar\0AVX2\0AVX-512\0")) direct.level = SimdLevel(level);
+                    ImGui::Checkbox("Reciprocal square root with Newton steps", &direct.fast_rsqrt);
+                    ImGui::Checkbox("Vectorized", &simulation.gravity.vectorized);
+
+                    bool used = simulation.gravity.vectorized && !simulation.gravity.reproducible && simulation.bodies.size() >= simulation.gravity.parallel_threshold;
+                    ImGui::Text("%s supported, %s", simdLevelName(DirectSummation::supportedLevel()),
+                        used ? "in use" : "used from the parallel threshold outside reproducible mode");
+                    ImGui::Text("%.3g interactions per second, %.3g per frame", direct_interaction_rate, direct_interactions_per_frame);
+
+                    ImGui::TreePop();
+                }
+
+                if (simulation.mode == SteppingMode::BlockHermite && simulation.hermite.started()) {
+                    auto occupancy = simulation.hermite.levelOccupancy();
+
+                    // a body on level l takes 2^l steps per coarsest step, that is its share of the work
+                    std::vector<float> bodies_per_level(occupancy.begin(), occupancy.end());
+                    std::vector<float> work_per_level(occupancy.size());
+                    for (size_t l = 0; l < occupancy.size(); l++) work_per_level[l] = float(std::ldexp(double(occupancy[l]), int(l)));
+
+                    ImGui::PlotHistogram("Bodies per level", bodies_per_level.data(), int(bodies_per_level.size()), 0, nullptr, 0, FLT_MAX, ImVec2(0, 60));
+                    ImGui::PlotHistogram("Work per level", work_per_level.data(), int(work_per_level.size()), 0, nullptr, 0, FLT_MAX, ImVec2(0, 60));
+                    ImGui::Text("Level 0 step %.3e, finest step %.3e", simulation.hermite.max_dt, std::ldexp(simulation.hermite.max_dt, -int(occupancy.size() - 1)));
+
+                    double block_size = simulation.hermite.block_steps ? double(simulation.hermite.body_steps) / simulation.hermite.block_steps : 0;
+                    ImGui::Text("Blocks %llu, %.1f bodies per block", (unsigned long long)simulation.hermite.block_steps, block_size);
+                }
+
+                if ((scene == SceneKind::EarthMoon || scene == SceneKind::SunEarthMoon) && ImGui::TreeNode("Earth gravity field")) {
+                    ImGui::Checkbox("Spherical harmonics", &use_earth_field);
+                    ImGui::InputText("Coefficient file", earth_field_file, IM_ARRAYSIZE(earth_field_file));
+                    ImGui::SameLine();
+                    if (ImGui::Button("Load")) load_earth_field();
+
+                    ImGui::Text("%s", earth_field_status.c_str());
+                    if (earth_field.degree >= 2) ImGui::SliderInt("Degree", &earth_field_degree, 2, earth_field.degree);
+                    ImGui::Text("Reference radius is the Earth size, rotation follows simulation time");
+
+                    ImGui::TreePop();
+                }
+
+                if (scene == SceneKind::Satellite && ImGui::TreeNode("Near-Earth forces")) {
+                    ImGui::InputDouble("J2", &simulation.zonal.J2, 0, 0, "%.5e");
+                    ImGui::InputDouble("J3", &simulation.zonal.J3, 0, 0, "%.5e");
+
+                    bool sun_gravity = simulation.third_body.sun.mass > 0;
+                    if (ImGui::Checkbox("Sun third-body gravity", &sun_gravity)) simulation.third_body.sun.mass = sun_gravity ? sun_mass : 0;
+
+                    ImGui::InputDouble("Drag Cd A / m, m^2/kg", &simulation.drag.ballistic_coefficient, 0, 0, "%.4f");
+                    float density_scale = float(simulation.drag.density_scale);
+                    if (ImGui::SliderFloat("Density scale", &density_scale, 1, 1e3f, "%.0f", ImGuiSliderFlags_Logarithmic)) simulation.drag.density_scale = density_scale;
+
+                    ImGui::InputDouble("SRP Cr A / m, m^2/kg", &simulation.radiation.area_to_mass, 0, 0, "%.4f");
+                    float pressure_scale = float(simulation.radiation.pressure_scale);
+                    if (ImGui::SliderFloat("Pressure scale", &pressure_scale, 1, 1e6f, "%.0f", ImGuiSliderFlags_Logarithmic)) simulation.radiation.pressure_scale = pressure_scale;
+
+                    size_t satellite_body = simulation.bodyFromReset(2);
+                    if (has_moon && satellite_body != BodyStore::npos) {
+                        glm::dvec3 satellite = simulation.bodies.position(satellite_body);
+                        glm::dvec3 sun = simulation.radiation.sun.position(simulation.stateTime());
+                        double altitude = (glm::length(satellite - simulation.bodies.position(0)) / earth.r - 1) * simulation.drag.radius_km;
+                        double light = sunlightFraction(satellite, sun, simulation.radiation.sun.radius, simulation.bodies.position(0), earth.r)
+                                     * sunlightFraction(satellite, sun, simulation.radiation.sun.radius, simulation.bodies.position(moon_body), moon.r);
+
+                        ImGui::Text("Altitude %.1f km, density %.3e kg/m^3", altitude, AtmosphericDrag::density(altitude) * simulation.drag.density_scale);
+                        ImGui::Text("Sunlit fraction %.3f", light);
+                    }
+                    ImGui::Text("Changes apply from the next step, energy is not conserved with drag");
+
+                    ImGui::TreePop();
+                }
+
+                if (scene != SceneKind::Cluster && ImGui::TreeNode("Rigid-body rotation")) {
+                    bool changed = ImGui::Checkbox("Integrate Earth and Moon spin", &rigid_rotation);
+                    changed |= ImGui::Checkbox("Gravity-gradient torques", &tidal_torque);
+                    changed |= ImGui::SliderFloat("Flattening scale", &flattening_scale, 1, 100, "%.1f", ImGuiSliderFlags_Logarithmic);
+                    if (changed) reset_simulation();
+
+                    const auto& rotation = simulation.rotation;
+                    if (rigid_rotation && rotation.size() == 2) {
+                        glm::dvec3 r = simulation.bodies.position(moon_body) - simulation.bodies.position(0);
+                        glm::dvec3 normal = glm::normalize(glm::cross(r, simulation.bodies.velocity(moon_body) - simulation.bodies.velocity(0)));
+                        glm::dvec3 earth_pole = rotation.axis(earth_spin, glm::dvec3(0, 1, 0));
+                        glm::dvec3 moon_long_axis = rotation.axis(moon_spin, glm::dvec3(1, 0, 0));
+
+                        double obliquity = glm::acos(glm::clamp(glm::dot(earth_pole, normal), -1.0, 1.0));
+                        double azimuth = glm::atan(earth_pole.x, earth_pole.z);
+                        double libration = glm::acos(glm::clamp(glm::dot(moon_long_axis, -glm::normalize(r)), -1.0, 1.0));
+
+                        ImGui::Text("Earth pole %.3f deg from the Moon orbit normal, azimuth %.3f deg", glm::degrees(obliquity), glm::degrees(azimuth));
+                        ImGui::Text("Moon long axis %.3f deg off the Earth direction", glm::degrees(libration));
+                        ImGui::Text("Rotational energy %.6e", rotation.kineticEnergy());
+                    }
+                    ImGui::Text("Spin starts from the Earth rotation speed, the Moon starts locked");
+
+                    ImGui::TreePop();
+                }
+
+                if ((scene == SceneKind::EarthMoon || scene == SceneKind::SunEarthMoon) && ImGui::TreeNode("Patched conics")) {
+                    bool changed = ImGui::Checkbox("Preview craft on patched conics", &patched_preview);
+                    changed |= ImGui::SliderInt("Craft", &patched_craft_count, 1, 20000, "%d", ImGuiSliderFlags_Logarithmic);
+                    changed |= ImGui::SliderFloat("Apoapsis spread", &patched_spread, 0, 0.5f, "%.2f");
+                    if (changed) reset_simulation();
+
+                    if (patched.size() > 0) {
+                        size_t near_moon = 0;
+                        uint64_t handoffs = 0;
+                        for (size_t i = 0; i < patched.size(); i++) {
+                            near_moon += patched.parent[i] == 1;
+                            handoffs += patched.handoffs[i];
+                        }
+                        ImGui::Text("%zu craft in the Moon's sphere of influence, %llu handoffs", near_moon, (unsigned long long)handoffs);
+                        ImGui::Text("Advanced in %.2f ms", patched_advance_seconds * 1e3);
+                        if (simulation.time() - patched.time > patched_max_advance) {
+                            ImGui::Text("Runs %.1f time units behind the simulation", simulation.time() - patched.time);
+                        }
+
+                        ImGui::SliderInt("Selected craft", &patched_selected, 0, int(patched.size()) - 1);
+                        ImGui::SliderFloat("Path ahead", &patched_preview_span, 0.1f, 20, "%.1f", ImGuiSliderFlags_Logarithmic);
+
+                        // the final run: the selected craft and the ones after it integrated with the full force model
+                        ImGui::SliderInt("Craft to integrate", &patched_full_count, 1, 64);
+                        if (ImGui::Button("Run in full from launch")) {
+                            patched_full_run.clear();
+                            for (int j = 0; j < patched_full_count && size_t(patched_selected + j) < patched.size(); j++) patched_full_run.push_back(patched_selected + j);
+                            reset_simulation();
+                        }
+
+                        if (!patched_full_run.empty()) {
+                            double deviation = 0;
+                            for (size_t j = 0; j < patched_full_run.size(); j++) {
+                                size_t body = simulation.bodyFromReset(patched.majorCount() + j);
+                                size_t craft = patched_full_run[j];
+                                if (body == BodyStore::npos || craft >= patched.size()) continue;
+
+                                glm::dvec3 relative = simulation.renderPosition(body) - patched_parent_position(patched.parent[craft]);
+                                deviation = glm::max(deviation, glm::length(relative - patched.relativePosition(craft)));
+                            }
+                            ImGui::Text("%zu integrated, largest deviation from the preview %.3f Earth radii", patched_full_run.size(), deviation / earth.r);
+                            if (ImGui::Button("Back to preview only")) {
+                                patched_full_run.clear();
+                                reset_simulation();
+                            }
+                        }
+                    }
+                    ImGui::Text("Crossings are found on sphere of influence boundaries, orbits in between are Kepler conics");
+
+                    ImGui::TreePop();
+                }
+
+                if (ImGui::TreeNode("Collisions")) {
+                    auto& collisions = simulation.collisions;
+                    ImGui::Checkbox("Detect collisions", &collisions.enabled);
+
+                    int resolution = int(collisions.resolution);
+                    if (ImGui::Combo("Resolution", &resolution, "Merge\0Bounce\0Fragment\0")) collisions.resolution = CollisionResolution(resolution);
+                    if (collisions.resolution == CollisionResolution::Bounce) {
+                        ImGui::InputDouble("Restitution", &collisions.restitution, 0, 0, "%.2f");
+                    }
+                    if (collisions.resolution == CollisionResolution::Fragment) {
+                        ImGui::InputDouble("Fragmenting speed, escape speeds", &collisions.fragment_speed, 0, 0, "%.2f");
+                        ImGui::InputDouble("Ejected mass fraction", &collisions.fragment_mass_fraction, 0, 0, "%.2f");
+                        ImGui::SliderInt("Fragments", &collisions.fragment_count, 2, 64);
+                    }
+
+                    ImGui::Text("%d bodies, %llu contacts, %zu last step", int(simulation.bodies.size()),
+                        (unsigned long long)collisions.total_contacts, collisions.contacts);
+                    ImGui::Text("%zu pair tests, %zu large bodies", collisions.pair_tests, collisions.large_bodies);
+                    if (ImGui::Button("Restore bodies")) reset_simulation();
+
+                    ImGui::TreePop();
+                }
+
+                if (scene != SceneKind::Cluster && has_moon && !secular_mode && ImGui::TreeNode("Events")) {
+                    ImGui::Checkbox("Shadows", &event_finder.shadows);
+                    ImGui::SameLine();
+                    ImGui::Checkbox("Apsides", &event_finder.apsides);
+                    ImGui::SameLine();
+                    ImGui::Checkbox("Nodes", &event_finder.nodes);
+                    ImGui::SameLine();
+                    ImGui::Checkbox("Occultations", &event_finder.occultations);
+                    ImGui::SliderFloat("Span, years", &event_span_years, 0.1f, 1000, "%.1f", ImGuiSliderFlags_Logarithmic);
+
+                    if (ImGui::Button("Scan from current state")) {
+                        // light and viewer as drawn now, the viewer keeps its offset from the camera target
+                        event_finder.primary = 0;
+                        event_finder.secondary = moon_body;
+                        event_finder.primary_radius = earth.r;
+                        event_finder.secondary_radius = moon.r;
+
+                        if (scene == SceneKind::SunEarthMoon && sun_body != BodyStore::npos && sun_body != 0) {
+                            event_finder.light.kind = EventLight::Kind::Body;
+                            event_finder.light.body = sun_body;
+                        } else if (scene == SceneKind::Satellite) {
+                            event_finder.light.kind = EventLight::Kind::Ephemeris;
+                            event_finder.light.ephemeris = simulation.radiation.sun;
+                        } else {
+                            event_finder.light.kind = EventLight::Kind::Direction;
+                            event_finder.light.direction = glm::dvec3(light_source_dir);
+                        }
+
+                        event_finder.viewer_body = target_body;
+                        event_finder.viewer_offset = camera.pos - camera.target;
+
+                        event_timeline = event_finder.scan(simulation, event_span_years * 2 * M_PI * year_in_months);
+                        event_selected = -1;
+                    }
+
+                    if (event_timeline.steps > 0) {
+                        ImGui::Text("%zu events%s in %.3f s, %llu steps, %llu refined", event_timeline.events.size(),
+                            event_timeline.truncated ? " (truncated)" : "", event_timeline.wall_seconds,
+                            (unsigned long long)event_timeline.steps, (unsigned long long)event_timeline.refinements);
+
+                        // days after the scan start, one unit of time is a radian of the Moon's sidereal month
+                        double day = 27.3217 / (2 * M_PI);
+                        auto body_name = [&](size_t body) { return body == 0 ? "Earth" : body == event_finder.secondary ? "Moon" : "?"; };
+
+                        ImGui::BeginChild("Event timeline", ImVec2(0, 200), true);
+                        ImGuiListClipper clipper;
+                        clipper.Begin(int(event_timeline.events.size()));
+                        while (clipper.Step()) {
+                            for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+                                const Event& event = event_timeline.events[i];
+                                char label[128];
+                                snprintf(label, sizeof(label), "%+.9f d  %-18s %s, %s", (event.time - event_timeline.t_start) * day,
+                                    eventKindName(event.kind), body_name(event.body), body_name(event.other));
+                                if (ImGui::Selectable(label, i == event_selected)) event_selected = i;
+                            }
+                        }
+                        ImGui::EndChild();
+
+                        if (event_selected >= 0 && event_selected < int(event_timeline.events.size())) {
+                            const Event& event = event_timeline.events[event_selected];
+                            if (ImGui::Button("Jump to selected event")) simulation.setState(event.state, event.time);
+                        }
+                    }
+                    ImGui::Text("Scans the orbits only, a jump keeps the current spin");
+
+                    ImGui::TreePop();
+                }
+
+                if ((scene == SceneKind::EarthMoon || scene == SceneKind::SunEarthMoon) && ImGui::TreeNode("Secular evolution")) {
+                    if (ImGui::Checkbox("Orbit-averaged Kozai-Lidov", &secular_mode) && secular_mode) {
+                        startSecularEvolution(secular, simulation);
+                    }
+                    ImGui::SliderFloat("Years per second", &secular_years_per_second, 0.1f, 100000.0f, "%.1f", ImGuiSliderFlags_Logarithmic);
+
+                    if (secular_mode) {
+                        double year = 2 * M_PI * year_in_months;
+                        ImGui::Text("Secular time %.1f years, %d steps last frame", secular.time / year, secular_steps_last_frame);
+                        ImGui::Text("Eccentricity %.4f, inclination to the ecliptic %.2f deg", secular.eccentricity(), glm::degrees(secular.inclination()));
+                        ImGui::Text("Kozai-Lidov timescale %.2f years", secular.timescale() / year);
+                        ImGui::Text("Sun orbit plane is the ecliptic, inclinations above 39.2 deg oscillate");
+                    }
+
+                    ImGui::TreePop();
+                }
+            }
+
+            if (ImGui::CollapsingHeader("Conservation")) {
+                int interval = int(monitor.interval);
+                if (ImGui::SliderInt("Sample every N steps", &interval, 1, 4096, "%d", ImGuiSliderFlags_Logarithmic)) monitor.interval = uint64_t(interval);
+                ImGui::InputDouble("Alarm threshold", &monitor.alarm_threshold, 0, 0, "%.1e");
+                ImGui::Checkbox("Pause on alarm", &pause_on_alarm);
+                ImGui::SameLine();
+                ImGui::Checkbox("Paused", &paused);
+
+                // drift on a log10 scale from 1e-16 to 1
+                auto plot_drift = [&](const char* label, double ConservationMonitor::Sample::* quantity, bool conserved) {
+                    std::vector<float> values;
+                    for (const auto& sample : monitor.history) values.push_back(float(std::log10(std::max(sample.*quantity, 1e-16))));
+
+                    char overlay[64] = "";
+                    if (!values.empty()) snprintf(overlay, sizeof(overlay), "%s%.2e", conserved ? "" : "not conserved, ", monitor.history.back().*quantity);
+                    ImGui::PlotLines(label, values.data(), int(values.size()), 0, overlay, -16, 0, ImVec2(0, 60));
+                };
+
+                plot_drift("Energy", &ConservationMonitor::Sample::energy, monitor.conservesEnergy(simulation));
+                plot_drift("Angular momentum", &ConservationMonitor::Sample::angular_momentum, monitor.conservesAngularMomentum(simulation));
+                plot_drift("Eccentricity vector", &ConservationMonitor::Sample::eccentricity, monitor.conservesEccentricity(simulation));
+
+                ImGui::Text("log10 of the drift since the last restart, %zu samples", monitor.history.size());
+                if (monitor.used_virial) ImGui::Text("Potential energy from the virial sum of the cached accelerations");
+
+                if (monitor.alarm && ImGui::Button("Acknowledge and resume")) {
+                    monitor.acknowledge();
+                    paused = false;
+                }
             }
 
             if (ImGui::CollapsingHeader("Earth")) {
                 ImGui::SliderFloat("Earth size", &earth.r, 0.1f, 10.0f);
-                ImGui::SliderFloat("Earth angle", &earth_angle, 0.0f, 360.0f);
+                const double full_turn = 360;
+                const double no_turn = 0;
+                ImGui::SliderScalar("Earth angle", ImGuiDataType_Double, &earth_angle, &no_turn, &full_turn, "%.3f");
                 ImGui::SliderFloat("Earth rotation speed", &earth_rotation_speed, 0.0f, 20.0f * 180.0f);
                 ImGui::Checkbox("Show Earth axis", &show_earth_axis);
             }
 
             if (ImGui::CollapsingHeader("Moon")) {
                 ImGui::SliderFloat("Moon size", &moon.r, 0.1f, 10.0f);
-                ImGui::SliderFloat("Moon angle", &moon_angle, 0.0f, 360.0f);
+                const double full_turn = 360;
+                const double no_turn = 0;
+                ImGui::SliderScalar("Moon angle", ImGuiDataType_Double, &moon_angle, &no_turn, &full_turn, "%.3f");
 
                 ImGui::SliderFloat("Moon rotation speed", &moon_rotation_speed, 0.0f, 20.0f * 180.0f);
                 ImGui::SliderFloat("Moon traverse speed", &moon_orbit_traverse_speed, 0.0f, 5.0f);
 
                 ImGui::Checkbox("Show Moon orbit", &show_orbit);
-                ImGui::SliderFloat("Orbit radius X", &moon_orbit_radius_x, 1.0f, 20.0f);
-                ImGui::SliderFloat("Orbit radius Z", &moon_orbit_radius_z, 1.0f, 20.0f);
-                ImGui::SliderFloat("Orbit pitch", &moon_orbit_pitch, 0.0f, 180.0f);
-                ImGui::SliderFloat("Orbit roll", &moon_orbit_roll, 0.0f, 180.0f);
+                ImGui::SliderFloat("Orbit radius X", &moon_orbit_radius_x, 1.0f, 100.0f, "%.3f", ImGuiSliderFlags_Logarithmic);
+                ImGui::SliderFloat("Orbit radius Z", &moon_orbit_radius_z, 1.0f, 100.0f, "%.3f", ImGuiSliderFlags_Logarithmic);
+                if (ImGui::Button("Real scale")) {
+                    // Moon size and a circular orbit at the real mean distance in Earth radii
+                    moon.r = float(moon_radius_in_earth_radii * earth.r);
+                    moon_orbit_radius_x = moon_orbit_radius_z = float(moon_distance_in_earth_radii * earth.r);
+                }
+                ImGui::SliderFloat("Orbit pitch", &moon_orbit_pitch, -180.0f, 180.0f);
+                ImGui::SliderFloat("Orbit roll", &moon_orbit_roll, -180.0f, 180.0f);
+                ImGui::SliderFloat("Orbit periapsis", &moon_orbit_periapsis, -180.0f, 180.0f);
+                if (ImGui::Button("Restart orbit")) reset_simulation();
 
                 ImGui::Checkbox("Show Moon axis", &show_moon_axis);
                 ImGui::DragFloat3("Moon axis", (float*)&moon_rotation_axis, 0.01f, -1.0f, 1.0f);
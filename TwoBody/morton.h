@@ -0,0 +1,126 @@
+#pragma once
+
+#include "body_store.h"
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// bits 0 .. 20 of v moved to every third bit, 0 .. 60
+inline uint64_t spreadBits21(uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffull;
+    v = (v | v << 16) & 0x1f0000ff0000ffull;
+    v = (v | v << 8) & 0x100f00f00f00f00full;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+    v = (v | v << 2) & 0x1249249249249249ull;
+    return v;
+}
+
+// Z-order key of a cell on the 2^21 grid, x in the lowest bit of every octal digit and the coarsest digit highest
+inline uint64_t mortonKey(uint32_t ix, uint32_t iy, uint32_t iz) {
+    return spreadBits21(ix) | spreadBits21(iy) << 1 | spreadBits21(iz) << 2;
+}
+
+// Axis-aligned cube around every body, split into the 2^21 cells per axis that Morton keys address.
+struct MortonGrid {
+    static constexpr int levels = 21;
+
+    glm::dvec3 low = glm::dvec3(0);
+    double size = 1;
+
+    // bounding cube of the bodies, min and max reduced over blocks in parallel, a little larger so the far faces quantize inside
+    static MortonGrid bounding(const BodyStore& bodies, ThreadPool& pool) {
+        size_t n = bodies.size();
+        size_t block = 4096;
+        size_t blocks = std::max<size_t>(1, (n + block - 1) / block);
+        std::vector<glm::dvec3> low(blocks, glm::dvec3(std::numeric_limits<double>::max()));
+        std::vector<glm::dvec3> high(blocks, glm::dvec3(std::numeric_limits<double>::lowest()));
+
+        pool.parallelFor(0, blocks, [&](size_t b) {
+            for (size_t i = b * block; i < std::min(n, (b + 1) * block); i++) {
+                low[b] = glm::min(low[b], bodies.position(i));
+                high[b] = glm::max(high[b], bodies.position(i));
+            }
+        });
+
+        MortonGrid grid;
+        if (n == 0) return grid;
+
+        glm::dvec3 lo = low[0], hi = high[0];
+        for (size_t b = 1; b < blocks; b++) {
+            lo = glm::min(lo, low[b]);
+            hi = glm::max(hi, high[b]);
+        }
+
+        glm::dvec3 extent = hi - lo;
+        double size = std::max(extent.x, std::max(extent.y, extent.z));
+        if (size <= 0) size = 1;
+
+        grid.size = size * (1 + 1e-9);
+        grid.low = lo - glm::dvec3(size * 0.5e-9);
+        return grid;
+    }
+
+    uint64_t key(glm::dvec3 p) const {
+        const double cells = double(1u << levels);
+        glm::dvec3 q = glm::clamp((p - low) * (cells / size), 0.0, cells - 1);
+        return mortonKey(uint32_t(q.x), uint32_t(q.y), uint32_t(q.z));
+    }
+};
+
+// Stable LSD radix sort of keys with values moved along, 8 bits per pass over the low key_bits bits.
+// Every pass cuts the array into blocks: the blocks count their digits in parallel, a scan in digit then block order
+// gives each block its output offsets and the blocks scatter in parallel. Passes over a digit all keys share are skipped.
+inline void radixSortPairs(std::vector<uint64_t>& keys, std::vector<uint32_t>& values, int key_bits, ThreadPool& pool) {
+    size_t n = keys.size();
+    if (n < 2) return;
+
+    size_t blocks = std::max<size_t>(1, std::min<size_t>(4 * pool.size(), n / 16384));
+    size_t block = (n + blocks - 1) / blocks;
+
+    std::vector<uint64_t> key_buffer(n);
+    std::vector<uint32_t> value_buffer(n);
+    std::vector<size_t> offsets(blocks * 256);
+
+    for (int shift = 0; shift < key_bits; shift += 8) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+
+        pool.parallelFor(0, blocks, [&](size_t b) {
+            size_t* count = offsets.data() + b * 256;
+            for (size_t i = b * block; i < std::min(n, (b + 1) * block); i++) count[(keys[i] >> shift) & 0xff]++;
+        });
+
+        bool shared_digit = false;
+        size_t offset = 0;
+        for (size_t digit = 0; digit < 256; digit++) {
+            size_t total = 0;
+            for (size_t b = 0; b < blocks; b++) {
+                size_t count = offsets[b * 256 + digit];
+                offsets[b * 256 + digit] = offset + total;
+                total += count;
+            }
+            shared_digit |= total == n;
+            offset += total;
+        }
+        if (shared_digit) continue;
+
+        pool.parallelFor(0, blocks, [&](size_t b) {
+            size_t* next = offsets.data() + b * 256;
+            for (size_t i = b * block; i < std::min(n, (b + 1) * block); i++) {
+                size_t& slot = next[(keys[i] >> shift) & 0xff];
+                key_buffer[slot] = keys[i];
+                value_buffer[slot] = values[i];
+                slot++;
+            }
+        });
+
+        std::swap(keys, key_buffer);
+        std::swap(values, value_buffer);
+    }
+}
@@ -0,0 +1,177 @@
+#pragma once
+
+#include "body_store.h"
+#include "morton.h"
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// Octree over the bodies' Morton order, the topology the tree gravity solvers share.
+// Bodies are keyed by their cell on the 2^21 Morton grid of the bounding cube and sorted by a parallel radix sort,
+// so every octree cell is a contiguous range of the sorted bodies and its children are found by binary search on the
+// next octal digit. The tree grows one level at a time with all the level's cells split in parallel and their children
+// appended to one cell pool, siblings side by side, so a solver's per-cell data is a vector indexed like the cells and
+// its upward passes run level by level from level_start.
+class Octree {
+public:
+    struct Cell {
+        glm::dvec3 center;
+        double half_size;
+
+        uint32_t first_body;
+        uint32_t body_count;
+        uint32_t first_child;
+        uint32_t child_count;
+
+        bool leaf() const {
+            return child_count == 0;
+        }
+    };
+
+    MortonGrid grid;
+    std::vector<Cell> cells;
+    // cells of level l are [level_start[l], level_start[l + 1])
+    std::vector<size_t> level_start;
+    // non-empty leaves in Morton order
+    std::vector<uint32_t> leaves;
+
+    // sorted body k is body order[k]
+    std::vector<uint32_t> order;
+    std::vector<double> x, y, z, m;
+
+    size_t depth() const {
+        return level_start.size() - 1;
+    }
+
+    size_t size() const {
+        return order.size();
+    }
+
+    glm::dvec3 position(size_t k) const {
+        return glm::dvec3(x[k], y[k], z[k]);
+    }
+
+    // cells holding more than leaf_size bodies are split, except on the finest level of the grid
+    void build(const BodyStore& bodies, uint32_t leaf_size, ThreadPool& pool) {
+        size_t n = bodies.size();
+        grid = MortonGrid::bounding(bodies, pool);
+
+        keys.resize(n);
+        order.resize(n);
+        pool.parallelFor(0, n, [&](size_t i) {
+            keys[i] = grid.key(bodies.position(i));
+            order[i] = uint32_t(i);
+        }, 4096);
+
+        radixSortPairs(keys, order, 3 * MortonGrid::levels, pool);
+
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+        m.resize(n);
+        pool.parallelFor(0, n, [&](size_t k) {
+            size_t i = order[k];
+            x[k] = bodies.x[i];
+            y[k] = bodies.y[i];
+            z[k] = bodies.z[i];
+            m[k] = bodies.mass[i];
+        }, 4096);
+
+        cells.clear();
+        level_start.assign({0, 1});
+
+        Cell root = {};
+        root.center = grid.low + glm::dvec3(grid.size / 2);
+        root.half_size = grid.size / 2;
+        root.body_count = uint32_t(n);
+        cells.push_back(root);
+
+        for (int level = 0; ; level++) {
+            size_t begin = level_start[level];
+            size_t end = level_start[level + 1];
+            if (begin == end) {
+                level_start.pop_back();
+                break;
+            }
+
+            bool deepest = level == MortonGrid::levels;
+            int shift = 3 * (MortonGrid::levels - 1 - level);
+
+            // octant ranges of a cell, the digit below the cell's prefix never decreases within it
+            auto octants = [&](const Cell& cell, uint32_t* bounds) {
+                const uint64_t* first = keys.data() + cell.first_body;
+                const uint64_t* last = first + cell.body_count;
+                bounds[0] = cell.first_body;
+                for (int o = 1; o < 8; o++) {
+                    bounds[o] = uint32_t(std::partition_point(first, last, [&](uint64_t key) { return int(key >> shift & 7) < o; }) - keys.data());
+                }
+                bounds[8] = cell.first_body + cell.body_count;
+            };
+
+            child_offset.assign(end - begin + 1, 0);
+            pool.parallelFor(begin, end, [&](size_t i) {
+                const Cell& cell = cells[i];
+                if (deepest || cell.body_count <= leaf_size) return;
+
+                uint32_t bounds[9];
+                octants(cell, bounds);
+                size_t children = 0;
+                for (int o = 0; o < 8; o++) children += bounds[o + 1] > bounds[o];
+                child_offset[i - begin + 1] = children;
+            }, 64);
+
+            for (size_t i = 1; i < child_offset.size(); i++) child_offset[i] += child_offset[i - 1];
+            cells.resize(end + child_offset.back());
+
+            pool.parallelFor(begin, end, [&](size_t i) {
+                Cell& cell = cells[i];
+                size_t slot = end + child_offset[i - begin];
+                size_t children = child_offset[i - begin + 1] - child_offset[i - begin];
+                cell.first_child = uint32_t(slot);
+                cell.child_count = uint32_t(children);
+                if (children == 0) return;
+
+                uint32_t bounds[9];
+                octants(cell, bounds);
+                double half = cell.half_size / 2;
+                for (int o = 0; o < 8; o++) {
+                    if (bounds[o + 1] == bounds[o]) continue;
+
+                    Cell child = {};
+                    child.center = cell.center + glm::dvec3((o & 1) ? half : -half, (o & 2) ? half : -half, (o & 4) ? half : -half);
+                    child.half_size = half;
+                    child.first_body = bounds[o];
+                    child.body_count = bounds[o + 1] - bounds[o];
+                    cells[slot++] = child;
+                }
+            }, 64);
+
+            level_start.push_back(cells.size());
+        }
+
+        leaves.clear();
+        for (size_t i = 0; i < cells.size(); i++) {
+            if (cells[i].leaf() && cells[i].body_count > 0) leaves.push_back(uint32_t(i));
+        }
+        std::sort(leaves.begin(), leaves.end(), [&](uint32_t a, uint32_t b) { return cells[a].first_body < cells[b].first_body; });
+    }
+
+    // whether the bodies still have the positions and masses the tree was built from
+    bool holds(const BodyStore& bodies) const {
+        if (order.size() != bodies.size()) return false;
+
+        for (size_t k = 0; k < order.size(); k++) {
+            size_t i = order[k];
+            if (bodies.x[i] != x[k] || bodies.y[i] != y[k] || bodies.z[i] != z[k] || bodies.mass[i] != m[k]) return false;
+        }
+        return true;
+    }
+
+private:
+    std::vector<uint64_t> keys;
+    std::vector<size_t> child_offset;
+};
@@ -0,0 +1,167 @@
+#pragma once
+
+#include "body_store.h"
+#include "simulation.h"
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <vector>
+
+// Parareal time-parallel integration (Lions, Maday & Turinici 2001).
+// The span is cut into slices. A cheap coarse propagator G sweeps them serially while the accurate
+// fine propagator F runs on all slices concurrently; the correction
+//     U[n+1] = G(U[n]) + F(U_old[n]) - G(U_old[n])
+// converges to the serial fine solution, exactly so after at most one iteration per slice.
+// Propagators are callables (BodyStore& state, double t_start, double t_end).
+
+struct PararealReport {
+    int slices = 0;
+    int iterations = 0;
+    bool converged = false;
+
+    double wall_seconds = 0;
+    // sum of the per-slice fine times of one sweep, what a serial fine run would have cost
+    double serial_fine_seconds = 0;
+    double speedup = 0;
+
+    double last_update = 0;
+};
+
+// largest change of any position or velocity component, relative to the largest component of b
+inline double maxStateDifference(const BodyStore& a, const BodyStore& b) {
+    double difference = 0;
+    double scale = 0;
+
+    const std::vector<double> BodyStore::* components[] = {
+        &BodyStore::x, &BodyStore::y, &BodyStore::z, &BodyStore::vx, &BodyStore::vy, &BodyStore::vz
+    };
+
+    for (auto component : components) {
+        for (size_t i = 0; i < a.size(); i++) {
+            difference = std::max(difference, std::abs((a.*component)[i] - (b.*component)[i]));
+            scale = std::max(scale, std::abs((b.*component)[i]));
+        }
+    }
+
+    return scale > 0 ? difference / scale : difference;
+}
+
+// out = coarse_new + fine - coarse_old, component-wise on positions and velocities
+inline void pararealCorrection(BodyStore& out, const BodyStore& coarse_new, const BodyStore& fine, const BodyStore& coarse_old) {
+    out = coarse_new;
+
+    std::vector<double> BodyStore::* components[] = {
+        &BodyStore::x, &BodyStore::y, &BodyStore::z, &BodyStore::vx, &BodyStore::vy, &BodyStore::vz
+    };
+
+    for (auto component : components) {
+        for (size_t i = 0; i < out.size(); i++) {
+            (out.*component)[i] += (fine.*component)[i] - (coarse_old.*component)[i];
+        }
+    }
+
+    out.accelerations_valid = false;
+}
+
+template<class Coarse, class Fine>
+PararealReport parareal(BodyStore& state, double t_start, double t_end, int slices,
+                        const Coarse& coarse, const Fine& fine,
+                        double tolerance, int max_iterations, ThreadPool& pool)
+{
+    using Clock = std::chrono::steady_clock;
+    auto wall_start = Clock::now();
+
+    PararealReport report;
+    report.slices = slices;
+
+    auto slice_time = [&](int n) {
+        return t_start + (t_end - t_start) * double(n) / slices;
+    };
+
+    std::vector<BodyStore> u(slices + 1, state);
+    std::vector<BodyStore> coarse_old(slices, state);
+    std::vector<BodyStore> fine_result(slices, state);
+    std::vector<double> fine_seconds(slices, 0.0);
+
+    // initial serial coarse sweep
+    for (int n = 0; n < slices; n++) {
+        coarse_old[n] = u[n];
+        coarse(coarse_old[n], slice_time(n), slice_time(n + 1));
+        u[n + 1] = coarse_old[n];
+    }
+
+    for (int k = 0; k < std::min(max_iterations, slices); k++) {
+        // slices before k already hold the fine solution, only the rest need work
+        pool.parallelFor(size_t(k), size_t(slices), [&](size_t n) {
+            auto slice_start = Clock::now();
+
+            fine_result[n] = u[n];
+            fine(fine_result[n], slice_time(int(n)), slice_time(int(n) + 1));
+
+            fine_seconds[n] = std::chrono::duration<double>(Clock::now() - slice_start).count();
+        });
+
+        if (k == 0) {
+            for (double seconds : fine_seconds) report.serial_fine_seconds += seconds;
+        }
+
+        // serial correction sweep
+        double update = 0;
+        u[k + 1] = fine_result[k];
+        for (int n = k + 1; n < slices; n++) {
+            BodyStore coarse_new = u[n];
+            coarse(coarse_new, slice_time(n), slice_time(n + 1));
+
+            BodyStore corrected;
+            pararealCorrection(corrected, coarse_new, fine_result[n], coarse_old[n]);
+
+            update = std::max(update, maxStateDifference(corrected, u[n + 1]));
+
+            coarse_old[n] = coarse_new;
+            u[n + 1] = corrected;
+        }
+
+        report.iterations = k + 1;
+        report.last_update = update;
+
+        if (update <= tolerance) {
+            report.converged = true;
+            break;
+        }
+    }
+
+    state = u[slices];
+
+    report.wall_seconds = std::chrono::duration<double>(Clock::now() - wall_start).count();
+    report.speedup = report.wall_seconds > 0 ? report.serial_fine_seconds / report.wall_seconds : 0;
+
+    return report;
+}
+
+// Propagator running a private copy of the simulation's stepping configuration and forces with step dt.
+// Every call works on its own Simulation, so one propagator can serve many slices concurrently.
+class SimulationPropagator {
+public:
+    SimulationPropagator(const Simulation& prototype, double dt) : settings(prototype) {
+        settings.fixed_dt = dt;
+        // the corrected state is the orbit, spins would be carried along without being corrected
+        settings.rotation.clear();
+        // merges and fragments would change the body count within a slice, the correction needs it fixed
+        settings.collisions.enabled = false;
+    }
+
+    void operator()(BodyStore& state, double t_start, double t_end) const {
+        Simulation simulation = settings;
+
+        simulation.bodies = state;
+        simulation.reset(t_start);
+        simulation.propagateTo(t_end);
+
+        state = simulation.bodies;
+    }
+
+private:
+    Simulation settings;
+};
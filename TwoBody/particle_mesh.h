@@ -0,0 +1,236 @@
+#pragma once
+
+#include "body_store.h"
+#include "fft.h"
+#include "morton.h"
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <cstdint>
+#include <vector>
+
+// Particle-mesh gravity (Hockney & Eastwood 1988), O(N + M^3 log M) per evaluation for an M^3 mesh.
+// Mass is assigned cloud-in-cell onto a mesh over the bodies' bounding cube, the potential is the mesh convolved with
+// the Green's function -1/r through the in-tree real FFT, and accelerations are four-point differences of the potential
+// interpolated back with the same cloud-in-cell weights, which keeps the pair forces symmetric. The mesh is zero-padded
+// to twice its size so the circular convolution gives isolated boundaries, and the bodies keep two points from its
+// faces for the difference stencil. Forces are smoothed over about a cell: the Green's function is softened by the
+// larger of the softening and half a cell, so this suits smooth collisionless systems rather than close encounters.
+// The scatter needs no atomics: bodies are sorted by the z plane below them and touch only that plane and the next,
+// so all even planes deposit in parallel, then all odd ones, in a fixed order.
+class ParticleMesh {
+public:
+    // mesh points per axis, a power of two
+    int cells = 64;
+
+    // last evaluation
+    double cell_size = 0;
+    double assign_seconds = 0;
+    double fft_seconds = 0;
+    double interpolate_seconds = 0;
+
+    // adds G times the acceleration of every body to ax, ay, az
+    void accumulate(const BodyStore& bodies, double G, double softening, double* ax, double* ay, double* az, ThreadPool& pool) {
+        evaluate(bodies, softening, pool);
+
+        pool.parallelFor(0, bodies.size(), [&](size_t i) {
+            ax[i] += G * qx[i];
+            ay[i] += G * qy[i];
+            az[i] += G * qz[i];
+        }, 4096);
+    }
+
+    // the mesh potential at every body without its own cloud, taken from the last accumulate when nothing moved since
+    double potentialEnergy(const BodyStore& bodies, double G, double softening, ThreadPool& pool) {
+        if (!cacheMatches(bodies, softening)) evaluate(bodies, softening, pool);
+
+        double energy = 0;
+        for (size_t i = 0; i < bodies.size(); i++) energy += bodies.mass[i] * potential[i];
+        return 0.5 * G * energy;
+    }
+
+private:
+    RealFft3d fft;
+    // mass per mesh point, then the potential in cell units
+    std::vector<double> mesh;
+    std::vector<std::complex<double>> spectrum;
+    // transform of the Green's function in cell units, real as the function is even
+    std::vector<double> green;
+    size_t green_extent = 0;
+    double green_softening = -1;
+
+    // bodies sorted by their lowest z plane, those of plane s in [plane_start[s], plane_start[s + 1])
+    std::vector<uint64_t> planes;
+    std::vector<uint32_t> order;
+    std::vector<size_t> plane_start;
+
+    glm::dvec3 origin = glm::dvec3(0);
+    // results per body, without G
+    std::vector<double> qx, qy, qz, potential;
+
+    // what the results were computed for
+    std::vector<double> cached_x, cached_y, cached_z, cached_mass;
+    double cached_softening = 0;
+    int cached_cells = 0;
+
+    bool cacheMatches(const BodyStore& bodies, double softening) const {
+        return cached_softening == softening && cached_cells == cells && cached_x == bodies.x && cached_y == bodies.y &&
+            cached_z == bodies.z && cached_mass == bodies.mass && qx.size() == bodies.size();
+    }
+
+    size_t meshExtent() const {
+        size_t m = 16;
+        while (m < size_t(std::clamp(cells, 16, 128))) m *= 2;
+        return m;
+    }
+
+    // mesh coordinates of a body, the lowest of the eight points around it and its offset from that point
+    void locate(glm::dvec3 p, size_t m, glm::ivec3& low, glm::dvec3& fraction) const {
+        glm::dvec3 u = (p - origin) / cell_size;
+        low = glm::clamp(glm::ivec3(glm::floor(u)), glm::ivec3(2), glm::ivec3(int(m) - 4));
+        fraction = glm::clamp(u - glm::dvec3(low), 0.0, 1.0);
+    }
+
+    void evaluate(const BodyStore& bodies, double softening, ThreadPool& pool) {
+        using Clock = std::chrono::steady_clock;
+        Clock::time_point start = Clock::now();
+
+        size_t n = bodies.size();
+        size_t m = meshExtent();
+        size_t extent = 2 * m;
+        fft.prepare(extent);
+
+        // the bodies span points 2 .. m - 3
+        MortonGrid bounds = MortonGrid::bounding(bodies, pool);
+        cell_size = bounds.size / double(m - 5);
+        origin = bounds.low - glm::dvec3(2 * cell_size);
+
+        planes.resize(n);
+        order.resize(n);
+        pool.parallelFor(0, n, [&](size_t i) {
+            glm::ivec3 low;
+            glm::dvec3 fraction;
+            locate(bodies.position(i), m, low, fraction);
+            planes[i] = uint64_t(low.z);
+            order[i] = uint32_t(i);
+        }, 4096);
+        radixSortPairs(planes, order, 16, pool);
+
+        plane_start.assign(m + 1, n);
+        for (size_t k = n; k-- > 0;) plane_start[planes[k]] = k;
+        for (size_t s = m; s-- > 0;) plane_start[s] = std::min(plane_start[s], plane_start[s + 1]);
+
+        mesh.assign(extent * extent * extent, 0.0);
+        for (size_t parity = 0; parity < 2; parity++) {
+            pool.parallelFor(0, m / 2, [&](size_t pair) {
+                size_t s = 2 * pair + parity;
+                for (size_t k = plane_start[s]; k < plane_start[s + 1]; k++) {
+                    size_t i = order[k];
+                    glm::ivec3 low;
+                    glm::dvec3 f;
+                    locate(bodies.position(i), m, low, f);
+
+                    double mass = bodies.mass[i];
+                    for (int c = 0; c < 8; c++) {
+                        int dx = c & 1, dy = (c >> 1) & 1, dz = (c >> 2) & 1;
+                        double w = (dx ? f.x : 1 - f.x) * (dy ? f.y : 1 - f.y) * (dz ? f.z : 1 - f.z);
+                        mesh[((low.z + dz) * extent + low.y + dy) * extent + low.x + dx] += mass * w;
+                    }
+                }
+            });
+        }
+        Clock::time_point assigned = Clock::now();
+
+        double soft = std::max(softening / cell_size, 0.5);
+        prepareGreen(extent, soft, pool);
+
+        fft.forward(mesh, spectrum, pool, m);
+        pool.parallelFor(0, spectrum.size(), [&](size_t k) { spectrum[k] *= green[k]; }, 4096);
+        fft.inverse(spectrum, mesh, pool, m);
+        Clock::time_point transformed = Clock::now();
+
+        // the potential of a body's own cloud at itself, from the Green's function between the eight points, which
+        // lie as far apart as the bits in which their corner numbers differ
+        double own[8];
+        for (int c = 0; c < 8; c++) own[c] = -1 / std::sqrt(double((c & 1) + ((c >> 1) & 1) + ((c >> 2) & 1)) + soft * soft);
+
+        qx.resize(n);
+        qy.resize(n);
+        qz.resize(n);
+        potential.resize(n);
+        double inv_h = 1 / cell_size;
+        pool.parallelFor(0, n, [&](size_t i) {
+            glm::ivec3 low;
+            glm::dvec3 f;
+            locate(bodies.position(i), m, low, f);
+
+            auto at = [&](int x, int y, int z) { return mesh[(size_t(z) * extent + size_t(y)) * extent + size_t(x)]; };
+
+            double w[8];
+            glm::dvec3 gradient(0);
+            double phi = 0;
+            for (int c = 0; c < 8; c++) {
+                int x = low.x + (c & 1), y = low.y + ((c >> 1) & 1), z = low.z + ((c >> 2) & 1);
+                w[c] = ((c & 1) ? f.x : 1 - f.x) * (((c >> 1) & 1) ? f.y : 1 - f.y) * (((c >> 2) & 1) ? f.z : 1 - f.z);
+
+                phi += w[c] * at(x, y, z);
+                gradient.x += w[c] * (8 * (at(x + 1, y, z) - at(x - 1, y, z)) - (at(x + 2, y, z) - at(x - 2, y, z)));
+                gradient.y += w[c] * (8 * (at(x, y + 1, z) - at(x, y - 1, z)) - (at(x, y + 2, z) - at(x, y - 2, z)));
+                gradient.z += w[c] * (8 * (at(x, y, z + 1) - at(x, y, z - 1)) - (at(x, y, z + 2) - at(x, y, z - 2)));
+            }
+
+            double self = 0;
+            for (int a = 0; a < 8; a++) {
+                for (int b = 0; b < 8; b++) self += w[a] * w[b] * own[a ^ b];
+            }
+
+            // the potential is in cell units, the differences span 12 cells
+            glm::dvec3 acceleration = -gradient * (inv_h * inv_h / 12);
+            qx[i] = acceleration.x;
+            qy[i] = acceleration.y;
+            qz[i] = acceleration.z;
+            potential[i] = (phi - bodies.mass[i] * self) * inv_h;
+        }, 1024);
+
+        assign_seconds = std::chrono::duration<double>(assigned - start).count();
+        fft_seconds = std::chrono::duration<double>(transformed - assigned).count();
+        interpolate_seconds = std::chrono::duration<double>(Clock::now() - transformed).count();
+
+        cached_x = bodies.x;
+        cached_y = bodies.y;
+        cached_z = bodies.z;
+        cached_mass = bodies.mass;
+        cached_softening = softening;
+        cached_cells = cells;
+    }
+
+    // -1 / sqrt(d^2 + soft^2) at the periodic distance d of every padded mesh point, transformed once per mesh and
+    // softening in cells
+    void prepareGreen(size_t extent, double soft, ThreadPool& pool) {
+        if (green_extent == extent && green_softening == soft) return;
+        green_extent = extent;
+        green_softening = soft;
+
+        std::vector<double> kernel(extent * extent * extent);
+        pool.parallelFor(0, extent, [&](size_t z) {
+            double dz = double(std::min(z, extent - z));
+            for (size_t y = 0; y < extent; y++) {
+                double dy = double(std::min(y, extent - y));
+                for (size_t x = 0; x < extent; x++) {
+                    double dx = double(std::min(x, extent - x));
+                    kernel[(z * extent + y) * extent + x] = -1 / std::sqrt(dx * dx + dy * dy + dz * dz + soft * soft);
+                }
+            }
+        });
+
+        std::vector<std::complex<double>> transformed;
+        fft.forward(kernel, transformed, pool);
+        green.resize(transformed.size());
+        for (size_t k = 0; k < transformed.size(); k++) green[k] = transformed[k].real();
+    }
+};
@@ -0,0 +1,336 @@
+#pragma once
+
+#include "body_store.h"
+#include "kepler.h"
+#include "root_finding.h"
+#include "thread_pool.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Patched-conic approximation for previewing many massless craft. The major bodies form a tree, each moving on
+// a fixed Kepler orbit around its parent, and the root in uniform motion. A craft moves on a Kepler orbit around
+// the innermost major whose sphere of influence, a (m / M)^(2/5) after Laplace, contains it. When it crosses a
+// sphere boundary its state is carried over unchanged to the new parent's frame.
+// Crossings are bracketed by steps the boundary distance cannot close within, the fastest the craft and the
+// major can approach being their periapsis speeds, and then located by Brent's method. A craft whose conic never
+// reaches a boundary takes a single Kepler solve however long the span, so low orbits cost nothing extra.
+class PatchedConics {
+public:
+    double G = 1;
+    // crossing times are located to this accuracy
+    double tolerance = 1e-10;
+    double time = 0;
+
+    // major bodies, the bodies of a store at the same indices
+    std::vector<size_t> major_parent;
+    std::vector<double> major_mass;
+    std::vector<double> soi;
+
+    // craft, struct-of-arrays, states relative to their parent at time
+    std::vector<size_t> parent;
+    std::vector<double> x, y, z;
+    std::vector<double> vx, vy, vz;
+    std::vector<uint32_t> handoffs;
+
+    size_t majorCount() const {
+        return major_mass.size();
+    }
+
+    size_t size() const {
+        return parent.size();
+    }
+
+    // parents[i] is the major body i orbits, BodyStore::npos for the root, which there must be exactly one of.
+    // Orbits are fixed from the state of the store at t0, craft are removed.
+    void setMajors(const BodyStore& bodies, const std::vector<size_t>& parents, double gravity_G, double t0) {
+        G = gravity_G;
+        time = t0;
+        epoch = t0;
+
+        size_t n = bodies.size();
+        major_parent = parents;
+        major_mass = bodies.mass;
+        soi.assign(n, std::numeric_limits<double>::infinity());
+        children.assign(n, {});
+        relative_r0.assign(n, glm::dvec3(0));
+        relative_v0.assign(n, glm::dvec3(0));
+        conics.assign(n, Conic());
+
+        for (size_t k = 0; k < n; k++) {
+            if (parents[k] == BodyStore::npos) {
+                root = k;
+                relative_r0[k] = bodies.position(k);
+                relative_v0[k] = bodies.velocity(k);
+                continue;
+            }
+
+            size_t p = parents[k];
+            children[p].push_back(k);
+            relative_r0[k] = bodies.position(k) - bodies.position(p);
+            relative_v0[k] = bodies.velocity(k) - bodies.velocity(p);
+
+            double mu = G * (bodies.mass[p] + bodies.mass[k]);
+            conics[k] = conic(relative_r0[k], relative_v0[k], mu);
+
+            double r = glm::length(relative_r0[k]);
+            double alpha = 2 / r - glm::dot(relative_v0[k], relative_v0[k]) / mu;
+            double a = alpha > 0 ? 1 / alpha : r;
+            soi[k] = a * std::pow(bodies.mass[k] / bodies.mass[p], 0.4);
+        }
+
+        // parents before children, so absolute states can be built in one pass
+        order.clear();
+        order.push_back(root);
+        for (size_t i = 0; i < order.size(); i++) {
+            for (size_t k : children[order[i]]) order.push_back(k);
+        }
+
+        clearCraft();
+    }
+
+    void clearCraft() {
+        parent.clear();
+        x.clear(); y.clear(); z.clear();
+        vx.clear(); vy.clear(); vz.clear();
+        handoffs.clear();
+    }
+
+    // absolute positions and velocities of all majors at t
+    void majorStates(double t, std::vector<glm::dvec3>& positions, std::vector<glm::dvec3>& velocities) const {
+        positions.resize(majorCount());
+        velocities.resize(majorCount());
+
+        for (size_t k : order) {
+            if (k == root) {
+                positions[k] = relative_r0[k] + relative_v0[k] * (t - epoch);
+                velocities[k] = relative_v0[k];
+                continue;
+            }
+
+            KeplerState relative = majorRelative(k, t);
+            positions[k] = positions[major_parent[k]] + relative.position;
+            velocities[k] = velocities[major_parent[k]] + relative.velocity;
+        }
+    }
+
+    glm::dvec3 majorPosition(size_t k, double t) const {
+        glm::dvec3 position = relative_r0[root] + relative_v0[root] * (t - epoch);
+        for (; k != root; k = major_parent[k]) position += majorRelative(k, t).position;
+        return position;
+    }
+
+    // innermost major whose sphere of influence contains the absolute position at t
+    size_t innermost(const glm::dvec3& position, double t) const {
+        std::vector<glm::dvec3> positions, velocities;
+        majorStates(t, positions, velocities);
+
+        size_t k = root;
+        for (bool descended = true; descended;) {
+            descended = false;
+            for (size_t child : children[k]) {
+                if (glm::length(position - positions[child]) < soi[child]) {
+                    k = child;
+                    descended = true;
+                    break;
+                }
+            }
+        }
+        return k;
+    }
+
+    // craft from an absolute state at the current time
+    size_t addCraft(const glm::dvec3& position, const glm::dvec3& velocity) {
+        std::vector<glm::dvec3> positions, velocities;
+        majorStates(time, positions, velocities);
+
+        size_t p = innermost(position, time);
+        glm::dvec3 r = position - positions[p];
+        glm::dvec3 v = velocity - velocities[p];
+
+        parent.push_back(p);
+        x.push_back(r.x); y.push_back(r.y); z.push_back(r.z);
+        vx.push_back(v.x); vy.push_back(v.y); vz.push_back(v.z);
+        handoffs.push_back(0);
+
+        return size() - 1;
+    }
+
+    glm::dvec3 relativePosition(size_t i) const {
+        return glm::dvec3(x[i], y[i], z[i]);
+    }
+
+    glm::dvec3 relativeVelocity(size_t i) const {
+        return glm::dvec3(vx[i], vy[i], vz[i]);
+    }
+
+    glm::dvec3 position(size_t i) const {
+        return majorPosition(parent[i], time) + relativePosition(i);
+    }
+
+    // moves every craft to t_end, craft are independent and spread over the pool
+    void advance(double t_end) {
+        if (t_end <= time) return;
+
+        ThreadPool::global().parallelFor(0, size(), [&](size_t i) {
+            Craft craft{parent[i], relativePosition(i), relativeVelocity(i), 0};
+            advanceCraft(craft, time, t_end);
+
+            parent[i] = craft.parent;
+            x[i] = craft.r.x; y[i] = craft.r.y; z[i] = craft.r.z;
+            vx[i] = craft.v.x; vy[i] = craft.v.y; vz[i] = craft.v.z;
+            handoffs[i] += craft.handoffs;
+        }, 16);
+
+        time = t_end;
+    }
+
+    // absolute positions of craft i over the next duration, for drawing its trajectory
+    std::vector<glm::dvec3> previewPath(size_t i, double duration, int samples) const {
+        Craft craft{parent[i], relativePosition(i), relativeVelocity(i), 0};
+        std::vector<glm::dvec3> path;
+        path.reserve(samples + 1);
+
+        double t = time;
+        path.push_back(position(i));
+        for (int s = 1; s <= samples; s++) {
+            double t_next = time + duration * s / samples;
+            advanceCraft(craft, t, t_next);
+            t = t_next;
+
+            path.push_back(majorPosition(craft.parent, t) + craft.r);
+        }
+        return path;
+    }
+
+private:
+    struct Craft {
+        size_t parent;
+        glm::dvec3 r, v;
+        uint32_t handoffs;
+    };
+
+    // radial range of a conic and the fastest it is travelled, at periapsis
+    struct Conic {
+        double periapsis = 0;
+        double apoapsis = 0;
+        double max_speed = 0;
+    };
+
+    double epoch = 0;
+    size_t root = 0;
+    std::vector<std::vector<size_t>> children;
+    std::vector<size_t> order;
+    std::vector<glm::dvec3> relative_r0, relative_v0;
+    std::vector<Conic> conics;
+
+    static Conic conic(const glm::dvec3& r, const glm::dvec3& v, double mu) {
+        double r_length = glm::length(r);
+        double h = std::max(glm::length(glm::cross(r, v)), 1e-12 * r_length * glm::length(v));
+        double energy = glm::dot(v, v) / 2 - mu / r_length;
+        double e = std::sqrt(std::max(0.0, 1 + 2 * energy * h * h / (mu * mu)));
+
+        Conic result;
+        result.periapsis = h * h / (mu * (1 + e));
+        result.apoapsis = e < 1 ? h * h / (mu * (1 - e)) : std::numeric_limits<double>::infinity();
+        result.max_speed = std::max(h / result.periapsis, glm::length(v));
+        return result;
+    }
+
+    double parentMu(size_t p) const {
+        return G * major_mass[p];
+    }
+
+    KeplerState majorRelative(size_t k, double t) const {
+        double mu = G * (major_mass[major_parent[k]] + major_mass[k]);
+        return propagateKepler(relative_r0[k], relative_v0[k], mu, t - epoch);
+    }
+
+    KeplerState propagate(const Craft& craft, double dt) const {
+        if (dt == 0) return {craft.r, craft.v};
+        return propagateKepler(craft.r, craft.v, parentMu(craft.parent), dt);
+    }
+
+    // signed distance to the boundary of event e, negative once crossed: e == craft.parent is leaving it,
+    // any other e is entering that child
+    double boundaryGap(const Craft& craft, size_t e, const KeplerState& state, double t) const {
+        if (e == craft.parent) return soi[e] - glm::length(state.position);
+        return glm::length(state.position - majorRelative(e, t).position) - soi[e];
+    }
+
+    void advanceCraft(Craft& craft, double t, double t_end) const {
+        std::vector<size_t> events;
+
+        while (t < t_end) {
+            // boundaries the conic can reach at all, with the largest step that cannot cross any of them
+            Conic path = conic(craft.r, craft.v, parentMu(craft.parent));
+            double step = t_end - t;
+            events.clear();
+
+            if (craft.parent != root && path.apoapsis > soi[craft.parent]) {
+                events.push_back(craft.parent);
+                double gap = soi[craft.parent] - glm::length(craft.r);
+                step = std::min(step, 0.5 * gap / path.max_speed);
+            }
+            for (size_t k : children[craft.parent]) {
+                const Conic& orbit = conics[k];
+                if (path.periapsis > orbit.apoapsis + soi[k] || path.apoapsis < orbit.periapsis - soi[k]) continue;
+
+                events.push_back(k);
+                double gap = glm::length(craft.r - majorRelative(k, t).position) - soi[k];
+                step = std::min(step, 0.5 * gap / (path.max_speed + orbit.max_speed));
+            }
+            step = std::min(std::max(step, 4 * tolerance), t_end - t);
+
+            KeplerState next = propagate(craft, step);
+
+            // the earliest crossing within the step, if any
+            double crossing = t + step;
+            size_t crossed = BodyStore::npos;
+            for (size_t e : events) {
+                double gap_after = boundaryGap(craft, e, next, t + step);
+                if (gap_after >= 0) continue;
+
+                auto gap = [&](double s) {
+                    return boundaryGap(craft, e, propagate(craft, s - t), s);
+                };
+                double gap_before = gap(t);
+                double s = gap_before > 0 ? brentRoot(gap, t, t + step, gap_before, gap_after, tolerance) : t;
+
+                // past the root, so the craft is on the new side when handed over
+                s = std::min(s + tolerance, t + step);
+                if (s < crossing || crossed == BodyStore::npos) {
+                    crossing = s;
+                    crossed = e;
+                }
+            }
+
+            if (crossed == BodyStore::npos) {
+                craft.r = next.position;
+                craft.v = next.velocity;
+                t += step;
+                continue;
+            }
+
+            KeplerState state = propagate(craft, crossing - t);
+            if (crossed == craft.parent) {
+                KeplerState frame = majorRelative(crossed, crossing);
+                craft.parent = major_parent[crossed];
+                craft.r = state.position + frame.position;
+                craft.v = state.velocity + frame.velocity;
+            } else {
+                KeplerState frame = majorRelative(crossed, crossing);
+                craft.parent = crossed;
+                craft.r = state.position - frame.position;
+                craft.v = state.velocity - frame.velocity;
+            }
+            craft.handoffs++;
+            t = crossing;
+        }
+    }
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "simulation.h"
+#include "thread_pool.h"
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+struct ReproducibilityRun {
+    unsigned threads = 0;
+    uint64_t hash = 0;
+    double seconds = 0;
+};
+
+struct ReproducibilityReport {
+    std::vector<ReproducibilityRun> runs;
+    bool identical = false;
+};
+
+// Runs copies of the simulation from its current state for steps fixed steps, each on a private pool
+// with one of the thread counts, and hashes the final states. Listing a count twice repeats the run,
+// which catches anything that differs between restarts. With gravity.reproducible set all hashes must match,
+// without it the parallel gravity of large systems will usually make them differ.
+inline ReproducibilityReport reproducibilityCheck(const Simulation& simulation, uint64_t steps, const std::vector<unsigned>& thread_counts) {
+    using Clock = std::chrono::steady_clock;
+
+    ReproducibilityReport report;
+    double t_start = simulation.stateTime();
+    double t_end = t_start + double(steps) * simulation.fixed_dt;
+
+    for (unsigned threads : thread_counts) {
+        ThreadPool pool(threads);
+
+        Simulation run = simulation;
+        run.gravity.pool = &pool;
+        run.setState(simulation.bodies, t_start);
+
+        auto start = Clock::now();
+        run.propagateTo(t_end);
+
+        ReproducibilityRun result;
+        result.threads = pool.size();
+        result.hash = run.bodies.stateHash();
+        result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        report.runs.push_back(result);
+    }
+
+    report.identical = true;
+    for (const auto& run : report.runs) report.identical &= run.hash == report.runs.front().hash;
+
+    return report;
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include "body_store.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include <array>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+// Attitude and spin of selected bodies treated as rigid bodies, struct-of-arrays like BodyStore.
+// Each entry refers to a body of the store, its attitude is a unit quaternion from the principal axis frame
+// to the world and its spin the angular momentum in the principal frame, the inertia tensor being diagonal there.
+// The torque-free motion uses the splitting of Dullweber, Leimkuhler & McLachlan 1997: the kinetic energy
+// sum L_k^2 / (2 I_k) is split by axis and each part is an exact rotation about that axis, composed as
+//     X(h/2) Z(h/2) Y(h) Z(h/2) X(h/2)
+// which is symplectic, time reversible and keeps |L| and the quaternion norm to rounding. Y is the pole of the
+// drawn spheres and is given the full step, for a spinning planet that is the fast axis.
+// Gravity-gradient torques of all other bodies, taken as point masses, are applied as kicks around it.
+// The orbit is not affected back, the spin is driven by it only.
+class RigidRotation {
+public:
+    std::vector<size_t> body;
+
+    std::vector<double> qw, qx, qy, qz;
+    std::vector<double> lx, ly, lz;
+    std::vector<double> moment_x, moment_y, moment_z;
+
+    bool tidal_torque = true;
+
+    size_t size() const {
+        return body.size();
+    }
+
+    bool empty() const {
+        return body.empty();
+    }
+
+    void clear() {
+        body.clear();
+        qw.clear(); qx.clear(); qy.clear(); qz.clear();
+        lx.clear(); ly.clear(); lz.clear();
+        moment_x.clear(); moment_y.clear(); moment_z.clear();
+    }
+
+    // moments are the principal moments of inertia, the angular velocity is given in the world frame
+    size_t addBody(size_t index, glm::dvec3 moments, glm::dquat orientation, glm::dvec3 angular_velocity) {
+        orientation = glm::normalize(orientation);
+        glm::dvec3 spin = moments * (glm::conjugate(orientation) * angular_velocity);
+
+        body.push_back(index);
+        qw.push_back(orientation.w); qx.push_back(orientation.x); qy.push_back(orientation.y); qz.push_back(orientation.z);
+        lx.push_back(spin.x); ly.push_back(spin.y); lz.push_back(spin.z);
+        moment_x.push_back(moments.x); moment_y.push_back(moments.y); moment_z.push_back(moments.z);
+
+        return body.size() - 1;
+    }
+
+    // follows BodyStore::removeBodies, entries of removed bodies are dropped
+    void remap(const std::vector<size_t>& new_index) {
+        size_t kept = 0;
+
+        for (size_t k = 0; k < size(); k++) {
+            if (new_index[body[k]] == BodyStore::npos) continue;
+
+            body[kept] = new_index[body[k]];
+            for (std::vector<double>* component : {&qw, &qx, &qy, &qz, &lx, &ly, &lz, &moment_x, &moment_y, &moment_z}) {
+                (*component)[kept] = (*component)[k];
+            }
+            kept++;
+        }
+
+        body.resize(kept);
+        for (std::vector<double>* component : {&qw, &qx, &qy, &qz, &lx, &ly, &lz, &moment_x, &moment_y, &moment_z}) {
+            component->resize(kept);
+        }
+    }
+
+    // entry of a body of the store, size() if it does not rotate
+    size_t find(size_t index) const {
+        for (size_t k = 0; k < size(); k++) {
+            if (body[k] == index) return k;
+        }
+        return size();
+    }
+
+    glm::dquat orientation(size_t k) const {
+        return glm::dquat(qw[k], qx[k], qy[k], qz[k]);
+    }
+
+    glm::dvec3 moments(size_t k) const {
+        return glm::dvec3(moment_x[k], moment_y[k], moment_z[k]);
+    }
+
+    glm::dvec3 bodyAngularMomentum(size_t k) const {
+        return glm::dvec3(lx[k], ly[k], lz[k]);
+    }
+
+    glm::dvec3 angularMomentum(size_t k) const {
+        return orientation(k) * bodyAngularMomentum(k);
+    }
+
+    glm::dvec3 angularVelocity(size_t k) const {
+        return orientation(k) * (bodyAngularMomentum(k) / moments(k));
+    }
+
+    // world direction of a principal axis, e.g. the figure axis of a planet
+    glm::dvec3 axis(size_t k, glm::dvec3 body_axis) const {
+        return orientation(k) * body_axis;
+    }
+
+    double kineticEnergy() const {
+        double energy = 0;
+        for (size_t k = 0; k < size(); k++) {
+            energy += 0.5 * (lx[k] * lx[k] / moment_x[k] + ly[k] * ly[k] / moment_y[k] + lz[k] * lz[k] / moment_z[k]);
+        }
+        return energy;
+    }
+
+    // torque-free motion of all entries over h
+    void drift(double h) {
+        for (const auto& flow : splitting) {
+            for (size_t k = 0; k < size(); k++) {
+                glm::dquat q = orientation(k);
+                glm::dvec3 l = bodyAngularMomentum(k);
+
+                axisFlow(q, l, moments(k), flow.first, flow.second * h);
+
+                qw[k] = q.w; qx[k] = q.x; qy[k] = q.y; qz[k] = q.z;
+                lx[k] = l.x; ly[k] = l.y; lz[k] = l.z;
+            }
+        }
+    }
+
+    // gravity-gradient torques of every other body, 3 G m / r^5 (r x I r) in the principal frame
+    void kick(const BodyStore& bodies, double G, double h) {
+        if (!tidal_torque) return;
+
+        for (size_t k = 0; k < size(); k++) {
+            size_t i = body[k];
+            glm::dquat to_body = glm::conjugate(orientation(k));
+            glm::dvec3 I = moments(k);
+            glm::dvec3 torque(0);
+
+            for (size_t j = 0; j < bodies.size(); j++) {
+                if (j == i) continue;
+
+                glm::dvec3 r = to_body * (bodies.position(j) - bodies.position(i));
+                double r2 = glm::dot(r, r);
+                double r5 = r2 * r2 * std::sqrt(r2);
+
+                torque += (3 * G * bodies.mass[j] / r5) * glm::cross(r, I * r);
+            }
+
+            lx[k] += h * torque.x;
+            ly[k] += h * torque.y;
+            lz[k] += h * torque.z;
+        }
+    }
+
+    // kick-drift-kick across an orbit step of length h that has already been taken from before to after
+    void step(const BodyStore& before, const BodyStore& after, double G, double h) {
+        kick(before, G, h / 2);
+        drift(h);
+        kick(after, G, h / 2);
+    }
+
+    // attitude after a torque-free drift over h, negative h goes back, for drawing between steps
+    glm::dquat driftedOrientation(size_t k, double h) const {
+        glm::dquat q = orientation(k);
+        glm::dvec3 l = bodyAngularMomentum(k);
+
+        for (const auto& flow : splitting) axisFlow(q, l, moments(k), flow.first, flow.second * h);
+
+        return q;
+    }
+
+private:
+    static constexpr std::array<std::pair<int, double>, 5> splitting{{{0, 0.5}, {2, 0.5}, {1, 1.0}, {2, 0.5}, {0, 0.5}}};
+
+    // exact flow of L_a^2 / (2 I_a): the body turns by theta = h L_a / I_a about principal axis a,
+    // so the body-frame components of the fixed world angular momentum turn by -theta
+    static void axisFlow(glm::dquat& q, glm::dvec3& l, const glm::dvec3& I, int a, double h) {
+        double theta = h * l[a] / I[a];
+        double c = std::cos(theta), s = std::sin(theta);
+
+        int b = (a + 1) % 3;
+        int d = (a + 2) % 3;
+        double lb = l[b], ld = l[d];
+        l[b] = lb * c + ld * s;
+        l[d] = -lb * s + ld * c;
+
+        glm::dvec3 axis(0);
+        axis[a] = 1;
+        q = glm::normalize(q * glm::angleAxis(theta, axis));
+    }
+};
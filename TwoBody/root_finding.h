@@ -0,0 +1,69 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+// Root of f in [a, b] with f(a) and f(b) of opposite signs by Brent's method (Brent 1973, zeroin): inverse
+// quadratic interpolation or secant steps while they shrink the bracket fast enough, bisection otherwise,
+// so it converges superlinearly on smooth functions and never slower than bisection.
+// Returns a point within tolerance of a root.
+template<class F>
+double brentRoot(F&& f, double a, double b, double fa, double fb, double tolerance, int max_iterations = 100) {
+    if (fa == 0) return a;
+    if (fb == 0) return b;
+
+    double c = a, fc = fa;
+    double d = b - a, e = d;
+
+    for (int iteration = 0; iteration < max_iterations; iteration++) {
+        // b is the best estimate and c the other end of the bracket
+        if ((fb > 0) == (fc > 0)) {
+            c = a; fc = fa;
+            d = b - a; e = d;
+        }
+        if (std::abs(fc) < std::abs(fb)) {
+            a = b; b = c; c = a;
+            fa = fb; fb = fc; fc = fa;
+        }
+
+        double bound = 2 * 2.2e-16 * std::abs(b) + tolerance / 2;
+        double middle = (c - b) / 2;
+        if (std::abs(middle) <= bound || fb == 0) return b;
+
+        if (std::abs(e) >= bound && std::abs(fa) > std::abs(fb)) {
+            double s = fb / fa;
+            double p, q;
+
+            if (a == c) {
+                p = 2 * middle * s;
+                q = 1 - s;
+            } else {
+                double r = fb / fc;
+                q = fa / fc;
+                p = s * (2 * middle * q * (q - r) - (b - a) * (r - 1));
+                q = (q - 1) * (r - 1) * (s - 1);
+            }
+
+            if (p > 0) q = -q;
+            else p = -p;
+
+            // accept the interpolation only if it stays inside the bracket and beats half the step before last
+            if (2 * p < std::min(3 * middle * q - std::abs(bound * q), std::abs(e * q))) {
+                e = d;
+                d = p / q;
+            } else {
+                d = middle;
+                e = d;
+            }
+        } else {
+            d = middle;
+            e = d;
+        }
+
+        a = b; fa = fb;
+        b += std::abs(d) > bound ? d : (middle > 0 ? bound : -bound);
+        fb = f(b);
+    }
+
+    return b;
+}
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+
+// outer body of a hierarchical triple, averaged over its orbit
+struct SecularPerturber {
+    double mass = 0;
+    double semi_major_axis = 1;
+    double eccentricity = 0;
+    glm::dvec3 normal = glm::dvec3(0, 1, 0);
+};
+
+// Orbit-averaged (secular) evolution of an inner binary perturbed by a distant body, the double-averaged
+// quadrupole Kozai-Lidov equations in vector form (Tremaine, Touma & Kazandjian 2009):
+//     dj/dt = 3 / (4 t_K) [ (j.n) j x n - 5 (e.n) e x n ]
+//     de/dt = 3 / (4 t_K) [ (j.n) e x n + 2 j x e - 5 (e.n) j x n ]
+// e is the eccentricity vector, j = sqrt(1 - e^2) times the orbit normal and n the perturber's orbit normal.
+// The semi-major axis is a secular constant, so a step only has to resolve t_K, the Kozai-Lidov timescale,
+// instead of the inner orbital period. The outer orbit is held fixed (test particle limit), and
+// the octupole term vanishes for the circular outer orbits of the scenes here.
+class SecularKozaiLidov {
+public:
+    glm::dvec3 e = glm::dvec3(0);
+    glm::dvec3 j = glm::dvec3(0, 1, 0);
+
+    double semi_major_axis = 1;
+    // G times the mass of the inner binary
+    double mu = 1;
+    double G = 1;
+
+    SecularPerturber perturber;
+
+    double time = 0;
+    double steps_per_timescale = 64;
+
+    // elements of the relative orbit r, v of the inner binary
+    void setFromRelativeOrbit(glm::dvec3 r, glm::dvec3 v, double inner_mu, double gravity_G) {
+        mu = inner_mu;
+        G = gravity_G;
+
+        glm::dvec3 h = glm::cross(r, v);
+        e = glm::cross(v, h) / mu - r / glm::length(r);
+        semi_major_axis = 1 / (2 / glm::length(r) - glm::dot(v, v) / mu);
+        j = h / std::sqrt(mu * semi_major_axis);
+
+        time = 0;
+    }
+
+    double eccentricity() const {
+        return glm::length(e);
+    }
+
+    // angle between the inner orbit and the perturber's orbit plane
+    double inclination() const {
+        return std::acos(std::clamp(glm::dot(glm::normalize(j), perturber.normal), -1.0, 1.0));
+    }
+
+    double timescale() const {
+        double inner_mean_motion = std::sqrt(mu / (semi_major_axis * semi_major_axis * semi_major_axis));
+        double axis_ratio = perturber.semi_major_axis / semi_major_axis;
+        double outer_factor = std::pow(1 - perturber.eccentricity * perturber.eccentricity, 1.5);
+
+        return mu / (G * perturber.mass) * axis_ratio * axis_ratio * axis_ratio * outer_factor / inner_mean_motion;
+    }
+
+    // advances by dt in RK4 steps of at most t_K / steps_per_timescale, returns the number of steps.
+    // Spans needing more than max_steps are cut short rather than taken with unstable step sizes.
+    int advance(double dt, int max_steps) {
+        double t_k = timescale();
+        double max_dt = max_steps * t_k / steps_per_timescale;
+        dt = std::clamp(dt, -max_dt, max_dt);
+
+        int steps = std::min(max_steps, std::max(1, int(std::ceil(std::abs(dt) / t_k * steps_per_timescale))));
+        double h = dt / steps;
+
+        for (int i = 0; i < steps; i++) step(h, t_k);
+
+        return steps;
+    }
+
+    // quantities conserved by the quadrupole equations, useful to watch the integration drift
+    double conservedAngularMomentum() const {
+        return glm::dot(j, perturber.normal);
+    }
+
+    double quadrupoleEnergy() const {
+        double e_n = glm::dot(e, perturber.normal);
+        double j_n = glm::dot(j, perturber.normal);
+        return 6 * glm::dot(e, e) - 15 * e_n * e_n + 3 * j_n * j_n;
+    }
+
+private:
+    void derivatives(glm::dvec3 e_in, glm::dvec3 j_in, double rate, glm::dvec3& de, glm::dvec3& dj) const {
+        glm::dvec3 n = perturber.normal;
+        double e_n = glm::dot(e_in, n);
+        double j_n = glm::dot(j_in, n);
+
+        dj = rate * (j_n * glm::cross(j_in, n) - 5 * e_n * glm::cross(e_in, n));
+        de = rate * (j_n * glm::cross(e_in, n) + 2.0 * glm::cross(j_in, e_in) - 5 * e_n * glm::cross(j_in, n));
+    }
+
+    void step(double h, double t_k) {
+        double rate = 0.75 / t_k;
+
+        glm::dvec3 de1, dj1, de2, dj2, de3, dj3, de4, dj4;
+        derivatives(e, j, rate, de1, dj1);
+        derivatives(e + 0.5 * h * de1, j + 0.5 * h * dj1, rate, de2, dj2);
+        derivatives(e + 0.5 * h * de2, j + 0.5 * h * dj2, rate, de3, dj3);
+        derivatives(e + h * de3, j + h * dj3, rate, de4, dj4);
+
+        e += h / 6 * (de1 + 2.0 * de2 + 2.0 * de3 + de4);
+        j += h / 6 * (dj1 + 2.0 * dj2 + 2.0 * dj3 + dj4);
+
+        // keep the pair a valid orbit, e.j = 0 and e^2 + j^2 = 1
+        if (glm::dot(e, e) > 0) j -= glm::dot(e, j) / glm::dot(e, e) * e;
+        double j_length = glm::length(j);
+        if (j_length > 0) j *= std::sqrt(std::max(1 - glm::dot(e, e), 0.0)) / j_length;
+
+        time += h;
+    }
+};
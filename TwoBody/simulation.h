@@ -0,0 +1,577 @@
+#pragma once
+
+#include "body_store.h"
+#include "collisions.h"
+#include "forces.h"
+#include "hermite.h"
+#include "ias15.h"
+#include "kepler.h"
+#include "ks_regularization.h"
+#include "rigid_body.h"
+#include "symplectic.h"
+#include "time_base.h"
+#include "variational.h"
+#include "wisdom_holman.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+inline double kineticEnergy(const BodyStore& bodies) {
+    double energy = 0;
+
+    for (size_t i = 0; i < bodies.size(); i++) {
+        double v2 = bodies.vx[i] * bodies.vx[i] + bodies.vy[i] * bodies.vy[i] + bodies.vz[i] * bodies.vz[i];
+        energy += 0.5 * bodies.mass[i] * v2;
+    }
+
+    return energy;
+}
+
+// force terms acting on top of the point-mass gravity, chosen by the scene
+enum class ForceModelKind {
+    PointMass,
+    Geopotential,
+    NearEarth
+};
+
+enum class SteppingMode {
+    Symplectic,
+    Adaptive,
+    WisdomHolman,
+    BlockHermite
+};
+
+// Advances the bodies with a fixed physics timestep that is decoupled from the render frame rate.
+// Wall clock time is fed into an accumulator and consumed in whole steps, so the trajectory depends
+// only on the number of steps taken and never on how the frames happened to be spaced.
+// The fixed step is taken either by a symplectic splitting scheme or by the Wisdom-Holman map.
+// In adaptive mode IAS15 chooses its own steps instead and the rendered state is sampled from its
+// dense output at exactly the requested time. Block Hermite mode works the same way, with every body
+// on its own power-of-two step and the rendered state predicted from the last corrections, it needs
+// the jerk and so only sees the point-mass gravity.
+class Simulation {
+public:
+    BodyStore bodies;
+
+    // the scene's forces, gravity is always on and the model decides which other terms join it
+    ForceModelKind force_model;
+    PointMassGravity gravity;
+    SphericalHarmonicGravity geopotential;
+    ZonalHarmonics zonal;
+    ThirdBodySun third_body;
+    AtmosphericDrag drag;
+    SolarRadiationPressure radiation;
+
+    // spin of selected bodies, stepped along with the orbit and driven by it through gravity-gradient torques
+    RigidRotation rotation;
+
+    // swept-sphere contacts checked after every step, merges and fragments change the body count
+    CollisionHandler collisions;
+    // index every body had at the last reset, npos for fragments, followed through merges
+    std::vector<size_t> reset_index;
+
+    IntegratorKind integrator;
+    SteppingMode mode;
+
+    Ias15 ias15;
+
+    WisdomHolman wisdom_holman;
+
+    BlockHermite hermite;
+
+    // state transition matrices since the last reset, carried by the symplectic stepper only
+    bool propagate_stm;
+    StateTransition stm;
+
+    // Kustaanheimo-Stiefel treatment of the Earth-Moon pair in symplectic mode, switched on per step
+    // while the pair is close or its orbit is nearly radial
+    bool regularize_pair;
+    double regularize_eccentricity;
+    double regularize_separation;
+    KsPair ks;
+    bool regularized_last_step;
+    uint64_t regularized_segments;
+
+    double fixed_dt;
+    // fixed steps cover stride ticks of fixed_dt each, the time-warp scheduler's way of lengthening them
+    // while the clock keeps an exact tick count
+    int stride;
+    double max_frame_delta;
+    int max_steps_per_frame;
+    // wall-clock seconds one advance may spend stepping, 0 for no limit
+    double step_budget;
+
+    // fixed steps tick the clock, the adaptive modes advance it by the frame's simulated time
+    SimulationClock clock;
+    uint64_t step_count;
+    double accumulator;
+    double initial_energy;
+
+    // state at the last reset, the analytic reference for isolated two-body runs
+    BodyStore reference_bodies;
+    double reference_time;
+
+    // positions before the last step, used to interpolate the rendered state between steps
+    std::vector<double> prev_x, prev_y, prev_z;
+
+    Simulation(double fixed_dt)
+        : force_model(ForceModelKind::PointMass), integrator(IntegratorKind::Leapfrog), mode(SteppingMode::Symplectic), propagate_stm(false),
+          regularize_pair(false), regularize_eccentricity(0.95), regularize_separation(1), regularized_last_step(false), regularized_segments(0),
+          fixed_dt(fixed_dt), stride(1), max_frame_delta(0.25), max_steps_per_frame(1000), step_budget(0),
+          step_count(0), accumulator(0), initial_energy(0), reference_time(0)
+    {
+
+    }
+
+    // rendered time, in the adaptive modes the target the integrator is stepped to
+    DoubleDouble preciseTime() const {
+        return clock.now();
+    }
+
+    double time() const {
+        return clock.seconds();
+    }
+
+    // time of the state held in the body store, IAS15 may already be past the rendered time
+    DoubleDouble preciseStateTime() const {
+        if (mode == SteppingMode::Adaptive) return ias15.time;
+        if (mode == SteppingMode::BlockHermite && hermite.started()) return hermite.time;
+        return preciseTime();
+    }
+
+    double stateTime() const {
+        return preciseStateTime().toDouble();
+    }
+
+    void reset(double t0 = 0) {
+        restart(t0);
+
+        reset_index.resize(bodies.size());
+        for (size_t i = 0; i < bodies.size(); i++) reset_index[i] = i;
+        initial_energy = totalEnergy();
+
+        reference_bodies = bodies;
+        reference_time = t0;
+    }
+
+    // current index of the body that had index original at the last reset, BodyStore::npos if it was merged away
+    size_t bodyFromReset(size_t original) const {
+        for (size_t i = 0; i < reset_index.size(); i++) {
+            if (reset_index[i] == original) return i;
+        }
+        return BodyStore::npos;
+    }
+
+    bool isTwoBody() const {
+        return bodies.size() == 2;
+    }
+
+    // jumps an isolated two-body run to time t with the analytic Kepler solution, no stepping
+    void seek(double t) {
+        bodies = reference_bodies;
+        propagateTwoBody(bodies, gravity.G, t - reference_time);
+
+        restart(t);
+    }
+
+    // distance between the integrated and the analytic relative position, divided by the separation
+    double analyticPositionError() const {
+        BodyStore expected = reference_bodies;
+        propagateTwoBody(expected, gravity.G, stateTime() - reference_time);
+
+        glm::dvec3 expected_relative = expected.position(1) - expected.position(0);
+        glm::dvec3 actual_relative = bodies.position(1) - bodies.position(0);
+
+        return glm::length(actual_relative - expected_relative) / glm::length(expected_relative);
+    }
+
+    // switching keeps the energy reference so the error display stays meaningful across modes
+    void setMode(SteppingMode new_mode) {
+        if (new_mode == mode) return;
+
+        // the bodies hold the state at the end of the last IAS15 step, not at the rendered time
+        DoubleDouble t = preciseStateTime();
+        mode = new_mode;
+        restart(t);
+    }
+
+    // the matrices start from identity at the current state, which becomes the covariance epoch
+    void setPropagateStm(bool enabled) {
+        propagate_stm = enabled;
+        stm.reset(bodies.size());
+    }
+
+    void setFixedStep(double dt) {
+        DoubleDouble t = preciseStateTime();
+        fixed_dt = dt;
+        restart(t);
+    }
+
+    double stepLength() const {
+        return fixed_dt * stride;
+    }
+
+    // consumes frame time scaled by timeScale, returns the number of physics steps taken
+    int advance(double frameDelta, double timeScale) {
+        // a vsync stall or a minimised window must not turn into a burst of catch-up steps
+        frameDelta = std::clamp(frameDelta, 0.0, max_frame_delta);
+
+        if (mode == SteppingMode::Adaptive) return advanceAdaptive(frameDelta * timeScale);
+        if (mode == SteppingMode::BlockHermite) return advanceBlockHermite(frameDelta * timeScale);
+
+        accumulator += frameDelta * timeScale;
+
+        WallClock::time_point start = WallClock::now();
+        double h = stepLength();
+        int steps = 0;
+        while (accumulator >= h && steps < max_steps_per_frame && !overBudget(start)) {
+            savePreviousPositions();
+            step();
+
+            accumulator -= h;
+            steps++;
+        }
+
+        // drop the backlog we could not afford instead of carrying it into the next frames
+        if (accumulator >= h) {
+            accumulator = std::min(accumulator, h);
+        }
+
+        return steps;
+    }
+
+    // Moves every body along its Jacobi Kepler orbit by delta, interactions left out, and spins torque-free.
+    // The time-warp fallback when stepping cannot keep up: exact for an isolated pair, for a hierarchical
+    // system the orbits stay fixed and their mutual perturbations are lost. Integrator state starts over.
+    void coast(double delta) {
+        DoubleDouble t = preciseStateTime() + delta;
+
+        wisdom_holman.drift(bodies, gravity.G, delta);
+        rotation.drift(delta);
+
+        restart(t);
+    }
+
+    // calls f with the force model matching force_model at time t,
+    // the switch happens once per step and every term below it is a direct call
+    template<class F>
+    auto withForces(const DoubleDouble& t, F&& f) const {
+        switch (force_model) {
+        case ForceModelKind::Geopotential: {
+            ForceModel<SphericalHarmonicGravity> forces(t, gravity, geopotential);
+            return f(forces);
+        }
+        case ForceModelKind::NearEarth: {
+            ForceModel<ZonalHarmonics, ThirdBodySun, AtmosphericDrag, SolarRadiationPressure> forces(t, gravity, zonal, third_body, drag, radiation);
+            return f(forces);
+        }
+        default: {
+            ForceModel<> forces(t, gravity);
+            return f(forces);
+        }
+        }
+    }
+
+    void step() {
+        if (collisions.enabled) collisions.begin(bodies);
+        bool regularize = mode != SteppingMode::WisdomHolman && regularize_pair && pairNeedsRegularization();
+        double h = stepLength();
+
+        rotation.kick(bodies, gravity.G, h / 2);
+
+        withForces(preciseTime(), [&](auto& forces) {
+            if (mode == SteppingMode::WisdomHolman) {
+                wisdom_holman.step(bodies, gravity.G, h, forces);
+            } else if (regularize) {
+                regularizedPairStep(ks, integrator, bodies, h, forces);
+            } else if (propagate_stm) {
+                symplecticStep(integrator, bodies, h, forces, stm);
+            } else {
+                symplecticStep(integrator, bodies, h, forces);
+            }
+        });
+
+        rotation.drift(h);
+        rotation.kick(bodies, gravity.G, h / 2);
+
+        // consecutive regularized steps make up one segment
+        if (regularize && !regularized_last_step) regularized_segments++;
+        regularized_last_step = regularize;
+        clock.tick(stride);
+        step_count++;
+
+        handleCollisions(h);
+    }
+
+    // the switching criterion, separation below the threshold or eccentricity above it
+    bool pairNeedsRegularization() const {
+        if (bodies.size() < 2) return false;
+
+        glm::dvec3 r = bodies.position(1) - bodies.position(0);
+        glm::dvec3 v = bodies.velocity(1) - bodies.velocity(0);
+        double mu = gravity.G * (bodies.mass[0] + bodies.mass[1]);
+
+        double distance = glm::length(r);
+        if (distance < regularize_separation) return true;
+
+        glm::dvec3 eccentricity = glm::cross(v, glm::cross(r, v)) / mu - r / distance;
+        return glm::length(eccentricity) > regularize_eccentricity;
+    }
+
+    // replaces the state with one computed elsewhere, e.g. by a time-parallel run
+    void setState(const BodyStore& state, double t) {
+        bodies = state;
+        restart(t);
+    }
+
+    // integrates the stored state to exactly t_end with the current stepping mode, bypassing the frame accumulator
+    void propagateTo(double t_end) {
+        double t = stateTime();
+
+        if (mode == SteppingMode::Adaptive) {
+            BodyStore before = bodies;
+            withForces(t, [&](auto& forces) {
+                if (collisions.enabled) collisions.begin(bodies);
+                ias15.integrateTo(bodies, forces, t_end, [&](double h) {
+                    if (!rotation.empty()) rotation.step(before, bodies, gravity.G, h);
+                    handleCollisions(h);
+
+                    if (!rotation.empty()) before = bodies;
+                    if (collisions.enabled) collisions.begin(bodies);
+                });
+            });
+        } else if (mode == SteppingMode::BlockHermite) {
+            // block times do not land on t_end, the final state is predicted from the last blocks
+            startBlockHermite();
+            while (hermite.nextTime() <= t_end) stepBlockHermite();
+            for (size_t i = 0; i < bodies.size(); i++) {
+                bodies.setPosition(i, hermite.predictedPosition(i, t_end));
+                bodies.setVelocity(i, hermite.predictedVelocity(i, t_end));
+            }
+        } else if (t_end > t) {
+            double saved_dt = fixed_dt;
+            int saved_stride = stride;
+            uint64_t steps = std::max<uint64_t>(1, uint64_t(std::ceil((t_end - t) / fixed_dt - 1e-9)));
+
+            fixed_dt = (t_end - t) / double(steps);
+            stride = 1;
+            clock.restart(preciseTime(), fixed_dt);
+            for (uint64_t i = 0; i < steps; i++) step();
+            fixed_dt = saved_dt;
+            stride = saved_stride;
+        }
+
+        restart(t_end);
+    }
+
+    double interpolationFactor() const {
+        return std::clamp(accumulator / stepLength(), 0.0, 1.0);
+    }
+
+    // position blended between the last two steps so the motion stays smooth between physics ticks
+    glm::dvec3 renderPosition(size_t i) const {
+        if (mode == SteppingMode::Adaptive) {
+            return ias15.hasSegment() ? ias15.densePosition(i, time()) : bodies.position(i);
+        }
+        if (mode == SteppingMode::BlockHermite) {
+            return hermite.started() ? hermite.predictedPosition(i, time()) : bodies.position(i);
+        }
+
+        glm::dvec3 previous(prev_x[i], prev_y[i], prev_z[i]);
+        return glm::mix(previous, bodies.position(i), interpolationFactor());
+    }
+
+    // attitude of rotation entry k at the rendered time, drifted torque-free from the stepped state,
+    // which in the fixed-step modes is one step ahead of the interpolated positions
+    glm::dquat renderOrientation(size_t k) const {
+        double lag = (mode == SteppingMode::Adaptive || mode == SteppingMode::BlockHermite)
+            ? time() - stateTime()
+            : (interpolationFactor() - 1) * stepLength();
+
+        return rotation.driftedOrientation(k, lag);
+    }
+
+    double potentialEnergy() const {
+        return withForces(preciseStateTime(), [&](auto& forces) { return forces.potentialEnergy(bodies); });
+    }
+
+    double totalEnergy() const {
+        return kineticEnergy(bodies) + potentialEnergy();
+    }
+
+    double relativeEnergyError() const {
+        return std::abs((totalEnergy() - initial_energy) / initial_energy);
+    }
+
+private:
+    using WallClock = std::chrono::steady_clock;
+
+    bool overBudget(WallClock::time_point start) const {
+        return step_budget > 0 && std::chrono::duration<double>(WallClock::now() - start).count() > step_budget;
+    }
+
+    void restart(const DoubleDouble& t0) {
+        clock.restart(t0, fixed_dt);
+        step_count = 0;
+        accumulator = 0;
+        bodies.accelerations_valid = false;
+        ias15.reset(t0.toDouble(), fixed_dt);
+        hermite.clear();
+
+        // the matrices are relative to the state at t0
+        stm.G = gravity.G;
+        stm.softening = gravity.softening;
+        stm.reset(bodies.size());
+
+        regularized_last_step = false;
+        regularized_segments = 0;
+        ks.steps = 0;
+
+        savePreviousPositions();
+    }
+
+    // steps IAS15 until its last step covers the target time, dense output fills in the rest
+    int advanceAdaptive(double simDelta) {
+        clock.advance(simDelta);
+        double target_time = time();
+
+        WallClock::time_point start = WallClock::now();
+        BodyStore before;
+        int steps = 0;
+        while (ias15.time < target_time && steps < max_steps_per_frame && !overBudget(start)) {
+            double t0 = ias15.time;
+            if (!rotation.empty()) before = bodies;
+            if (collisions.enabled) collisions.begin(bodies);
+
+            withForces(t0, [&](auto& forces) { ias15.step(bodies, forces); });
+            if (!rotation.empty()) rotation.step(before, bodies, gravity.G, ias15.time - t0);
+            handleCollisions(ias15.time - t0);
+
+            step_count++;
+            steps++;
+        }
+
+        if (ias15.time < target_time) clock.restart(ias15.time, fixed_dt);
+
+        return steps;
+    }
+
+    void startBlockHermite() {
+        if (!hermite.started()) hermite.start(bodies, gravity.G, gravity.softening, stateTime());
+    }
+
+    // spins take the torques from the stored positions, which for bodies outside the block lag by less than their own step
+    // collisions likewise see the stored positions
+    void stepBlockHermite() {
+        double t0 = hermite.time;
+        if (collisions.enabled) collisions.begin(bodies);
+
+        if (rotation.empty()) {
+            hermite.step(bodies, gravity.G, gravity.softening);
+        } else {
+            BodyStore before = bodies;
+            hermite.step(bodies, gravity.G, gravity.softening);
+            rotation.step(before, bodies, gravity.G, hermite.time - t0);
+        }
+
+        handleCollisions(hermite.time - t0);
+    }
+
+    // same scheme as IAS15, blocks are stepped until the last one covers the target time
+    int advanceBlockHermite(double simDelta) {
+        startBlockHermite();
+        clock.advance(simDelta);
+        double target_time = time();
+
+        WallClock::time_point start = WallClock::now();
+        int steps = 0;
+        while (hermite.time < target_time && steps < max_steps_per_frame && !overBudget(start)) {
+            stepBlockHermite();
+
+            step_count++;
+            steps++;
+        }
+
+        if (hermite.time < target_time) clock.restart(hermite.time, fixed_dt);
+
+        return steps;
+    }
+
+    // everything sized by or integrating the old bodies starts over from the resolved state, the clock runs on
+    // and the energy reference moves to the state after the contact
+    void handleCollisions(double h) {
+        if (!collisions.enabled || collisions.resolve(bodies, gravity.G, h) == 0) return;
+
+        if (!collisions.new_index.empty()) {
+            rotation.remap(collisions.new_index);
+
+            std::vector<size_t> remapped(bodies.size(), BodyStore::npos);
+            for (size_t i = 0; i < collisions.new_index.size() && i < reset_index.size(); i++) {
+                if (collisions.new_index[i] != BodyStore::npos) remapped[collisions.new_index[i]] = reset_index[i];
+            }
+            reset_index = std::move(remapped);
+        }
+
+        DoubleDouble t = preciseStateTime();
+        ias15.reset(t.toDouble(), fixed_dt);
+        if (hermite.started()) {
+            hermite.clear();
+            hermite.start(bodies, gravity.G, gravity.softening, t.toDouble());
+        }
+        stm.reset(bodies.size());
+
+        reference_bodies = bodies;
+        reference_time = t.toDouble();
+        initial_energy = totalEnergy();
+
+        savePreviousPositions();
+    }
+
+    void savePreviousPositions() {
+        prev_x = bodies.x;
+        prev_y = bodies.y;
+        prev_z = bodies.z;
+    }
+};
+
+// Runs every integrator on a copy of the current state for trial_time and returns the one with
+// the fewest force evaluations per step whose relative energy error stayed within energy_budget.
+// Falls back to the most accurate scheme when none of them meets the budget.
+inline IntegratorKind cheapestIntegratorWithin(const Simulation& simulation, double energy_budget, double trial_time) {
+    IntegratorKind best = IntegratorKind::Yoshida8;
+    int best_cost = -1;
+    double best_error = 0;
+
+    uint64_t trial_steps = uint64_t(trial_time / simulation.fixed_dt) + 1;
+
+    for (int k = 0; k < int(IntegratorKind::Count); k++) {
+        Simulation trial = simulation;
+        trial.mode = SteppingMode::Symplectic;
+        trial.stride = 1;
+        trial.integrator = IntegratorKind(k);
+        trial.reset(simulation.time());
+
+        double max_error = 0;
+        for (uint64_t i = 0; i < trial_steps; i++) {
+            trial.step();
+            max_error = std::max(max_error, trial.relativeEnergyError());
+        }
+
+        int cost = integratorForceEvaluations(trial.integrator);
+        bool cheaper = best_cost < 0 || cost < best_cost || (cost == best_cost && max_error < best_error);
+
+        if (max_error <= energy_budget && cheaper) {
+            best = trial.integrator;
+            best_cost = cost;
+            best_error = max_error;
+        }
+    }
+
+    return best;
+}
@@ -7,8 +7,8 @@ in vec4 fragPos;
 
 uniform vec3 lightColor;
 uniform vec3 lightDirection;
-uniform vec3 cameraPos;
 uniform float ignoreTextures;
+uniform float emissive;
 uniform sampler2D ourTexture;
 
 void main() {
@@ -17,7 +17,7 @@ void main() {
     vec3 lightDirectionNorm = normalize(lightDirection);
 
     vec3 normal = normalize(-sphereCenter.xyz + fragPos.xyz);
-    vec3 viewDirection = normalize(-cameraPos + fragPos.xyz);
+    vec3 viewDirection = normalize(fragPos.xyz); // positions are relative to the camera
     vec3 reflectedLightDir = reflect(lightDirectionNorm, normal); 
 
     float ambientCoef = 0.05;
@@ -32,6 +32,7 @@ void main() {
     vec3 specularLight = specularCoef * specularStrength * lightColor;
 
     vec3 totalLight = ambientLight + diffuseLight + specularLight;
+    totalLight = mix(totalLight, lightColor, emissive);
     
     vec4 textureColor = texture(ourTexture, texPos);
     if (ignoreTextures == 1) textureColor = vec4(0.5, 0.5, 0.5, 1.0);
@@ -7,7 +7,7 @@ out vec4 sphereCenter;
 out vec4 fragPos;
 
 uniform mat4 vertexTransform;
-uniform mat4 modelTransform;
+uniform mat4 modelTransform; // places the sphere relative to the camera
 uniform float r;
 
 void main() {
@@ -0,0 +1,229 @@
+#pragma once
+
+#include "body_store.h"
+#include "time_base.h"
+
+#include <array>
+#include <cstddef>
+#include <utility>
+
+// Symplectic splitting integrators for separable Hamiltonians H = T(v) + V(x).
+// A scheme is a constexpr table of alternating kick and drift coefficients
+//     kick[0] drift[0] kick[1] drift[1] ... drift[S-1] kick[S]
+// which symplecticStep() unrolls at compile time, zero kicks are removed entirely.
+
+template<size_t Stages>
+struct SplittingCoefficients {
+    std::array<double, Stages> drift;
+    std::array<double, Stages + 1> kick;
+};
+
+// composition of kick-drift-kick leapfrogs with the given weights, neighbouring kicks merged
+template<size_t M>
+constexpr SplittingCoefficients<M> composeVelocityVerlet(const std::array<double, M>& weights) {
+    SplittingCoefficients<M> c{};
+
+    c.kick[0] = weights[0] / 2;
+    for (size_t i = 0; i < M; i++) {
+        c.drift[i] = weights[i];
+        c.kick[i + 1] = (weights[i] + (i + 1 < M ? weights[i + 1] : 0.0)) / 2;
+    }
+
+    return c;
+}
+
+// composition of drift-kick-drift leapfrogs with the given weights, neighbouring drifts merged
+template<size_t M>
+constexpr SplittingCoefficients<M + 1> composePositionVerlet(const std::array<double, M>& weights) {
+    SplittingCoefficients<M + 1> c{};
+
+    c.drift[0] = weights[0] / 2;
+    for (size_t i = 0; i < M; i++) {
+        c.kick[i + 1] = weights[i];
+        c.drift[i + 1] = (weights[i] + (i + 1 < M ? weights[i + 1] : 0.0)) / 2;
+    }
+
+    return c;
+}
+
+template<size_t S>
+constexpr int countForceEvaluations(const SplittingCoefficients<S>& c) {
+    // a leading kick reuses the accelerations cached by the previous step
+    int count = 0;
+    for (size_t i = 1; i <= S; i++) {
+        if (c.kick[i] != 0.0) count++;
+    }
+    return count;
+}
+
+namespace symplectic_weights {
+    // triple jump, 1 / (2 - 2^(1/3))
+    constexpr double triple_jump = 1.35120719195965763404768780897;
+
+    constexpr std::array<double, 3> fourth_order{
+        triple_jump, 1 - 2 * triple_jump, triple_jump
+    };
+
+    // H. Yoshida, Construction of higher order symplectic integrators, 1990, solution A
+    constexpr double y6_w1 = -1.17767998417887;
+    constexpr double y6_w2 = 0.235573213359357;
+    constexpr double y6_w3 = 0.784513610477560;
+    constexpr double y6_w0 = 1 - 2 * (y6_w1 + y6_w2 + y6_w3);
+
+    constexpr std::array<double, 7> sixth_order{
+        y6_w3, y6_w2, y6_w1, y6_w0, y6_w1, y6_w2, y6_w3
+    };
+
+    // same paper, solution D
+    constexpr double y8_w1 = 0.102799849391985;
+    constexpr double y8_w2 = -1.96061023297549;
+    constexpr double y8_w3 = 1.93813913762276;
+    constexpr double y8_w4 = -0.158240635368243;
+    constexpr double y8_w5 = -1.44485223686048;
+    constexpr double y8_w6 = 0.253693336566229;
+    constexpr double y8_w7 = 0.914844246229740;
+    constexpr double y8_w0 = 1 - 2 * (y8_w1 + y8_w2 + y8_w3 + y8_w4 + y8_w5 + y8_w6 + y8_w7);
+
+    constexpr std::array<double, 15> eighth_order{
+        y8_w7, y8_w6, y8_w5, y8_w4, y8_w3, y8_w2, y8_w1, y8_w0,
+        y8_w1, y8_w2, y8_w3, y8_w4, y8_w5, y8_w6, y8_w7
+    };
+}
+
+struct Leapfrog {
+    static constexpr const char* name = "Leapfrog (Verlet)";
+    static constexpr int order = 2;
+    static constexpr auto coefficients = composeVelocityVerlet<1>({1.0});
+};
+
+// original Forest-Ruth arrangement, drift first
+struct ForestRuth {
+    static constexpr const char* name = "Forest-Ruth";
+    static constexpr int order = 4;
+    static constexpr auto coefficients = composePositionVerlet(symplectic_weights::fourth_order);
+};
+
+struct Yoshida4 {
+    static constexpr const char* name = "Yoshida 4";
+    static constexpr int order = 4;
+    static constexpr auto coefficients = composeVelocityVerlet(symplectic_weights::fourth_order);
+};
+
+struct Yoshida6 {
+    static constexpr const char* name = "Yoshida 6";
+    static constexpr int order = 6;
+    static constexpr auto coefficients = composeVelocityVerlet(symplectic_weights::sixth_order);
+};
+
+struct Yoshida8 {
+    static constexpr const char* name = "Yoshida 8";
+    static constexpr int order = 8;
+    static constexpr auto coefficients = composeVelocityVerlet(symplectic_weights::eighth_order);
+};
+
+template<class Forces>
+inline void symplecticKick(BodyStore& bodies, double h, Forces& forces) {
+    if (!bodies.accelerations_valid) forces.computeAccelerations(bodies);
+
+    size_t n = bodies.size();
+    for (size_t i = 0; i < n; i++) {
+        bodies.vx[i] += h * bodies.ax[i];
+        bodies.vy[i] += h * bodies.ay[i];
+        bodies.vz[i] += h * bodies.az[i];
+    }
+}
+
+inline void symplecticDrift(BodyStore& bodies, double h) {
+    size_t n = bodies.size();
+    for (size_t i = 0; i < n; i++) {
+        bodies.x[i] += h * bodies.vx[i];
+        bodies.y[i] += h * bodies.vy[i];
+        bodies.z[i] += h * bodies.vz[i];
+    }
+
+    bodies.accelerations_valid = false;
+}
+
+// Tangent (variational) state carried through the same kicks and drifts as the bodies.
+// The empty default compiles away entirely.
+struct NoTangents {
+    void kick(const BodyStore&, double) {}
+    void drift(double) {}
+};
+
+template<class Scheme, size_t I, class Forces, class Tangents>
+inline void symplecticStage(BodyStore& bodies, double h, Forces& forces, Tangents& tangents) {
+    constexpr double kick = Scheme::coefficients.kick[I];
+    constexpr double drift = Scheme::coefficients.drift[I];
+
+    if constexpr (kick != 0.0) {
+        tangents.kick(bodies, kick * h);
+        symplecticKick(bodies, kick * h, forces);
+    }
+
+    symplecticDrift(bodies, drift * h);
+    tangents.drift(drift * h);
+    forces.time += drift * h;
+}
+
+template<class Scheme, class Forces, class Tangents, size_t... I>
+inline void symplecticStepUnrolled(BodyStore& bodies, double h, Forces& forces, Tangents& tangents, std::index_sequence<I...>) {
+    // every kick sees the forces at the time the drifts so far have reached
+    DoubleDouble t0 = forces.time;
+    (symplecticStage<Scheme, I>(bodies, h, forces, tangents), ...);
+    forces.time = t0 + h;
+
+    constexpr double last_kick = Scheme::coefficients.kick[sizeof...(I)];
+    if constexpr (last_kick != 0.0) {
+        tangents.kick(bodies, last_kick * h);
+        symplecticKick(bodies, last_kick * h, forces);
+    }
+}
+
+template<class Scheme, class Forces, class Tangents = NoTangents>
+inline void symplecticStep(BodyStore& bodies, double h, Forces& forces, Tangents&& tangents = Tangents{}) {
+    constexpr size_t stages = Scheme::coefficients.drift.size();
+    symplecticStepUnrolled<Scheme>(bodies, h, forces, tangents, std::make_index_sequence<stages>{});
+}
+
+enum class IntegratorKind {
+    Leapfrog,
+    ForestRuth,
+    Yoshida4,
+    Yoshida6,
+    Yoshida8,
+    Count
+};
+
+// calls f with a value of the scheme type matching the runtime choice,
+// the switch happens once per step and everything below it is a direct call
+template<class F>
+inline void withIntegrator(IntegratorKind kind, F&& f) {
+    switch (kind) {
+    case IntegratorKind::Leapfrog: f(Leapfrog{}); break;
+    case IntegratorKind::ForestRuth: f(ForestRuth{}); break;
+    case IntegratorKind::Yoshida4: f(Yoshida4{}); break;
+    case IntegratorKind::Yoshida6: f(Yoshida6{}); break;
+    case IntegratorKind::Yoshida8: f(Yoshida8{}); break;
+    default: break;
+    }
+}
+
+template<class Forces, class Tangents = NoTangents>
+inline void symplecticStep(IntegratorKind kind, BodyStore& bodies, double h, Forces& forces, Tangents&& tangents = Tangents{}) {
+    withIntegrator(kind, [&](auto scheme) {
+        symplecticStep<decltype(scheme)>(bodies, h, forces, tangents);
+    });
+}
+
+inline const char* integratorName(IntegratorKind kind) {
+    const char* name = "";
+    withIntegrator(kind, [&](auto scheme) { name = decltype(scheme)::name; });
+    return name;
+}
+
+inline int integratorForceEvaluations(IntegratorKind kind) {
+    int count = 0;
+    withIntegrator(kind, [&](auto scheme) { count = countForceEvaluations(decltype(scheme)::coefficients); });
+    return count;
+}
@@ -0,0 +1,45 @@
+#include "../reproducibility.h"
+#include "../simulation.h"
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// Steps a fixed cluster on private pools of 1, 2, 4 and 8 threads with reproducible gravity and fails unless
+// every run ends in the same state hash. The cluster is above the parallel threshold so the gathered rows
+// really are split over the threads. GCC and Clang builds need -ffp-contract=off, see PointMassGravity.
+int main() {
+    const size_t count = 512;
+    const uint64_t steps = 50;
+
+    Simulation simulation(1e-3);
+    simulation.gravity.G = 1;
+    simulation.gravity.softening = 0.01;
+    simulation.gravity.reproducible = true;
+
+    // uniform sphere, fixed seed and mt19937 so the scene is the same on every standard library
+    std::mt19937 random(7);
+    auto uniform = [&] { return double(random()) / 4294967296.0; };
+    for (size_t i = 0; i < count; i++) {
+        glm::dvec3 p;
+        do {
+            p = glm::dvec3(2 * uniform() - 1, 2 * uniform() - 1, 2 * uniform() - 1);
+        } while (glm::dot(p, p) > 1);
+
+        glm::dvec3 v = 0.3 * glm::dvec3(2 * uniform() - 1, 2 * uniform() - 1, 2 * uniform() - 1);
+        simulation.bodies.addBody(1.0 / count, p, v);
+    }
+    simulation.reset(0);
+
+    ReproducibilityReport report = reproducibilityCheck(simulation, steps, {1, 2, 4, 8, 1});
+
+    for (const auto& run : report.runs) {
+        std::printf("%u threads: %016llx in %.3f s\n", run.threads, (unsigned long long)run.hash, run.seconds);
+    }
+    std::printf(report.identical ? "identical\n" : "MISMATCH\n");
+
+    return report.identical ? 0 : 1;
+}
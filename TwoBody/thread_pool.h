@@ -0,0 +1,386 @@
+#pragma once
+
+#include "work_deque.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Work-stealing thread pool, the one set of threads everything parallel in the program runs on.
+// Every thread owns a Chase-Lev deque: it pushes and pops its own tasks at the bottom, and once that runs dry takes the
+// oldest task of another thread picked at random, so large pieces of work travel and small ones stay where their data
+// is warm. The thread that calls into the pool takes part as thread 0 with a deque of its own; a second outside thread
+// arriving while thread 0 is taken posts through a shared queue instead.
+// parallelFor splits lazily (Tzannes et al. 2010): a thread halves its range only while its own deque is empty, the
+// sign that it has nothing left for thieves, and otherwise runs the next grain and looks again, so the grain adapts to
+// how busy the pool is instead of being fixed up front. Jobs are single tasks that start once the jobs they depend on
+// have finished. Waiting threads keep running tasks themselves, so nested parallel loops cannot deadlock the pool,
+// and with a single thread queued jobs run when something waits on them.
+class ThreadPool {
+    struct Task {
+        std::atomic<bool> done{false};
+
+        virtual void run() = 0;
+
+    protected:
+        ~Task() = default;
+    };
+
+public:
+    // a function submitted to the pool, queued once every job it depends on has finished
+    class Job : public Task {
+    public:
+        bool finished() const {
+            return done.load(std::memory_order_acquire);
+        }
+
+    private:
+        friend class ThreadPool;
+
+        ThreadPool* pool = nullptr;
+        std::function<void()> fn;
+        // unfinished dependencies, plus one while submit is still adding them
+        std::atomic<int> waiting{1};
+        std::mutex mutex;
+        std::vector<std::shared_ptr<Job>> dependents;
+        // the pool's reference while the job is queued
+        std::shared_ptr<Job> self;
+
+        void run() override {
+            std::shared_ptr<Job> keep = std::move(self);
+            fn();
+            fn = nullptr;
+
+            std::vector<std::shared_ptr<Job>> ready;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.store(true, std::memory_order_release);
+                ready.swap(dependents);
+            }
+            for (const auto& job : ready) job->pool->release(job);
+        }
+    };
+
+    using JobHandle = std::shared_ptr<Job>;
+
+    explicit ThreadPool(unsigned thread_count = std::max(1u, std::thread::hardware_concurrency())) {
+        thread_count = std::max(1u, thread_count);
+        for (unsigned i = 0; i < thread_count; i++) deques.push_back(std::make_unique<WorkDeque<Task>>());
+
+        // the calling thread participates, so one fewer worker is enough
+        for (unsigned i = 1; i < thread_count; i++) {
+            workers.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+
+        for (auto& worker : workers) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const {
+        return unsigned(workers.size()) + 1;
+    }
+
+    static ThreadPool& global() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    // calls fn(i) for every i in [begin, end) and returns once all calls have finished;
+    // ranges of min_chunk or fewer indices are never split
+    template<class F>
+    void parallelFor(size_t begin, size_t end, F&& fn, size_t min_chunk = 1) {
+        if (end <= begin) return;
+
+        size_t count = end - begin;
+        // at most a few dozen pieces per thread however idle the pool is
+        size_t grain = std::max({min_chunk, size_t(1), count / (64 * size_t(size()))});
+
+        if (count <= grain || workers.empty()) {
+            for (size_t i = begin; i < end; i++) fn(i);
+            return;
+        }
+
+        Attach attach(*this);
+        if (current().slot == outsider) {
+            RangeTask<std::remove_reference_t<F>> all(*this, begin, end, fn, grain);
+            schedule(&all);
+            help(all);
+        } else {
+            split(begin, end, fn, grain);
+        }
+    }
+
+    // queues fn to run on the pool after all the dependencies, null ones are ignored
+    JobHandle submit(std::function<void()> fn, const std::vector<JobHandle>& dependencies = {}) {
+        JobHandle job = std::make_shared<Job>();
+        job->pool = this;
+        job->fn = std::move(fn);
+
+        for (const JobHandle& dependency : dependencies) {
+            if (!dependency) continue;
+
+            std::lock_guard<std::mutex> lock(dependency->mutex);
+            if (dependency->finished()) continue;
+            job->waiting.fetch_add(1, std::memory_order_relaxed);
+            dependency->dependents.push_back(job);
+        }
+
+        release(job);
+        return job;
+    }
+
+    // runs tasks until the job has finished
+    void wait(const JobHandle& job) {
+        if (!job || job->finished()) return;
+
+        Attach attach(*this);
+        help(*job);
+    }
+
+    // Sum of term(i) over [begin, end) that does not depend on the number of threads: the range is cut
+    // into fixed blocks summed in index order, then the block sums are added pairwise in a fixed tree.
+    template<class F>
+    double deterministicSum(size_t begin, size_t end, F&& term, size_t block = 256) {
+        if (end <= begin) return 0;
+
+        size_t block_count = (end - begin + block - 1) / block;
+        std::vector<double> partial(block_count);
+
+        parallelFor(0, block_count, [&](size_t b) {
+            size_t first = begin + b * block;
+            size_t last = std::min(end, first + block);
+
+            double sum = 0;
+            for (size_t i = first; i < last; i++) sum += term(i);
+            partial[b] = sum;
+        });
+
+        return pairwiseSum(partial);
+    }
+
+    static double pairwiseSum(std::vector<double> values) {
+        if (values.empty()) return 0;
+
+        for (size_t count = values.size(); count > 1; count = (count + 1) / 2) {
+            for (size_t k = 0; k < count / 2; k++) values[k] = values[2 * k] + values[2 * k + 1];
+            if (count % 2) values[count / 2] = values[count - 1];
+        }
+
+        return values[0];
+    }
+
+private:
+    static constexpr size_t outsider = size_t(-1);
+
+    // the pool the thread is running tasks of and its deque there
+    struct Context {
+        ThreadPool* pool = nullptr;
+        size_t slot = outsider;
+    };
+
+    // the part of a parallelFor range a thread has pushed for others to steal
+    template<class F>
+    struct RangeTask : Task {
+        ThreadPool& pool;
+        size_t begin;
+        size_t end;
+        F& fn;
+        size_t grain;
+
+        RangeTask(ThreadPool& pool, size_t begin, size_t end, F& fn, size_t grain) : pool(pool), begin(begin), end(end), fn(fn), grain(grain) {
+        }
+
+        void run() override {
+            pool.split(begin, end, fn, grain);
+            done.store(true, std::memory_order_release);
+        }
+    };
+
+    // makes the calling thread part of the pool while it exists: thread 0 when that is free, an outsider otherwise
+    class Attach {
+    public:
+        explicit Attach(ThreadPool& pool) : pool(pool), saved(current()) {
+            if (saved.pool == &pool) return;
+
+            claimed = !pool.host_taken.exchange(true, std::memory_order_acquire);
+            current() = Context{&pool, claimed ? 0 : outsider};
+        }
+
+        ~Attach() {
+            current() = saved;
+            if (claimed) pool.host_taken.store(false, std::memory_order_release);
+        }
+
+        Attach(const Attach&) = delete;
+        Attach& operator=(const Attach&) = delete;
+
+    private:
+        ThreadPool& pool;
+        Context saved;
+        bool claimed = false;
+    };
+
+    std::vector<std::thread> workers;
+    // one per thread, thread 0 being whoever has called in
+    std::vector<std::unique_ptr<WorkDeque<Task>>> deques;
+    std::atomic<bool> host_taken{false};
+
+    // tasks posted by outsiders
+    std::deque<Task*> injected;
+    std::mutex injected_mutex;
+    std::atomic<size_t> injected_count{0};
+
+    // idle workers sleep until epoch moves on
+    std::atomic<uint64_t> epoch{0};
+    std::atomic<unsigned> sleeping{0};
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    bool stopping = false;
+
+    static Context& current() {
+        thread_local Context context;
+        return context;
+    }
+
+    static uint32_t randomIndex(uint32_t bound) {
+        thread_local uint32_t state = uint32_t(std::hash<std::thread::id>()(std::this_thread::get_id())) | 1;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state % bound;
+    }
+
+    // lazy binary splitting of [begin, end) on the calling thread
+    template<class F>
+    void split(size_t begin, size_t end, F& fn, size_t grain) {
+        size_t slot = current().slot;
+
+        while (end - begin > grain) {
+            bool exposed = slot == outsider ? injected_count.load(std::memory_order_relaxed) > 0 : !deques[slot]->empty();
+            if (!exposed) {
+                size_t middle = begin + (end - begin) / 2;
+                RangeTask<F> upper(*this, middle, end, fn, grain);
+                schedule(&upper);
+                split(begin, middle, fn, grain);
+                help(upper);
+                return;
+            }
+
+            for (size_t i = begin; i < begin + grain; i++) fn(i);
+            begin += grain;
+        }
+
+        for (size_t i = begin; i < end; i++) fn(i);
+    }
+
+    void release(const JobHandle& job) {
+        if (job->waiting.fetch_sub(1, std::memory_order_acq_rel) != 1) return;
+
+        job->self = job;
+        schedule(job.get());
+    }
+
+    void schedule(Task* task) {
+        const Context& context = current();
+        if (context.pool == this && context.slot != outsider) {
+            deques[context.slot]->push(task);
+        } else {
+            std::lock_guard<std::mutex> lock(injected_mutex);
+            injected.push_back(task);
+            injected_count.fetch_add(1, std::memory_order_release);
+        }
+
+        // a sleeper either sees the new epoch before it waits or is counted here and woken
+        epoch.fetch_add(1);
+        if (sleeping.load() > 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            wakeup.notify_one();
+        }
+    }
+
+    // own deque first, then the shared queue, then the other deques from a random one on
+    Task* findTask(size_t slot) {
+        if (slot != outsider) {
+            if (Task* task = deques[slot]->pop()) return task;
+        }
+
+        if (injected_count.load(std::memory_order_acquire) > 0) {
+            std::lock_guard<std::mutex> lock(injected_mutex);
+            if (!injected.empty()) {
+                Task* task = injected.front();
+                injected.pop_front();
+                injected_count.fetch_sub(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+
+        size_t count = deques.size();
+        size_t start = randomIndex(uint32_t(count));
+        for (size_t k = 0; k < count; k++) {
+            size_t victim = (start + k) % count;
+            if (victim == slot) continue;
+            if (Task* task = deques[victim]->steal()) return task;
+        }
+
+        return nullptr;
+    }
+
+    // runs other tasks until the given one has finished
+    void help(const Task& task) {
+        size_t slot = current().slot;
+        while (!task.done.load(std::memory_order_acquire)) {
+            if (Task* next = findTask(slot)) {
+                next->run();
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void workerLoop(size_t slot) {
+        current() = Context{this, slot};
+
+        int idle = 0;
+        for (;;) {
+            uint64_t seen = epoch.load();
+            if (Task* task = findTask(slot)) {
+                task->run();
+                idle = 0;
+                continue;
+            }
+
+            // spin a little before sleeping, a parallelFor usually follows another
+            if (++idle < 64) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            if (stopping) return;
+
+            sleeping.fetch_add(1);
+            wakeup.wait(lock, [&] { return stopping || epoch.load() != seen; });
+            sleeping.fetch_sub(1);
+            idle = 0;
+        }
+    }
+};
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+// Unevaluated sum hi + lo with |lo| below half an ulp of hi, about 32 significant digits.
+// Error-free transformations after Dekker 1971 and Knuth's TwoSum, they rely on strict IEEE double
+// arithmetic, which is why the project builds with the precise floating point model.
+struct DoubleDouble {
+    double hi = 0;
+    double lo = 0;
+
+    DoubleDouble() = default;
+    DoubleDouble(double value) : hi(value), lo(0) {}
+    DoubleDouble(double hi, double lo) : hi(hi), lo(lo) {}
+
+    // exact a + b
+    static DoubleDouble sum(double a, double b) {
+        double s = a + b;
+        double b_virtual = s - a;
+        double error = (a - (s - b_virtual)) + (b - b_virtual);
+        return {s, error};
+    }
+
+    // exact a * b, the fused multiply-add returns the rounding error of the product
+    static DoubleDouble product(double a, double b) {
+        double p = a * b;
+        return {p, std::fma(a, b, -p)};
+    }
+
+    DoubleDouble operator+(const DoubleDouble& other) const {
+        DoubleDouble s = sum(hi, other.hi);
+        DoubleDouble t = sum(lo, other.lo);
+        s = quickSum(s.hi, s.lo + t.hi);
+        return quickSum(s.hi, s.lo + t.lo);
+    }
+
+    DoubleDouble operator-() const {
+        return {-hi, -lo};
+    }
+
+    DoubleDouble operator-(const DoubleDouble& other) const {
+        return *this + -other;
+    }
+
+    DoubleDouble operator*(double factor) const {
+        DoubleDouble p = product(hi, factor);
+        return quickSum(p.hi, p.lo + lo * factor);
+    }
+
+    DoubleDouble& operator+=(const DoubleDouble& other) {
+        return *this = *this + other;
+    }
+
+    bool operator<(const DoubleDouble& other) const {
+        return hi < other.hi || (hi == other.hi && lo < other.lo);
+    }
+
+    double toDouble() const {
+        return hi + lo;
+    }
+
+private:
+    // exact a + b when |a| >= |b|
+    static DoubleDouble quickSum(double a, double b) {
+        double s = a + b;
+        return {s, b - (s - a)};
+    }
+};
+
+// x modulo period in [0, period). Whole periods are removed in double-double, so the phase of
+// something spinning for years keeps the resolution it had in the first turn.
+inline double wrap(const DoubleDouble& x, double period) {
+    double turns = std::floor(x.hi / period);
+    double phase = (x - DoubleDouble::product(turns, period)).toDouble();
+
+    phase = std::fmod(phase, period);
+    return phase < 0 ? phase + period : phase;
+}
+
+// Simulation time as a double-double epoch plus an integer count of fixed-length ticks.
+// Fixed-step modes only count ticks and the time is epoch + ticks * tick_length evaluated exactly,
+// so it neither accumulates rounding nor loses the step resolution at large epochs.
+// Variable-step modes move the epoch itself with a compensated addition.
+class SimulationClock {
+public:
+    DoubleDouble epoch;
+    double tick_length = 0;
+    int64_t ticks = 0;
+
+    void restart(const DoubleDouble& t0, double new_tick_length) {
+        epoch = t0;
+        tick_length = new_tick_length;
+        ticks = 0;
+    }
+
+    void tick(int64_t count = 1) {
+        ticks += count;
+    }
+
+    void advance(double delta) {
+        epoch += delta;
+    }
+
+    DoubleDouble now() const {
+        return epoch + DoubleDouble::product(double(ticks), tick_length);
+    }
+
+    double seconds() const {
+        return now().toDouble();
+    }
+};
+
+// Wall clock for frame timing in integer nanoseconds since construction. Deltas are exact tick
+// differences, a float seconds counter instead loses milliseconds after a few hours.
+class FrameClock {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    FrameClock() : start(Clock::now()), last_ticks(0), current_ticks(0) {}
+
+    // starts a new frame, returns the length of the previous one in seconds
+    double tick() {
+        last_ticks = current_ticks;
+        current_ticks = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        return deltaSeconds();
+    }
+
+    double deltaSeconds() const {
+        return double(current_ticks - last_ticks) * 1e-9;
+    }
+
+    int64_t ticks() const {
+        return current_ticks;
+    }
+
+private:
+    Clock::time_point start;
+    int64_t last_ticks;
+    int64_t current_ticks;
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "body_store.h"
+#include "simulation.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+
+enum class WarpStrategy {
+    // every step taken at its usual length
+    Full,
+    // fixed steps lengthened by a stride, limited to a fraction of the shortest orbit
+    LargerSteps,
+    // analytic Kepler motion of the Jacobi orbits, interactions left out
+    Coasting,
+    // as many steps as the budget holds, simulated time falls behind the warp
+    Dilated
+};
+
+inline const char* warpStrategyName(WarpStrategy strategy) {
+    switch (strategy) {
+    case WarpStrategy::Full: return "full steps";
+    case WarpStrategy::LargerSteps: return "larger steps";
+    case WarpStrategy::Coasting: return "coasting on Kepler orbits";
+    default: return "time dilated";
+    }
+}
+
+// Decides every frame how the simulation covers the frame time times the warp factor within a wall-clock
+// budget, so the window stays responsive at any warp. The cost of a step is learned from the previous frames.
+// The strategies are tried in order of fidelity: full steps while they fit, then fixed steps up to max_stride
+// times longer as long as the shortest orbit keeps steps_per_orbit of them, then Kepler coasting where it is
+// allowed, and otherwise the budget cuts the stepping short and the achieved warp drops below the requested one.
+class TimeWarpScheduler {
+public:
+    double warp = 1;
+    double max_warp = 1e7;
+
+    // wall-clock seconds of physics per frame
+    double budget = 0.008;
+    int max_stride = 64;
+    double steps_per_orbit = 64;
+    // set by the scene, coasting needs bodies ordered innermost first and no force beyond point-mass gravity
+    bool allow_coasting = true;
+
+    WarpStrategy strategy = WarpStrategy::Full;
+    int steps_last_frame = 0;
+    double achieved_warp = 1;
+    double seconds_per_step = 0;
+    // simulated time per step, what the adaptive schemes are judged by
+    double mean_step = 0;
+    double physics_seconds = 0;
+
+    // advances the simulation by frame_delta * time_scale * warp at most, returns the steps taken
+    int advance(Simulation& simulation, double frame_delta, double time_scale) {
+        frame_delta = std::clamp(frame_delta, 0.0, simulation.max_frame_delta);
+        double requested = frame_delta * time_scale * warp;
+        // fixed steps hold the remainder below one step in the accumulator, it counts as covered
+        double t0 = simulation.time() + simulation.accumulator;
+
+        Clock::time_point start = Clock::now();
+        plan(simulation, requested);
+
+        int steps = 0;
+        if (strategy == WarpStrategy::Coasting) {
+            simulation.coast(requested);
+        } else {
+            simulation.step_budget = budget;
+            steps = simulation.advance(frame_delta, time_scale * warp);
+        }
+        physics_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+        double covered = simulation.time() + simulation.accumulator - t0;
+        if (steps > 0) {
+            double per_step = physics_seconds / steps;
+            seconds_per_step = seconds_per_step > 0 ? 0.8 * seconds_per_step + 0.2 * per_step : per_step;
+            mean_step = covered / steps;
+        }
+        // the budget or the step limit stopped the stepping before the frame's time was covered
+        if (strategy != WarpStrategy::Coasting && covered < requested * (1 - 1e-9)) strategy = WarpStrategy::Dilated;
+
+        steps_last_frame = steps;
+        achieved_warp = frame_delta * time_scale > 0 ? covered / (frame_delta * time_scale) : warp;
+        return steps;
+    }
+
+    // the shortest period among bodies bound to their strongest attractor, infinite for large or unbound systems,
+    // which are then left at their usual step
+    static double shortestPeriod(const BodyStore& bodies, double G) {
+        double shortest = std::numeric_limits<double>::infinity();
+        if (bodies.size() > 64) return shortest;
+
+        for (size_t i = 0; i < bodies.size(); i++) {
+            size_t attractor = i;
+            double strongest = 0;
+            for (size_t j = 0; j < bodies.size(); j++) {
+                if (j == i) continue;
+
+                glm::dvec3 r = bodies.position(j) - bodies.position(i);
+                double pull = bodies.mass[j] / glm::dot(r, r);
+                if (pull > strongest) {
+                    strongest = pull;
+                    attractor = j;
+                }
+            }
+            if (attractor == i) continue;
+
+            glm::dvec3 r = bodies.position(i) - bodies.position(attractor);
+            glm::dvec3 v = bodies.velocity(i) - bodies.velocity(attractor);
+            double mu = G * (bodies.mass[i] + bodies.mass[attractor]);
+            double alpha = 2 / glm::length(r) - glm::dot(v, v) / mu;
+            if (alpha <= 0) continue;
+
+            shortest = std::min(shortest, glm::two_pi<double>() / (std::sqrt(mu) * alpha * std::sqrt(alpha)));
+        }
+        return shortest;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    void plan(Simulation& simulation, double requested) {
+        bool fixed_steps = simulation.mode == SteppingMode::Symplectic || simulation.mode == SteppingMode::WisdomHolman;
+        bool can_coast = allow_coasting && simulation.force_model == ForceModelKind::PointMass && simulation.bodies.size() >= 2;
+
+        // steps the budget holds, unknown until a step has been timed, and never more than a frame may take
+        double affordable = seconds_per_step > 0 ? budget / seconds_per_step : std::numeric_limits<double>::infinity();
+        affordable = std::min(affordable, double(simulation.max_steps_per_frame));
+
+        if (!fixed_steps) {
+            // the adaptive schemes pick their own steps, they are judged by the mean step of the last frames
+            bool fits = mean_step <= 0 || requested / mean_step <= affordable;
+            strategy = fits ? WarpStrategy::Full : (can_coast ? WarpStrategy::Coasting : WarpStrategy::Dilated);
+            return;
+        }
+
+        double needed = requested / simulation.fixed_dt;
+        if (needed <= affordable) {
+            simulation.stride = 1;
+            strategy = WarpStrategy::Full;
+            return;
+        }
+
+        double period = shortestPeriod(simulation.bodies, simulation.gravity.G);
+        double longest = std::min(double(max_stride), std::max(1.0, std::floor(period / steps_per_orbit / simulation.fixed_dt)));
+        int stride = int(std::min(longest, std::ceil(needed / affordable)));
+
+        if (needed / stride <= affordable) {
+            simulation.stride = stride;
+            strategy = stride > 1 ? WarpStrategy::LargerSteps : WarpStrategy::Full;
+        } else if (can_coast) {
+            simulation.stride = 1;
+            strategy = WarpStrategy::Coasting;
+        } else {
+            simulation.stride = stride;
+            strategy = WarpStrategy::Dilated;
+        }
+    }
+};
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "body_store.h"
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+// Per-body 6x6 state transition matrix d(state(t)) / d(state(t0)), state = (position, velocity).
+// It is carried through the symplectic kicks and drifts as their tangent map:
+//     drift: Phi_r += h Phi_v
+//     kick:  Phi_v += h T(r) Phi_r
+// with T the gravity gradient of all other bodies, which makes the propagated matrix exactly symplectic.
+// Each body's matrix treats the other bodies as moving on their nominal paths. That is an approximation
+// holding while the body is light next to what it orbits: it drops the (1 + m / M) coupling of a pair,
+// about 1.2% for the Moon around the Earth.
+//
+// Storage is element-major, phi[row * 6 + column][body], so every update is a plain loop over bodies.
+class StateTransition {
+public:
+    double G = 1;
+    double softening = 0;
+
+    std::array<std::vector<double>, 36> phi;
+
+    void reset(size_t body_count) {
+        for (int row = 0; row < 6; row++) {
+            for (int column = 0; column < 6; column++) {
+                phi[row * 6 + column].assign(body_count, row == column ? 1.0 : 0.0);
+            }
+        }
+    }
+
+    size_t size() const {
+        return phi[0].size();
+    }
+
+    void drift(double h) {
+        size_t n = size();
+
+        for (int row = 0; row < 3; row++) {
+            for (int column = 0; column < 6; column++) {
+                double* position_row = phi[row * 6 + column].data();
+                const double* velocity_row = phi[(row + 3) * 6 + column].data();
+
+                for (size_t i = 0; i < n; i++) position_row[i] += h * velocity_row[i];
+            }
+        }
+    }
+
+    void kick(const BodyStore& bodies, double h) {
+        size_t n = size();
+        computeGravityGradients(bodies);
+
+        // symmetric T stored as xx, xy, xz, yy, yz, zz
+        const int t_index[3][3] = {{0, 1, 2}, {1, 3, 4}, {2, 4, 5}};
+
+        for (int column = 0; column < 6; column++) {
+            for (int row = 0; row < 3; row++) {
+                double* velocity_row = phi[(row + 3) * 6 + column].data();
+
+                const double* t0 = gradient[t_index[row][0]].data();
+                const double* t1 = gradient[t_index[row][1]].data();
+                const double* t2 = gradient[t_index[row][2]].data();
+
+                const double* r0 = phi[0 * 6 + column].data();
+                const double* r1 = phi[1 * 6 + column].data();
+                const double* r2 = phi[2 * 6 + column].data();
+
+                for (size_t i = 0; i < n; i++) {
+                    velocity_row[i] += h * (t0[i] * r0[i] + t1[i] * r1[i] + t2[i] * r2[i]);
+                }
+            }
+        }
+    }
+
+    glm::dmat3 block(size_t body, int row_offset, int column_offset) const {
+        glm::dmat3 result;
+        for (int row = 0; row < 3; row++) {
+            for (int column = 0; column < 3; column++) {
+                // glm matrices are indexed [column][row]
+                result[column][row] = phi[(row + row_offset) * 6 + column + column_offset][body];
+            }
+        }
+        return result;
+    }
+
+    // position covariance at the current time from a diagonal initial covariance at the epoch,
+    // P = Phi P0 Phi^T restricted to the position rows
+    glm::dmat3 positionCovariance(size_t body, double position_sigma, double velocity_sigma) const {
+        glm::dmat3 phi_rr = block(body, 0, 0);
+        glm::dmat3 phi_rv = block(body, 0, 3);
+
+        return position_sigma * position_sigma * phi_rr * glm::transpose(phi_rr)
+             + velocity_sigma * velocity_sigma * phi_rv * glm::transpose(phi_rv);
+    }
+
+private:
+    std::array<std::vector<double>, 6> gradient;
+
+    // d(acceleration) / d(position) of every body, G m (3 r r^T - r^2 I) / r^5 summed over the others
+    void computeGravityGradients(const BodyStore& bodies) {
+        size_t n = bodies.size();
+        double eps2 = softening * softening;
+
+        for (auto& component : gradient) component.assign(n, 0.0);
+
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = i + 1; j < n; j++) {
+                double dx = bodies.x[j] - bodies.x[i];
+                double dy = bodies.y[j] - bodies.y[i];
+                double dz = bodies.z[j] - bodies.z[i];
+
+                double r2 = dx * dx + dy * dy + dz * dz + eps2;
+                double inv_r = 1.0 / std::sqrt(r2);
+                double inv_r3 = G * inv_r * inv_r * inv_r;
+                double inv_r5 = inv_r3 * inv_r * inv_r;
+
+                double t[6] = {
+                    3 * dx * dx * inv_r5 - inv_r3,
+                    3 * dx * dy * inv_r5,
+                    3 * dx * dz * inv_r5,
+                    3 * dy * dy * inv_r5 - inv_r3,
+                    3 * dy * dz * inv_r5,
+                    3 * dz * dz * inv_r5 - inv_r3
+                };
+
+                // the tensor is even in the separation, so both bodies see the same shape
+                for (int k = 0; k < 6; k++) {
+                    gradient[k][i] += bodies.mass[j] * t[k];
+                    gradient[k][j] += bodies.mass[i] * t[k];
+                }
+            }
+        }
+    }
+};
+
+// Eigen decomposition of a symmetric 3x3 matrix by cyclic Jacobi rotations.
+// Columns of vectors are the eigenvectors matching values.
+inline void symmetricEigen(const glm::dmat3& matrix, glm::dmat3& vectors, glm::dvec3& values) {
+    glm::dmat3 a = matrix;
+    vectors = glm::dmat3(1);
+
+    for (int sweep = 0; sweep < 50; sweep++) {
+        double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+        if (off < 1e-30 * (a[0][0] * a[0][0] + a[1][1] * a[1][1] + a[2][2] * a[2][2]) || off == 0) break;
+
+        for (int p = 0; p < 2; p++) {
+            for (int q = p + 1; q < 3; q++) {
+                if (a[p][q] == 0) continue;
+
+                double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+                double t = (theta >= 0 ? 1 : -1) / (std::abs(theta) + std::sqrt(theta * theta + 1));
+                double c = 1 / std::sqrt(t * t + 1);
+                double s = t * c;
+
+                glm::dmat3 rotation(1);
+                rotation[p][p] = c; rotation[q][q] = c;
+                rotation[q][p] = s; rotation[p][q] = -s;
+
+                a = glm::transpose(rotation) * a * rotation;
+                vectors = vectors * rotation;
+            }
+        }
+    }
+
+    values = glm::dvec3(a[0][0], a[1][1], a[2][2]);
+}
+
+// model transform of the n-sigma ellipsoid of a position covariance, for a unit sphere mesh
+inline glm::mat4 covarianceEllipsoidTransform(glm::vec3 center, const glm::dmat3& covariance, double sigmas) {
+    glm::dmat3 axes;
+    glm::dvec3 variances;
+    symmetricEigen(covariance, axes, variances);
+
+    glm::dmat3 scaled;
+    for (int k = 0; k < 3; k++) scaled[k] = axes[k] * (sigmas * std::sqrt(std::max(variances[k], 0.0)));
+
+    glm::mat4 transform = glm::mat4(glm::mat3(scaled));
+    transform[3] = glm::vec4(center, 1);
+
+    return transform;
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "body_store.h"
+#include "kepler.h"
+#include "time_base.h"
+
+#include <glm/glm.hpp>
+
+#include <cmath>
+#include <vector>
+
+// Wisdom-Holman mixed-variable symplectic map in Jacobi coordinates.
+// The Hamiltonian is split into Keplerian motion of every Jacobi body around the mass interior to it,
+// solved analytically, and the remaining interaction, applied as a kick:
+//     drift(h / 2) kick(h) drift(h / 2)
+// Jacobi order follows the body order, so the innermost pair must come first
+// (Earth, Moon, Sun, outer planets keeps the lunar orbit Earth-relative).
+class WisdomHolman {
+public:
+    template<class Forces>
+    void step(BodyStore& bodies, double G, double h, Forces& forces) {
+        DoubleDouble t0 = forces.time;
+        toJacobi(bodies);
+
+        keplerDrift(G, h / 2);
+
+        // the kick sits in the middle of the step
+        fromJacobi(bodies);
+        forces.time = t0 + h / 2;
+        forces.computeAccelerations(bodies);
+        interactionKick(bodies, G, h);
+
+        keplerDrift(G, h / 2);
+
+        fromJacobi(bodies);
+        bodies.accelerations_valid = false;
+        forces.time = t0 + h;
+    }
+
+    // Keplerian part alone over h, every Jacobi body on a fixed conic around the mass interior to it
+    void drift(BodyStore& bodies, double G, double h) {
+        toJacobi(bodies);
+        keplerDrift(G, h);
+        fromJacobi(bodies);
+        bodies.accelerations_valid = false;
+    }
+
+private:
+    std::vector<glm::dvec3> jacobi_r, jacobi_v;
+    // eta[i] is the mass of bodies 0 .. i
+    std::vector<double> eta;
+
+    void toJacobi(const BodyStore& bodies) {
+        size_t n = bodies.size();
+        jacobi_r.resize(n);
+        jacobi_v.resize(n);
+        eta.resize(n);
+        if (n == 0) return;
+
+        glm::dvec3 weighted_r = bodies.mass[0] * bodies.position(0);
+        glm::dvec3 weighted_v = bodies.mass[0] * bodies.velocity(0);
+        eta[0] = bodies.mass[0];
+
+        for (size_t i = 1; i < n; i++) {
+            jacobi_r[i] = bodies.position(i) - weighted_r / eta[i - 1];
+            jacobi_v[i] = bodies.velocity(i) - weighted_v / eta[i - 1];
+
+            weighted_r += bodies.mass[i] * bodies.position(i);
+            weighted_v += bodies.mass[i] * bodies.velocity(i);
+            eta[i] = eta[i - 1] + bodies.mass[i];
+        }
+
+        // slot 0 holds the center of mass
+        jacobi_r[0] = weighted_r / eta[n - 1];
+        jacobi_v[0] = weighted_v / eta[n - 1];
+    }
+
+    void fromJacobi(BodyStore& bodies) const {
+        size_t n = bodies.size();
+
+        // nothing to peel off, a lone body is the center of mass
+        if (n < 2) {
+            if (n == 1) {
+                bodies.setPosition(0, jacobi_r[0]);
+                bodies.setVelocity(0, jacobi_v[0]);
+            }
+            return;
+        }
+
+        // walk outwards in, peeling one body at a time off the interior center of mass
+        glm::dvec3 interior_r = jacobi_r[0];
+        glm::dvec3 interior_v = jacobi_v[0];
+
+        for (size_t i = n - 1; i >= 1; i--) {
+            interior_r -= bodies.mass[i] / eta[i] * jacobi_r[i];
+            interior_v -= bodies.mass[i] / eta[i] * jacobi_v[i];
+
+            bodies.setPosition(i, interior_r + jacobi_r[i]);
+            bodies.setVelocity(i, interior_v + jacobi_v[i]);
+        }
+
+        bodies.setPosition(0, interior_r);
+        bodies.setVelocity(0, interior_v);
+    }
+
+    void keplerDrift(double G, double h) {
+        if (jacobi_r.empty()) return;
+        jacobi_r[0] += h * jacobi_v[0];
+
+        for (size_t i = 1; i < jacobi_r.size(); i++) {
+            auto state = propagateKepler(jacobi_r[i], jacobi_v[i], G * eta[i], h);
+            jacobi_r[i] = state.position;
+            jacobi_v[i] = state.velocity;
+        }
+    }
+
+    // Jacobi acceleration of the full system minus the Keplerian part already handled by the drift
+    void interactionKick(const BodyStore& bodies, double G, double h) {
+        glm::dvec3 weighted_a = bodies.mass[0] * bodies.acceleration(0);
+
+        for (size_t i = 1; i < jacobi_r.size(); i++) {
+            glm::dvec3 jacobi_a = bodies.acceleration(i) - weighted_a / eta[i - 1];
+            weighted_a += bodies.mass[i] * bodies.acceleration(i);
+
+            double r = glm::length(jacobi_r[i]);
+            glm::dvec3 kepler_a = -G * eta[i] / (r * r * r) * jacobi_r[i];
+
+            jacobi_v[i] += h * (jacobi_a - kepler_a);
+        }
+    }
+};
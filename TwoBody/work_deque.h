@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Chase-Lev work-stealing deque of pointers (Chase & Lev 2005, with the memory orders of Le et al. 2013).
+// One owner thread pushes and pops at the bottom, any other thread steals from the top, and only a pop racing a
+// steal for the last item needs a compare-and-swap. The ring doubles when full; the old rings are kept until the
+// deque is destroyed, since a thief may still be reading one.
+template<class T>
+class WorkDeque {
+public:
+    WorkDeque() : top(0), bottom(0) {
+        rings.push_back(std::make_unique<Ring>(64));
+        ring.store(rings.back().get(), std::memory_order_relaxed);
+    }
+
+    WorkDeque(const WorkDeque&) = delete;
+    WorkDeque& operator=(const WorkDeque&) = delete;
+
+    // owner only
+    void push(T* item) {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        Ring* current = ring.load(std::memory_order_relaxed);
+        if (b - t >= current->capacity) current = grow(current, t, b);
+
+        current->put(b, item);
+        bottom.store(b + 1, std::memory_order_release);
+    }
+
+    // owner only, the most recently pushed item or null
+    T* pop() {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        Ring* current = ring.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+
+        T* item = current->get(b);
+        if (t == b) {
+            // the last item, a thief may be taking it at the same time
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) item = nullptr;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // any thread, the oldest item or null when empty or lost to another thief
+    T* steal() {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) return nullptr;
+
+        T* item = ring.load(std::memory_order_acquire)->get(t);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) return nullptr;
+        return item;
+    }
+
+    // exact for the owner, a hint for anyone else
+    bool empty() const {
+        return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Ring {
+        int64_t capacity;
+        std::unique_ptr<std::atomic<T*>[]> items;
+
+        explicit Ring(int64_t capacity) : capacity(capacity), items(new std::atomic<T*>[size_t(capacity)]) {
+        }
+
+        T* get(int64_t i) const {
+            return items[size_t(i & (capacity - 1))].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t i, T* item) {
+            items[size_t(i & (capacity - 1))].store(item, std::memory_order_relaxed);
+        }
+    };
+
+    // top and bottom on their own cache lines, thieves hammer the first and the owner the second
+    alignas(64) std::atomic<int64_t> top;
+    alignas(64) std::atomic<int64_t> bottom;
+    alignas(64) std::atomic<Ring*> ring;
+    std::vector<std::unique_ptr<Ring>> rings;
+
+    Ring* grow(Ring* old, int64_t t, int64_t b) {
+        rings.push_back(std::make_unique<Ring>(2 * old->capacity));
+        Ring* bigger = rings.back().get();
+        for (int64_t i = t; i < b; i++) bigger->put(i, old->get(i));
+        ring.store(bigger, std::memory_order_release);
+        return bigger;
+    }
+};